@@ -0,0 +1,378 @@
+#pragma once
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include "miniz.h"
+
+// Reader for Skyrim archives: version 104 (LE, zlib) and 105 (SE, LZ4 frame).
+// Open reads only the header and the folder records. A lookup binary-searches
+// the folder hashes, then reads that one folder's file records, so finding an
+// entry costs two small reads however large the archive is.
+class BsaArchive
+{
+public:
+	enum
+	{
+		FlagDirectoryNames = 0x1,
+		FlagCompressed = 0x4,
+		FlagEmbedNames = 0x100,
+		SizeCompressToggle = 0x40000000
+	};
+
+	BsaArchive() : Version_(0), Flags_(0), TotalFileNameLength_(0) {}
+
+	bool Open(const std::string& Path)
+	{
+		Folders_.clear();
+		File_.close();
+		File_.clear();
+		File_.open(Path.c_str(), std::ios::binary);
+		if (!File_.is_open())
+			return false;
+
+		uint8_t Header[36];
+		if (!File_.read(reinterpret_cast<char*>(Header), sizeof(Header)) || std::memcmp(Header, "BSA\0", 4) != 0)
+			return false;
+
+		uint32_t FolderOffset, FolderCount;
+		std::memcpy(&Version_, Header + 4, 4);
+		std::memcpy(&FolderOffset, Header + 8, 4);
+		std::memcpy(&Flags_, Header + 12, 4);
+		std::memcpy(&FolderCount, Header + 16, 4);
+		std::memcpy(&TotalFileNameLength_, Header + 28, 4);
+
+		if (Version_ != 104 && Version_ != 105)
+			return false;
+
+		const size_t RecordSize = Version_ == 105 ? 24 : 16;
+		std::vector<uint8_t> Records(static_cast<size_t>(FolderCount) * RecordSize);
+
+		File_.seekg(FolderOffset);
+		if (!Records.empty() && !File_.read(reinterpret_cast<char*>(Records.data()), Records.size()))
+			return false;
+
+		Folders_.resize(FolderCount);
+		for (uint32_t i = 0; i < FolderCount; ++i)
+		{
+			const uint8_t* R = Records.data() + i * RecordSize;
+			Folder& F = Folders_[i];
+			std::memcpy(&F.Hash, R, 8);
+			std::memcpy(&F.Count, R + 8, 4);
+
+			if (Version_ == 105)
+			{
+				std::memcpy(&F.Offset, R + 16, 8);
+			}
+			else
+			{
+				uint32_t Offset;
+				std::memcpy(&Offset, R + 12, 4);
+				F.Offset = Offset;
+			}
+		}
+		return true;
+	}
+
+	uint32_t GetVersion() const
+	{
+		return Version_;
+	}
+
+	bool Contains(const std::string& Path)
+	{
+		FileRecord Rec;
+		return FindFile(Path, Rec);
+	}
+
+	// Reads and, if needed, decompresses one entry, e.g. "strings\\mod_english.strings".
+	bool Extract(const std::string& Path, std::vector<uint8_t>& Out)
+	{
+		FileRecord Rec;
+		if (!FindFile(Path, Rec))
+			return false;
+
+		bool Compressed = ((Flags_ & FlagCompressed) != 0) != ((Rec.Size & SizeCompressToggle) != 0);
+		uint32_t Size = Rec.Size & ~(SizeCompressToggle | 0x80000000u);
+
+		File_.clear();
+		File_.seekg(Rec.Offset);
+
+		if (Flags_ & FlagEmbedNames)
+		{
+			uint8_t NameLength = 0;
+			if (!File_.read(reinterpret_cast<char*>(&NameLength), 1) || Size < 1u + NameLength)
+				return false;
+
+			File_.seekg(NameLength, std::ios::cur);
+			Size -= 1 + NameLength;
+		}
+
+		if (!Compressed)
+		{
+			Out.resize(Size);
+			return Size == 0 || static_cast<bool>(File_.read(reinterpret_cast<char*>(Out.data()), Size));
+		}
+
+		uint32_t OriginalSize = 0;
+		if (Size < 4 || !File_.read(reinterpret_cast<char*>(&OriginalSize), 4))
+			return false;
+
+		std::vector<uint8_t> Packed(Size - 4);
+		if (!Packed.empty() && !File_.read(reinterpret_cast<char*>(Packed.data()), Packed.size()))
+			return false;
+
+		Out.resize(OriginalSize);
+		if (Version_ == 105)
+			return Lz4FrameDecompress(Packed.data(), Packed.size(), Out.data(), Out.size());
+
+		return tinfl_decompress_mem_to_mem(Out.data(), Out.size(), Packed.data(), Packed.size(), TINFL_FLAG_PARSE_ZLIB_HEADER) == OriginalSize;
+	}
+
+	// The archive name hash. Name is lower case with backslashes; Extension
+	// includes the dot and is empty for folders.
+	static uint64_t Hash(const std::string& Name, const std::string& Extension)
+	{
+		const size_t Length = Name.size();
+		const uint8_t* S = reinterpret_cast<const uint8_t*>(Name.data());
+
+		uint64_t Result = 0;
+		if (Length > 0)
+		{
+			Result = static_cast<uint64_t>(S[Length - 1])
+				| (static_cast<uint64_t>(Length > 2 ? S[Length - 2] : 0) << 8)
+				| (static_cast<uint64_t>(Length) << 16)
+				| (static_cast<uint64_t>(S[0]) << 24);
+		}
+
+		if (Extension == ".kf") Result |= 0x80;
+		else if (Extension == ".nif") Result |= 0x8000;
+		else if (Extension == ".dds") Result |= 0x8080;
+		else if (Extension == ".wav") Result |= 0x80000000;
+
+		uint32_t Middle = 0;
+		for (size_t i = 1; i + 2 < Length; ++i)
+		{
+			Middle = Middle * 0x1003F + S[i];
+		}
+
+		uint32_t Tail = 0;
+		for (size_t i = 0; i < Extension.size(); ++i)
+		{
+			Tail = Tail * 0x1003F + static_cast<uint8_t>(Extension[i]);
+		}
+
+		return Result + (static_cast<uint64_t>(Middle + Tail) << 32);
+	}
+
+	// Decodes an LZ4 frame into a buffer of the known original size.
+	static bool Lz4FrameDecompress(const uint8_t* Src, size_t SrcSize, uint8_t* Dst, size_t DstSize)
+	{
+		if (SrcSize < 7)
+			return false;
+
+		uint32_t Magic;
+		std::memcpy(&Magic, Src, 4);
+		if (Magic != 0x184D2204)
+			return false;
+
+		const uint8_t Flags = Src[4];
+		size_t Pos = 7;
+		if (Flags & 0x08) Pos += 8; // content size
+		if (Flags & 0x01) Pos += 4; // dictionary id
+
+		const bool BlockChecksum = (Flags & 0x10) != 0;
+		size_t Written = 0;
+
+		while (Pos + 4 <= SrcSize)
+		{
+			uint32_t BlockSize;
+			std::memcpy(&BlockSize, Src + Pos, 4);
+			Pos += 4;
+
+			if (BlockSize == 0)
+				break;
+
+			const bool Stored = (BlockSize & 0x80000000u) != 0;
+			BlockSize &= 0x7FFFFFFF;
+			if (BlockSize > SrcSize - Pos)
+				return false;
+
+			if (Stored)
+			{
+				if (BlockSize > DstSize - Written)
+					return false;
+
+				std::memcpy(Dst + Written, Src + Pos, BlockSize);
+				Written += BlockSize;
+			}
+			else if (!Lz4BlockDecompress(Src + Pos, BlockSize, Dst, DstSize, Written))
+			{
+				return false;
+			}
+
+			Pos += BlockSize + (BlockChecksum ? 4 : 0);
+		}
+
+		return Written == DstSize;
+	}
+
+private:
+	struct Folder
+	{
+		uint64_t Hash;
+		uint32_t Count;
+		uint64_t Offset;
+	};
+
+	struct FileRecord
+	{
+		uint64_t Hash;
+		uint32_t Size;
+		uint32_t Offset;
+	};
+
+	std::ifstream File_;
+	uint32_t Version_;
+	uint32_t Flags_;
+	uint32_t TotalFileNameLength_;
+	std::vector<Folder> Folders_;
+
+	BsaArchive(const BsaArchive&);
+	BsaArchive& operator=(const BsaArchive&);
+
+	bool FindFile(const std::string& Path, FileRecord& Out)
+	{
+		std::string Key = Path;
+		for (size_t i = 0; i < Key.size(); ++i)
+		{
+			if (Key[i] == '/') Key[i] = '\\';
+			Key[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(Key[i])));
+		}
+
+		size_t Slash = Key.find_last_of('\\');
+		std::string FolderName = Slash == std::string::npos ? std::string() : Key.substr(0, Slash);
+		std::string FileName = Slash == std::string::npos ? Key : Key.substr(Slash + 1);
+
+		size_t Dot = FileName.find_last_of('.');
+		std::string Stem = Dot == std::string::npos ? FileName : FileName.substr(0, Dot);
+		std::string Extension = Dot == std::string::npos ? std::string() : FileName.substr(Dot);
+
+		// Folder records are sorted by hash.
+		const uint64_t FolderHash = Hash(FolderName, "");
+		size_t Low = 0, High = Folders_.size();
+		while (Low < High)
+		{
+			size_t Mid = (Low + High) / 2;
+			if (Folders_[Mid].Hash < FolderHash) Low = Mid + 1;
+			else High = Mid;
+		}
+		if (Low == Folders_.size() || Folders_[Low].Hash != FolderHash)
+			return false;
+
+		const Folder& F = Folders_[Low];
+
+		// The stored offset counts the file name block as if it came first.
+		File_.clear();
+		File_.seekg(static_cast<std::streamoff>(F.Offset - TotalFileNameLength_));
+
+		if (Flags_ & FlagDirectoryNames)
+		{
+			uint8_t NameLength = 0;
+			if (!File_.read(reinterpret_cast<char*>(&NameLength), 1))
+				return false;
+			File_.seekg(NameLength, std::ios::cur);
+		}
+
+		std::vector<uint8_t> Records(static_cast<size_t>(F.Count) * 16);
+		if (!Records.empty() && !File_.read(reinterpret_cast<char*>(Records.data()), Records.size()))
+			return false;
+
+		const uint64_t FileHash = Hash(Stem, Extension);
+		Low = 0;
+		High = F.Count;
+		while (Low < High)
+		{
+			size_t Mid = (Low + High) / 2;
+			uint64_t MidHash;
+			std::memcpy(&MidHash, Records.data() + Mid * 16, 8);
+			if (MidHash < FileHash) Low = Mid + 1;
+			else High = Mid;
+		}
+		if (Low == F.Count)
+			return false;
+
+		const uint8_t* R = Records.data() + Low * 16;
+		std::memcpy(&Out.Hash, R, 8);
+		std::memcpy(&Out.Size, R + 8, 4);
+		std::memcpy(&Out.Offset, R + 12, 4);
+		return Out.Hash == FileHash;
+	}
+
+	static bool Lz4BlockDecompress(const uint8_t* Src, size_t SrcSize, uint8_t* Dst, size_t DstSize, size_t& Written)
+	{
+		size_t Pos = 0;
+		while (Pos < SrcSize)
+		{
+			const uint8_t Token = Src[Pos++];
+
+			size_t Literals = Token >> 4;
+			if (Literals == 15)
+			{
+				uint8_t More;
+				do
+				{
+					if (Pos >= SrcSize) return false;
+					More = Src[Pos++];
+					Literals += More;
+				} while (More == 255);
+			}
+
+			if (Literals > SrcSize - Pos || Literals > DstSize - Written)
+				return false;
+
+			std::memcpy(Dst + Written, Src + Pos, Literals);
+			Pos += Literals;
+			Written += Literals;
+
+			// The last sequence has literals only.
+			if (Pos == SrcSize)
+				break;
+
+			if (Pos + 2 > SrcSize)
+				return false;
+
+			const size_t Distance = Src[Pos] | (Src[Pos + 1] << 8);
+			Pos += 2;
+			if (Distance == 0 || Distance > Written)
+				return false;
+
+			size_t Match = (Token & 0x0F) + 4;
+			if ((Token & 0x0F) == 15)
+			{
+				uint8_t More;
+				do
+				{
+					if (Pos >= SrcSize) return false;
+					More = Src[Pos++];
+					Match += More;
+				} while (More == 255);
+			}
+
+			if (Match > DstSize - Written)
+				return false;
+
+			// Byte by byte: the match may overlap what it is copying.
+			const uint8_t* From = Dst + Written - Distance;
+			for (size_t i = 0; i < Match; ++i)
+			{
+				Dst[Written + i] = From[i];
+			}
+			Written += Match;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,190 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include "SlotMap.h"
+
+// Sorted EditorID -> record index over every record of the plugin with an
+// EDID, whether the filter kept it or not. An entry names its record by
+// FormID and signature; only a record the document stores has a handle.
+// EditorIDs are case-insensitive in the game, so keys are stored lowercase.
+// Supports exact, prefix ("DLC2") and glob ("MQ10?*Book") lookups.
+class EditorIDIndex
+{
+public:
+	struct Entry
+	{
+		std::string Key;
+		uint32_t FormID;
+		std::string Sig;
+		int64_t SourceOffset;
+		EspHandle Handle;
+
+		bool operator<(const Entry& Other) const
+		{
+			return Key < Other.Key;
+		}
+	};
+
+private:
+	std::vector<Entry> Entries_;
+	bool Sorted_;
+
+	// First entry whose key is not less than Key.
+	std::vector<Entry>::const_iterator LowerBound(const std::string& Key) const
+	{
+		return std::lower_bound(Entries_.begin(), Entries_.end(), Key,
+			[](const Entry& E, const std::string& K) { return E.Key < K; });
+	}
+
+public:
+	static std::string ToLower(const std::string& Str)
+	{
+		std::string Result = Str;
+		for (size_t i = 0; i < Result.size(); ++i)
+		{
+			Result[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(Result[i])));
+		}
+		return Result;
+	}
+
+	// '*' matches any run of characters, '?' exactly one.
+	static bool GlobMatch(const char* Pattern, const char* Text)
+	{
+		const char* StarPattern = NULL;
+		const char* StarText = NULL;
+
+		while (*Text)
+		{
+			if (*Pattern == '?' || *Pattern == *Text)
+			{
+				++Pattern;
+				++Text;
+			}
+			else if (*Pattern == '*')
+			{
+				StarPattern = Pattern++;
+				StarText = Text;
+			}
+			else if (StarPattern)
+			{
+				Pattern = StarPattern + 1;
+				Text = ++StarText;
+			}
+			else
+			{
+				return false;
+			}
+		}
+
+		while (*Pattern == '*')
+			++Pattern;
+
+		return *Pattern == '\0';
+	}
+
+	EditorIDIndex() : Sorted_(true) {}
+
+	void Add(const std::string& EditorID, uint32_t FormID, const std::string& Sig, int64_t SourceOffset)
+	{
+		if (EditorID.empty())
+			return;
+
+		Entry E;
+		E.Key = ToLower(EditorID);
+		E.FormID = FormID;
+		E.Sig = Sig;
+		E.SourceOffset = SourceOffset;
+		E.Handle = INVALID_ESP_HANDLE;
+		Entries_.push_back(E);
+		Sorted_ = false;
+	}
+
+	// Must be called after the last Add and before querying. HandleOf gives
+	// the handle of the stored record an entry names, or INVALID_ESP_HANDLE.
+	template <typename HandleOfFn>
+	void Build(HandleOfFn HandleOf)
+	{
+		if (!Sorted_)
+		{
+			std::stable_sort(Entries_.begin(), Entries_.end());
+			Sorted_ = true;
+		}
+
+		for (size_t i = 0; i < Entries_.size(); ++i)
+		{
+			Entries_[i].Handle = HandleOf(Entries_[i]);
+		}
+	}
+
+	void Clear()
+	{
+		Entries_.clear();
+		Sorted_ = true;
+	}
+
+	size_t Size() const
+	{
+		return Entries_.size();
+	}
+
+	const std::vector<Entry>& GetEntries() const
+	{
+		return Entries_;
+	}
+
+	// The first entry with this EditorID, or NULL.
+	const Entry* FindExact(const std::string& EditorID) const
+	{
+		std::string Key = ToLower(EditorID);
+		std::vector<Entry>::const_iterator It = LowerBound(Key);
+		if (It != Entries_.end() && It->Key == Key)
+		{
+			return &*It;
+		}
+		return NULL;
+	}
+
+	void FindPrefix(const std::string& Prefix, std::vector<const Entry*>& Out) const
+	{
+		std::string Key = ToLower(Prefix);
+		for (std::vector<Entry>::const_iterator It = LowerBound(Key); It != Entries_.end(); ++It)
+		{
+			if (It->Key.compare(0, Key.size(), Key) != 0)
+				break;
+
+			Out.push_back(&*It);
+		}
+	}
+
+	void FindGlob(const std::string& Pattern, std::vector<const Entry*>& Out) const
+	{
+		std::string Lower = ToLower(Pattern);
+
+		// Only the part in front of the first wildcard narrows the range.
+		size_t Wild = Lower.find_first_of("*?");
+		if (Wild == std::string::npos)
+		{
+			const Entry* Match = FindExact(Lower);
+			if (Match)
+			{
+				Out.push_back(Match);
+			}
+			return;
+		}
+
+		std::string Prefix = Lower.substr(0, Wild);
+		for (std::vector<Entry>::const_iterator It = LowerBound(Prefix); It != Entries_.end(); ++It)
+		{
+			if (It->Key.compare(0, Prefix.size(), Prefix) != 0)
+				break;
+
+			if (GlobMatch(Lower.c_str(), It->Key.c_str()))
+			{
+				Out.push_back(&*It);
+			}
+		}
+	}
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include <mutex>
+#include <string>
+#include <memory>
+#include <vector>
+#include "EspRecord.h"
+#include "EspSnapshot.h"
+
+// One loaded plugin together with the filter and strings used to read it.
+// Contexts share no state with each other, so separate threads can each
+// drive their own context. Calls on the same context are serialized by Lock.
+//
+// Data is the writer's copy and is only touched under Lock. Readers go
+// through PinSnapshot instead, which never takes Lock: every load and edit
+// publishes a new immutable EspSnapshot, and a pinned one stays valid until
+// released. Snapshots share Data's record chunks, so publishing one copies
+// no records.
+//
+// Pointers the handle and offset lookups return point into Data, not into a
+// snapshot. They are outside that isolation: use them under the caller's own
+// ordering, and only until the next edit or load on the context.
+class EspContext
+{
+public:
+	RecordFilter* Filter;
+	StringsManager* Strings;
+	EspData* Data;
+	std::wstring LastSetPath;
+	// Copy of the plugin when it was read from memory (LastSetPath is empty then).
+	std::shared_ptr<const std::vector<uint8_t> > SourceBytes;
+
+	// Backing store for the const char* handed out by C_Ctx_SubRecordData_GetString.
+	// Valid until the next call on the same context.
+	std::string StringBuffer;
+
+	std::mutex Lock;
+
+	EspContext()
+		: Filter(new RecordFilter()), Strings(new StringsManager()), Data(NULL), SnapshotVersion_(0)
+	{
+	}
+
+	~EspContext()
+	{
+		delete Data;
+		delete Strings;
+		delete Filter;
+	}
+
+	void ClearData()
+	{
+		delete Data;
+		Data = NULL;
+
+		LastSetPath.clear();
+		SourceBytes.reset();
+		PublishSnapshot();
+	}
+
+	// Safe to call from any thread; never blocks on Lock.
+	std::shared_ptr<const EspSnapshot> PinSnapshot() const
+	{
+		return std::atomic_load(&Current_);
+	}
+
+	// Publishes Data and Strings as the current snapshot, or none when there is
+	// no document. Call under Lock at the end of every load, clear and strings
+	// load.
+	void PublishSnapshot()
+	{
+		std::shared_ptr<const EspSnapshot> Snap;
+		if (Data)
+		{
+			Snap = EspSnapshot::Build(*Data, Strings->CopyCurrentLanguage(), ++SnapshotVersion_);
+		}
+		std::atomic_store(&Current_, Snap);
+	}
+
+	// Publishes the records edited since the last snapshot; the strings are
+	// carried over. Call under Lock after editing records in Data.
+	void PublishEdits()
+	{
+		std::shared_ptr<const EspSnapshot> Prev = std::atomic_load(&Current_);
+		if (!Data || !Prev)
+		{
+			PublishSnapshot();
+			return;
+		}
+
+		std::atomic_store(&Current_, EspSnapshot::Build(*Data, Prev->Strings, ++SnapshotVersion_));
+	}
+
+private:
+	std::shared_ptr<const EspSnapshot> Current_;
+	uint64_t SnapshotVersion_;
+
+	EspContext(const EspContext&);
+	EspContext& operator=(const EspContext&);
+};
@@ -0,0 +1,383 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cctype>
+#include "EspRecord.h"
+
+// Composable predicates over (record, subrecord) pairs.
+// Record-level predicates (sig, FormID, flags, EditorID) ignore the subrecord;
+// subrecord-level ones (sub sig, localized, text, translatable) fail when there is none.
+class QueryNode
+{
+public:
+	enum NodeType
+	{
+		RecordSig,
+		SubSig,
+		FormIDRange,
+		HasFlags,
+		EditorIDPattern,
+		Localized,
+		TextContains,
+		Translatable,
+		And,
+		Or,
+		Not
+	};
+
+	NodeType Type;
+	std::string Text;
+	uint32_t Min;
+	uint32_t Max;
+	bool Value;
+	std::vector<std::shared_ptr<const QueryNode> > Children;
+
+	QueryNode(NodeType T) : Type(T), Min(0), Max(0), Value(true) {}
+
+	bool Match(const EspRecord& Rec, const SubRecordData* Sub, const StringsManager* Strings) const
+	{
+		switch (Type)
+		{
+		case RecordSig:
+			return Rec.Sig == Text;
+		case FormIDRange:
+			return Rec.FormID >= Min && Rec.FormID <= Max;
+		case HasFlags:
+			return (Rec.Flags & Min) == Min;
+		case EditorIDPattern:
+			return EditorIDIndex::GlobMatch(Text.c_str(), EditorIDIndex::ToLower(Rec.GetEditorID()).c_str());
+		case SubSig:
+			return Sub && Sub->Sig == Text;
+		case Localized:
+			return Sub && Sub->IsLocalized == Value;
+		case TextContains:
+			return Sub && ContainsNoCase(Sub->GetString(Strings), Text);
+		case Translatable:
+			return Sub && Rec.CanTranslateSub(Rec, *Sub) == Value;
+		case And:
+			for (size_t i = 0; i < Children.size(); ++i)
+			{
+				if (!Children[i]->Match(Rec, Sub, Strings))
+					return false;
+			}
+			return true;
+		case Or:
+			for (size_t i = 0; i < Children.size(); ++i)
+			{
+				if (Children[i]->Match(Rec, Sub, Strings))
+					return true;
+			}
+			return false;
+		case Not:
+			return !Children[0]->Match(Rec, Sub, Strings);
+		}
+		return false;
+	}
+
+	// Needle is already lowercase.
+	static bool ContainsNoCase(const std::string& Haystack, const std::string& Needle)
+	{
+		if (Needle.empty())
+			return true;
+
+		return std::search(Haystack.begin(), Haystack.end(), Needle.begin(), Needle.end(),
+			[](char A, char B) { return std::tolower(static_cast<unsigned char>(A)) == B; }) != Haystack.end();
+	}
+};
+
+// Value wrapper so predicates compose with &&, || and !.
+class QueryExpr
+{
+public:
+	std::shared_ptr<const QueryNode> Node;
+
+	QueryExpr() {}
+	explicit QueryExpr(const std::shared_ptr<const QueryNode>& N) : Node(N) {}
+
+	bool IsEmpty() const { return !Node; }
+
+	static QueryExpr RecordSig(const std::string& Sig)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::RecordSig);
+		N->Text = Sig.substr(0, 4);
+		return QueryExpr(N);
+	}
+
+	static QueryExpr SubSig(const std::string& Sig)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::SubSig);
+		N->Text = Sig.substr(0, 4);
+		return QueryExpr(N);
+	}
+
+	static QueryExpr FormIDRange(uint32_t Min, uint32_t Max)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::FormIDRange);
+		N->Min = Min;
+		N->Max = Max;
+		return QueryExpr(N);
+	}
+
+	// All bits of Mask must be set.
+	static QueryExpr HasFlags(uint32_t Mask)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::HasFlags);
+		N->Min = Mask;
+		return QueryExpr(N);
+	}
+
+	static QueryExpr EditorID(const std::string& GlobPattern)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::EditorIDPattern);
+		N->Text = EditorIDIndex::ToLower(GlobPattern);
+		return QueryExpr(N);
+	}
+
+	static QueryExpr Localized(bool IsLocalized)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::Localized);
+		N->Value = IsLocalized;
+		return QueryExpr(N);
+	}
+
+	static QueryExpr TextContains(const std::string& Needle)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::TextContains);
+		N->Text = EditorIDIndex::ToLower(Needle);
+		return QueryExpr(N);
+	}
+
+	static QueryExpr Translatable(bool CanTranslate)
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::Translatable);
+		N->Value = CanTranslate;
+		return QueryExpr(N);
+	}
+
+	static QueryExpr Combine(QueryNode::NodeType Type, const QueryExpr& A, const QueryExpr& B)
+	{
+		if (A.IsEmpty()) return B;
+		if (B.IsEmpty()) return A;
+
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(Type);
+		N->Children.push_back(A.Node);
+		N->Children.push_back(B.Node);
+		return QueryExpr(N);
+	}
+
+	QueryExpr operator!() const
+	{
+		std::shared_ptr<QueryNode> N = std::make_shared<QueryNode>(QueryNode::Not);
+		N->Children.push_back(Node);
+		return QueryExpr(N);
+	}
+};
+
+inline QueryExpr operator&&(const QueryExpr& A, const QueryExpr& B)
+{
+	return QueryExpr::Combine(QueryNode::And, A, B);
+}
+
+inline QueryExpr operator||(const QueryExpr& A, const QueryExpr& B)
+{
+	return QueryExpr::Combine(QueryNode::Or, A, B);
+}
+
+struct QueryMatch
+{
+	const EspRecord* Record;
+	const SubRecordData* Sub;
+};
+
+// Lazy query over Records then CellRecords. Nothing is evaluated until the
+// iterator is advanced, and results are pointers into the EspData, not copies.
+// Offset/Limit page through the matches: only offset + limit matches are
+// ever evaluated.
+//
+//   EspQuery Q(Doc);
+//   Q.Where(QueryExpr::RecordSig("WEAP") && QueryExpr::TextContains("sword")).Offset(50).Limit(50);
+//   for (EspQuery::Iterator It = Q.begin(); It != Q.end(); ++It) { ... It->Record ... }
+class EspQuery
+{
+public:
+	class Iterator
+	{
+	public:
+		Iterator() : Query_(NULL), Phase_(2), RecordIndex_(0), SubIndex_(0), Yielded_(0)
+		{
+			Current_.Record = NULL;
+			Current_.Sub = NULL;
+		}
+
+		explicit Iterator(const EspQuery* Query)
+			: Query_(Query), Phase_(0), RecordIndex_(0), SubIndex_(0), Yielded_(0)
+		{
+			Current_.Record = NULL;
+			Current_.Sub = NULL;
+
+			for (size_t i = 0; i < Query_->Offset_ && FindNext(); ++i)
+			{
+			}
+
+			Advance();
+		}
+
+		const QueryMatch& operator*() const { return Current_; }
+		const QueryMatch* operator->() const { return &Current_; }
+
+		Iterator& operator++()
+		{
+			Advance();
+			return *this;
+		}
+
+		bool operator==(const Iterator& Other) const { return IsEnd() == Other.IsEnd(); }
+		bool operator!=(const Iterator& Other) const { return !(*this == Other); }
+
+	private:
+		const EspQuery* Query_;
+		int Phase_;
+		size_t RecordIndex_;
+		size_t SubIndex_;
+		size_t Yielded_;
+		QueryMatch Current_;
+
+		bool IsEnd() const { return Phase_ >= 2; }
+
+		void Advance()
+		{
+			if (IsEnd())
+				return;
+
+			if (Query_->Limit_ != 0 && Yielded_ >= Query_->Limit_)
+			{
+				Phase_ = 2;
+				return;
+			}
+
+			if (FindNext())
+			{
+				Yielded_++;
+			}
+		}
+
+		const RecordStore& Vec() const
+		{
+			return Phase_ == 0 ? Query_->Doc_.Records : Query_->Doc_.CellRecords;
+		}
+
+		// Moves to the next match and stores it in Current_.
+		bool FindNext()
+		{
+			while (Phase_ < 2)
+			{
+				const RecordStore& Records = Vec();
+				if (RecordIndex_ >= Records.size())
+				{
+					Phase_++;
+					RecordIndex_ = 0;
+					SubIndex_ = 0;
+					continue;
+				}
+
+				const EspRecord& Rec = Records[RecordIndex_];
+
+				if (Rec.SubRecords.empty())
+				{
+					RecordIndex_++;
+					if (Query_->Matches(Rec, NULL))
+					{
+						Current_.Record = &Rec;
+						Current_.Sub = NULL;
+						return true;
+					}
+					continue;
+				}
+
+				while (SubIndex_ < Rec.SubRecords.size())
+				{
+					const SubRecordData& Sub = Rec.SubRecords[SubIndex_++];
+					if (Query_->Matches(Rec, &Sub))
+					{
+						Current_.Record = &Rec;
+						Current_.Sub = &Sub;
+
+						// One hit per record unless every subrecord is wanted.
+						if (!Query_->EachSubRecord_)
+						{
+							SubIndex_ = Rec.SubRecords.size();
+						}
+						return true;
+					}
+				}
+
+				RecordIndex_++;
+				SubIndex_ = 0;
+			}
+			return false;
+		}
+	};
+
+	explicit EspQuery(const EspData& Doc)
+		: Doc_(Doc), Offset_(0), Limit_(0), EachSubRecord_(false)
+	{
+	}
+
+	EspQuery& Where(const QueryExpr& Expr)
+	{
+		Expr_ = Expr_ && Expr;
+		return *this;
+	}
+
+	EspQuery& Offset(size_t Count)
+	{
+		Offset_ = Count;
+		return *this;
+	}
+
+	// 0 = no limit.
+	EspQuery& Limit(size_t Count)
+	{
+		Limit_ = Count;
+		return *this;
+	}
+
+	// Yield every matching subrecord instead of one match per record.
+	EspQuery& EachSubRecord(bool Enable = true)
+	{
+		EachSubRecord_ = Enable;
+		return *this;
+	}
+
+	Iterator begin() const { return Iterator(this); }
+	Iterator end() const { return Iterator(); }
+
+	// Evaluates the whole document, ignoring Offset/Limit.
+	size_t Count() const
+	{
+		EspQuery All(Doc_);
+		All.Expr_ = Expr_;
+		All.EachSubRecord_ = EachSubRecord_;
+
+		size_t Total = 0;
+		for (Iterator It = All.begin(); It != All.end(); ++It)
+		{
+			Total++;
+		}
+		return Total;
+	}
+
+	bool Matches(const EspRecord& Rec, const SubRecordData* Sub) const
+	{
+		return Expr_.IsEmpty() || Expr_.Node->Match(Rec, Sub, Doc_.Strings);
+	}
+
+private:
+	const EspData& Doc_;
+	QueryExpr Expr_;
+	size_t Offset_;
+	size_t Limit_;
+	bool EachSubRecord_;
+};
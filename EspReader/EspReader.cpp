@@ -6,8 +6,22 @@
 #include <stack>
 #include <unordered_map>
 #include <unordered_set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
 #include "miniz.h"
 #include "EspRecord.h"
+#include "EspContext.h"
+#include "EspQuery.h"
+#include "EspStream.h"
+#include "StringsTable.h"
+#include "ZipArchive.h"
+#include "LoadOrder.h"
+#include "TranslationMemory.h"
 #include <random>
 
 #define NOMINMAX  
@@ -21,6 +35,98 @@
 #define SSELex_API __declspec(dllimport)
 #endif
 
+// Compression used for edited records that were compressed in the source.
+enum EspCompressionPolicy
+{
+	ESP_COMPRESS_FASTEST = 0,
+	ESP_COMPRESS_MATCH_ORIGINAL = 1, // same zlib level class as the source record
+	ESP_COMPRESS_BEST = 2
+};
+
+struct EspSaveOptions
+{
+	int CompressionPolicy; // EspCompressionPolicy
+	int ThreadCount;       // workers re-encoding edited records; 0 = one per core
+	// For localized plugins: keep edited localized subrecords as StringIDs and
+	// write new string tables under Strings\ next to the output, instead of
+	// inlining the text into the plugin.
+	int WriteStringTables;
+};
+
+// One subrecord text to replace while streaming a plugin (C_ApplyTranslations).
+struct EspTranslationEdit
+{
+	uint32_t FormID;
+	const char* RecordSig;
+	const char* SubSig;
+	int OccurrenceIndex;   // among the record's subrecords with this SubSig
+	const char* Utf8Text;
+};
+
+// Wall-clock seconds spent by C_OpenPlugin on each file. A strings entry is
+// indexed by StringsFileType and covers the loose file or the archive lookup.
+struct EspOpenTimings
+{
+	double PluginSeconds;
+	double StringsSeconds[3];
+	double TotalSeconds;
+};
+
+struct EspBatchOptions
+{
+	int ThreadCount;          // 0 = one per core
+	const char* Language;     // load each plugin's strings too; may be null
+	EspContext* FilterFrom;   // use this context's filter; null = the default filter
+};
+
+// What C_BatchProcess* reports for one plugin.
+struct EspBatchResult
+{
+	const wchar_t* Path;
+	int Status;               // 0 = read; otherwise the plugin could not be read
+	EspContext* Context;      // the loaded plugin, valid only during the callback
+	uint64_t Bytes;
+	uint64_t Records;         // records kept by the filter
+	uint64_t SubRecords;      // translatable subrecords in them
+	uint64_t TextHash;        // FNV-1a over FormIDs, signatures and texts, to spot changes;
+	                          // localized texts come from the strings of Language, if given
+	double Seconds;
+};
+
+typedef void (*EspBatchCallback)(const EspBatchResult* Result, void* UserData);
+
+enum EspDiffChange
+{
+	ESP_DIFF_ADDED = 1,
+	ESP_DIFF_REMOVED = 2,
+	ESP_DIFF_CHANGED = 3
+};
+
+// One translatable subrecord that differs between two versions of a plugin.
+struct EspDiffEntry
+{
+	uint32_t FormID;
+	char RecordSig[5];
+	char SubSig[5];
+	int OccurrenceIndex;   // among the record's subrecords with this SubSig
+	int Change;            // EspDiffChange
+};
+
+struct EspDiff;
+
+// A translatable subrecord of a loaded plugin looked up in a translation memory.
+struct EspTmMatch
+{
+	uint64_t SubRecord;    // handle
+	uint32_t FormID;
+	char RecordSig[5];
+	char SubSig[5];
+	int OccurrenceIndex;
+	const char* SourceUtf8;
+	const char* TargetUtf8; // null on a miss
+};
+
+struct EspTmLookup;
 
 extern "C" 
 {
@@ -53,9 +159,196 @@ extern "C"
 	SSELex_API bool C_ModifySubRecordByOffset(int IsCell, int RecordOffset, int SubOffset, const char* NewUtf8Data);
 	SSELex_API bool C_ModifySubRecord(uint32_t FormID, const char* RecordSig, const char* SubSig, int OccurrenceIndex, int GlobalIndex, const char* NewUtf8Data);
 	SSELex_API bool C_SaveEsp(const char* Utf8Path);
+	SSELex_API bool C_SaveEspEx(const char* Utf8Path, const EspSaveOptions* Options);
+	// In-memory variants: no temporary files. The read copies the bytes; the
+	// saved plugin is returned in a buffer released with C_FreeEspBuffer.
+	SSELex_API int C_ReadEspFromMemory(const uint8_t* Data, size_t Size);
+	SSELex_API uint8_t* C_SaveEspToBuffer(const EspSaveOptions* Options, size_t* OutSize);
+	SSELex_API void C_FreeEspBuffer(uint8_t* Buffer);
+	// Reads a plugin out of a .zip without extracting it. PluginName matches
+	// an entry's file name in any folder; null takes the first .esp/.esm/.esl.
+	// With a Language, Strings\<Plugin>_<Language>.* next to it are loaded too.
+	SSELex_API int C_ReadEspFromZip(const wchar_t* ZipPath, const char* PluginName, const char* Language);
+	// C_ReadEsp and C_Ctx_LoadStrings in one call: the plugin and its three
+	// strings files are read at the same time. Timings may be null.
+	SSELex_API int C_OpenPlugin(const wchar_t* EspPath, const char* Language, EspOpenTimings* Timings);
 
 	SSELex_API void C_Clear();
 	SSELex_API void C_Close();
+
+	// Context API: every call works on its own document, so separate contexts
+	// can be used from separate threads at the same time.
+	SSELex_API EspContext* C_CreateContext();
+	SSELex_API void C_DestroyContext(EspContext* Ctx);
+	SSELex_API EspContext* C_GetDefaultContext();
+	SSELex_API int C_Ctx_SetDefaultFilter(EspContext* Ctx);
+	SSELex_API int C_Ctx_SetFilter(EspContext* Ctx, const char* parentSig, const char** childSigs, int childCount);
+	SSELex_API void C_Ctx_ClearFilter(EspContext* Ctx);
+	SSELex_API bool C_Ctx_LoadStrings(EspContext* Ctx, const char* Utf8EspPath, const char* Language);
+	// Strings packed in an archive (BSA v104/v105). C_Ctx_LoadStrings already
+	// falls back to <Plugin>.bsa next to the plugin when no loose file exists.
+	SSELex_API bool C_Ctx_LoadStringsFromBsa(EspContext* Ctx, const char* Utf8BsaPath, const char* Utf8EspPath, const char* Language);
+	// Another language of the loaded strings, held next to the current one and
+	// read on first use. Returns its index (the current language is 0), or -1.
+	SSELex_API int C_Ctx_AddStringsLanguage(EspContext* Ctx, const char* Language);
+	SSELex_API int C_Ctx_ReadEsp(EspContext* Ctx, const wchar_t* EspPath);
+	SSELex_API EspRecord** C_Ctx_SearchBySig(EspContext* Ctx, const char* ParentSig, const char* ChildSig, int* OutCount);
+	SSELex_API const char* C_Ctx_SubRecordData_GetString(EspContext* Ctx, const SubRecordData* subRecord);
+	SSELex_API int C_Ctx_SubRecordData_GetStringUtf8(EspContext* Ctx, const SubRecordData* subRecord, uint8_t* buffer, int bufferSize);
+	SSELex_API int C_Ctx_SubRecordData_GetStringInLanguageUtf8(EspContext* Ctx, const SubRecordData* subRecord, int Language, uint8_t* buffer, int bufferSize);
+	// The text in several languages with one StringID lookup: Buffers[i] gets
+	// Languages[i] and OutLengths[i] its length, as GetStringInLanguageUtf8.
+	// Returns how many of the languages have the string, or -1.
+	SSELex_API int C_Ctx_SubRecordData_GetStringsInLanguagesUtf8(EspContext* Ctx, const SubRecordData* subRecord, const int* Languages, int Count, uint8_t** Buffers, int bufferSize, int* OutLengths);
+	SSELex_API bool C_Ctx_ModifySubRecordByOffset(EspContext* Ctx, int IsCell, int RecordOffset, int SubOffset, const char* NewUtf8Data);
+	SSELex_API bool C_Ctx_ModifySubRecord(EspContext* Ctx, uint32_t FormID, const char* RecordSig, const char* SubSig, int OccurrenceIndex, int GlobalIndex, const char* NewUtf8Data);
+	SSELex_API bool C_Ctx_SaveEsp(EspContext* Ctx, const char* Utf8Path);
+	SSELex_API bool C_Ctx_SaveEspEx(EspContext* Ctx, const char* Utf8Path, const EspSaveOptions* Options);
+	SSELex_API int C_Ctx_ReadEspFromMemory(EspContext* Ctx, const uint8_t* Data, size_t Size);
+	SSELex_API uint8_t* C_Ctx_SaveEspToBuffer(EspContext* Ctx, const EspSaveOptions* Options, size_t* OutSize);
+	SSELex_API int C_Ctx_ReadEspFromZip(EspContext* Ctx, const wchar_t* ZipPath, const char* PluginName, const char* Language);
+	SSELex_API int C_Ctx_OpenPlugin(EspContext* Ctx, const wchar_t* EspPath, const char* Language, EspOpenTimings* Timings);
+	SSELex_API void C_Ctx_Clear(EspContext* Ctx);
+
+	// Handles stay valid while the document grows and resolve in O(1).
+	// A handle from a cleared or reloaded document resolves to null.
+	// Resolving reads the live document under the context's lock, not a
+	// snapshot, so it waits for edits and is not isolated from them.
+	SSELex_API uint64_t C_GetRecordHandle(EspRecord* record);
+	SSELex_API uint64_t C_SubRecordData_GetHandle(const SubRecordData* subRecord);
+	SSELex_API uint64_t C_Ctx_GetRecordHandle(EspContext* Ctx, int IsCell, int RecordOffset);
+	SSELex_API int C_Ctx_SearchBySigHandles(EspContext* Ctx, const char* ParentSig, const char* ChildSig, uint64_t* OutHandles, int Capacity);
+	SSELex_API bool C_Ctx_IsHandleValid(EspContext* Ctx, uint64_t Handle);
+	SSELex_API EspRecord* C_Ctx_ResolveRecord(EspContext* Ctx, uint64_t RecordHandle);
+	SSELex_API const SubRecordData* C_Ctx_ResolveSubRecord(EspContext* Ctx, uint64_t SubRecordHandle);
+	SSELex_API bool C_Ctx_ModifySubRecordByHandle(EspContext* Ctx, uint64_t SubRecordHandle, const char* NewUtf8Data);
+
+	// 64-bit FNV-1a content hashes, computed while parsing. A record's covers
+	// its payload as read; a subrecord's covers its current data. Equal bytes
+	// hash equal across plugins. Search functions return the total number of
+	// matches and fill at most Capacity handles.
+	SSELex_API uint64_t C_GetRecordPayloadHash(EspRecord* record);
+	SSELex_API uint64_t C_SubRecordData_GetContentHash(const SubRecordData* subRecord);
+	SSELex_API int C_Ctx_SearchPayloadHash(EspContext* Ctx, uint64_t Hash, uint64_t* OutHandles, int Capacity);
+	SSELex_API int C_Ctx_SearchContentHash(EspContext* Ctx, uint64_t Hash, uint64_t* OutHandles, int Capacity);
+
+	// EditorID lookups (case-insensitive) over every record of the plugin.
+	// Search functions return the total number of matches and fill at most
+	// Capacity entries. The handle functions only see records the document
+	// stores; the FormID ones also see those the filter dropped, and return
+	// 0 when nothing matches. OutSig, if not null, gets the 4-byte signature.
+	SSELex_API int C_GetRecordEditorIDUtf8(EspRecord* record, uint8_t* buffer, int bufferSize);
+	SSELex_API uint64_t C_Ctx_FindByEditorID(EspContext* Ctx, const char* EditorID);
+	SSELex_API int C_Ctx_SearchEditorIDPrefix(EspContext* Ctx, const char* Prefix, uint64_t* OutHandles, int Capacity);
+	SSELex_API int C_Ctx_SearchEditorIDGlob(EspContext* Ctx, const char* Pattern, uint64_t* OutHandles, int Capacity);
+	SSELex_API uint32_t C_Ctx_FindFormIDByEditorID(EspContext* Ctx, const char* EditorID, char* OutSig);
+	SSELex_API int C_Ctx_SearchEditorIDPrefixFormIDs(EspContext* Ctx, const char* Prefix, uint32_t* OutFormIDs, int Capacity);
+	SSELex_API int C_Ctx_SearchEditorIDGlobFormIDs(EspContext* Ctx, const char* Pattern, uint32_t* OutFormIDs, int Capacity);
+
+	// Query builder. Every C_Query_* result must be released with C_Query_Free;
+	// combining copies the operands, so they may be freed right away.
+	SSELex_API QueryExpr* C_Query_RecordSig(const char* Sig);
+	SSELex_API QueryExpr* C_Query_SubSig(const char* Sig);
+	SSELex_API QueryExpr* C_Query_FormIDRange(uint32_t Min, uint32_t Max);
+	SSELex_API QueryExpr* C_Query_HasFlags(uint32_t Mask);
+	SSELex_API QueryExpr* C_Query_EditorID(const char* GlobPattern);
+	SSELex_API QueryExpr* C_Query_Localized(int IsLocalized);
+	SSELex_API QueryExpr* C_Query_TextContains(const char* Utf8Text);
+	SSELex_API QueryExpr* C_Query_Translatable(int CanTranslate);
+	SSELex_API QueryExpr* C_Query_And(const QueryExpr* A, const QueryExpr* B);
+	SSELex_API QueryExpr* C_Query_Or(const QueryExpr* A, const QueryExpr* B);
+	SSELex_API QueryExpr* C_Query_Not(const QueryExpr* A);
+	SSELex_API void C_Query_Free(QueryExpr* Expr);
+	// Takes up to Limit matches (0 = all) after skipping Offset, writes at most
+	// Capacity of them and returns how many were taken.
+	// OutSubHandles may be null; otherwise it receives the matching subrecord of each hit.
+	SSELex_API int C_Ctx_QueryExecute(EspContext* Ctx, const QueryExpr* Expr, int EachSubRecord, int Offset, int Limit, uint64_t* OutRecordHandles, uint64_t* OutSubHandles, int Capacity);
+	SSELex_API int C_Ctx_QueryCount(EspContext* Ctx, const QueryExpr* Expr, int EachSubRecord);
+
+	// Snapshots: a pinned snapshot is an immutable view of the document that
+	// edits on other threads never change. Searches on it never block.
+	// Results are copies, freed with FreeSearchResults.
+	SSELex_API EspRecord** C_SearchRecords(const char* Utf8Query, int ExactMatch, int* OutCount);
+	SSELex_API EspRecord** C_Ctx_SearchRecords(EspContext* Ctx, const char* Utf8Query, int ExactMatch, int* OutCount);
+	SSELex_API EspSnapshotPin* C_Ctx_PinSnapshot(EspContext* Ctx);
+	SSELex_API void C_Snapshot_Release(EspSnapshotPin* Pin);
+	SSELex_API uint64_t C_Snapshot_GetVersion(const EspSnapshotPin* Pin);
+	SSELex_API int C_Snapshot_GetRecordCount(const EspSnapshotPin* Pin, int IsCell);
+	SSELex_API EspRecord** C_Snapshot_SearchBySig(const EspSnapshotPin* Pin, const char* ParentSig, const char* ChildSig, int* OutCount);
+	SSELex_API EspRecord** C_Snapshot_SearchRecords(const EspSnapshotPin* Pin, const char* Utf8Query, int ExactMatch, int* OutCount);
+
+	// Streams SourcePath to Utf8OutPath in one pass, replacing the text of every
+	// matching subrecord. Nothing is loaded into a context and memory stays
+	// bounded by the largest record. Options may be null (see C_Ctx_SaveEspEx).
+	// Returns the number of edits applied, or -1 on failure.
+	SSELex_API int C_ApplyTranslations(const wchar_t* SourcePath, const char* Utf8OutPath, const EspTranslationEdit* Edits, int EditCount, const EspSaveOptions* Options);
+
+	// Diagnostics.
+	// Saves the loaded document to memory and compares it with its source.
+	// Returns 0 if identical, 1 if not (Report gets the first divergent offset
+	// with its GRUP and record), -1 on failure. Meant for unedited documents.
+	SSELex_API int C_Ctx_VerifyRoundTrip(EspContext* Ctx, const EspSaveOptions* Options, uint8_t* Report, int ReportSize);
+	// Times read, modify (every kept subrecord rewritten) and save-to-memory for
+	// each plugin in Directory and prints MB/s and records/s. Returns the number
+	// of plugins measured, -1 if the directory cannot be listed.
+	SSELex_API int C_BenchmarkDirectory(const wchar_t* Directory, int Iterations);
+
+	// Load order: several plugins read side by side, with FormIDs resolved
+	// through each plugin's masters and an index of the winning overrides.
+	SSELex_API EspLoadOrder* C_CreateLoadOrder();
+	SSELex_API void C_DestroyLoadOrder(EspLoadOrder* Order);
+	// Reads the plugins not loaded yet on ThreadCount workers (0 = one per core)
+	// and appends them in the given order; loaded ones are skipped, not reread.
+	// With a Language, each plugin's strings are loaded too. Returns the number
+	// of plugins read, or -1.
+	SSELex_API int C_LoadOrder_AddPlugins(EspLoadOrder* Order, const wchar_t** Paths, int Count, const char* Language, int ThreadCount);
+	SSELex_API int C_LoadOrder_GetPluginCount(EspLoadOrder* Order);
+	// The plugin's own context, for the C_Ctx_ calls. Owned by the load order.
+	SSELex_API EspContext* C_LoadOrder_GetContext(EspLoadOrder* Order, int PluginIndex);
+	// The version of FormID (numbered as in PluginName) that wins the load order.
+	// Returns the winning plugin's index and its record handle, or -1.
+	SSELex_API int C_LoadOrder_FindWinner(EspLoadOrder* Order, const char* PluginName, uint32_t FormID, uint64_t* OutRecordHandle);
+	// Winning records only, in load order. Fills up to Capacity pairs and
+	// returns the total count.
+	SSELex_API int C_LoadOrder_SearchBySigHandles(EspLoadOrder* Order, const char* ParentSig, const char* ChildSig, int* OutPlugins, uint64_t* OutHandles, int Capacity);
+
+	// Batch: reads many plugins on all cores, each worker reusing one context and
+	// all sharing one filter. Callback gets each plugin's result as soon as it is
+	// read; it runs on a worker thread, one call at a time. Options may be null.
+	// Returns the number of plugins read, or -1.
+	SSELex_API int C_BatchProcessDirectory(const wchar_t* Directory, const EspBatchOptions* Options, EspBatchCallback Callback, void* UserData);
+	SSELex_API int C_BatchProcessFiles(const wchar_t** Paths, int Count, const EspBatchOptions* Options, EspBatchCallback Callback, void* UserData);
+
+	// Which translatable subrecords were added, removed or changed from OldPath
+	// to NewPath. Records match by (FormID, Sig), subrecords by (Sig,
+	// OccurrenceIndex). Top-level GRUPs with identical bytes are skipped without
+	// being parsed. With a Language, localized text is compared through each
+	// plugin's strings. Returns null on failure; free with C_Diff_Free.
+	SSELex_API EspDiff* C_DiffPlugins(const wchar_t* OldPath, const wchar_t* NewPath, const char* Language);
+	SSELex_API int C_Diff_GetCount(const EspDiff* Diff);
+	SSELex_API const EspDiffEntry* C_Diff_GetEntries(const EspDiff* Diff);
+	SSELex_API void C_Diff_Free(EspDiff* Diff);
+
+	// Translation memory: source text -> translation, shared across plugins.
+	// The table at Utf8Path is memory-mapped; additions go to a journal beside
+	// it until C_TranslationMemory_Compact merges them, optionally in the
+	// background. Lookup returns the target length, or -1 on a miss.
+	SSELex_API TranslationMemory* C_OpenTranslationMemory(const char* Utf8Path);
+	SSELex_API void C_CloseTranslationMemory(TranslationMemory* Tm);
+	SSELex_API bool C_TranslationMemory_Add(TranslationMemory* Tm, const char* SourceUtf8, const char* TargetUtf8);
+	SSELex_API int C_TranslationMemory_Lookup(TranslationMemory* Tm, const char* SourceUtf8, uint8_t* Buffer, int BufferSize);
+	SSELex_API int C_TranslationMemory_GetCount(TranslationMemory* Tm);
+	SSELex_API bool C_TranslationMemory_Compact(TranslationMemory* Tm, bool Background);
+
+	// Looks up the text of every translatable subrecord of the loaded plugin in
+	// one call. The hits are also offered as edits for C_ApplyTranslations.
+	// Free the result with C_TmLookup_Free.
+	SSELex_API EspTmLookup* C_Ctx_LookupTranslations(EspContext* Ctx, TranslationMemory* Tm);
+	SSELex_API int C_TmLookup_GetCount(const EspTmLookup* Lookup);
+	SSELex_API int C_TmLookup_GetHitCount(const EspTmLookup* Lookup);
+	SSELex_API const EspTmMatch* C_TmLookup_GetMatches(const EspTmLookup* Lookup);
+	SSELex_API const EspTranslationEdit* C_TmLookup_GetEdits(const EspTmLookup* Lookup);
+	SSELex_API void C_TmLookup_Free(EspTmLookup* Lookup);
 }
 
 const SubRecordData* C_GetSubRecordData_Ptr(EspRecord* record, int index)
@@ -65,12 +358,8 @@ const SubRecordData* C_GetSubRecordData_Ptr(EspRecord* record, int index)
 	return &record->SubRecords[index];
 }
 
-int C_SubRecordData_GetStringUtf8(const SubRecordData* subRecord, uint8_t* buffer, int bufferSize)
+int CopyStringUtf8(const std::string& str, uint8_t* buffer, int bufferSize)
 {
-	if (!subRecord) return -1;
-
-	std::string str = subRecord->GetString();
-
 	const char* cstr = str.c_str();
 	int len = static_cast<int>(strlen(cstr)); 
 
@@ -82,6 +371,13 @@ int C_SubRecordData_GetStringUtf8(const SubRecordData* subRecord, uint8_t* buffe
 	return len;
 }
 
+int C_SubRecordData_GetStringUtf8(const SubRecordData* subRecord, uint8_t* buffer, int bufferSize)
+{
+	if (!subRecord) return -1;
+
+	return CopyStringUtf8(subRecord->GetString(), buffer, bufferSize);
+}
+
 int C_SubRecordData_GetSigUtf8(const SubRecordData* subRecord, uint8_t* buffer, int bufferSize)
 {
 	if (!subRecord) return -1;
@@ -116,7 +412,8 @@ const char* C_SubRecordData_GetSig(const SubRecordData* subRecord)
 const char* C_SubRecordData_GetString(const SubRecordData* subRecord)
 {
 	if (!subRecord) return nullptr;
-	static std::string buffer;
+	// One buffer per calling thread, so parallel callers don't overwrite each other.
+	thread_local std::string buffer;
 	buffer = subRecord->GetString();
 	return buffer.c_str();
 }
@@ -172,6 +469,52 @@ int C_GetSubRecordCount(EspRecord* record)
 	return static_cast<int>(record->SubRecords.size());
 }
 
+uint64_t C_GetRecordHandle(EspRecord* record)
+{
+	if (!record) return INVALID_ESP_HANDLE;
+	return record->Handle;
+}
+
+uint64_t C_SubRecordData_GetHandle(const SubRecordData* subRecord)
+{
+	if (!subRecord) return INVALID_ESP_HANDLE;
+	return subRecord->Handle;
+}
+
+uint64_t C_GetRecordPayloadHash(EspRecord* record)
+{
+	if (!record) return 0;
+	return record->PayloadHash;
+}
+
+uint64_t C_SubRecordData_GetContentHash(const SubRecordData* subRecord)
+{
+	if (!subRecord) return 0;
+	return subRecord->ContentHash;
+}
+
+int C_GetRecordEditorIDUtf8(EspRecord* record, uint8_t* buffer, int bufferSize)
+{
+	if (!record) return -1;
+
+	return CopyStringUtf8(record->GetEditorID(), buffer, bufferSize);
+}
+
+int CopyHandles(const std::vector<EspHandle>& Handles, uint64_t* OutHandles, int Capacity)
+{
+	if (OutHandles)
+	{
+		int Count = static_cast<int>(Handles.size());
+		if (Count > Capacity) Count = Capacity;
+		for (int i = 0; i < Count; ++i)
+		{
+			OutHandles[i] = Handles[i];
+		}
+	}
+
+	return static_cast<int>(Handles.size());
+}
+
 
 void Close();
 
@@ -213,7 +556,7 @@ constexpr uint32_t RECORD_FLAG_COMPRESSED = 0x00040000;
 
 // Read helper
 template<typename T>
-inline void Read(std::ifstream& f, T& out) { f.read(reinterpret_cast<char*>(&out), sizeof(T)); }
+inline void Read(std::istream& f, T& out) { f.read(reinterpret_cast<char*>(&out), sizeof(T)); }
 inline bool IsGRUP(const char sig[4]) { return std::memcmp(sig, "GRUP", 4) == 0; }
 bool IsCompressed(const RecordHeader& hdr) { return (hdr.Flags & RECORD_FLAG_COMPRESSED) != 0; }
 
@@ -226,19 +569,26 @@ bool ZlibDecompress(const uint8_t* src, size_t srcSize, std::vector<uint8_t>& ou
 }
 
 //EnCompress
-bool ZlibCompress(const uint8_t* src, size_t srcSize, std::vector<uint8_t>& out)
+bool ZlibCompress(const uint8_t* src, size_t srcSize, std::vector<uint8_t>& out, int level = Z_BEST_COMPRESSION)
 {
 	mz_ulong destLen = compressBound(srcSize);
 	out.resize(destLen);
-	int ret = compress2(out.data(), &destLen, src, srcSize, Z_BEST_COMPRESSION);
+	int ret = compress2(out.data(), &destLen, src, srcSize, level);
 	if (ret != Z_OK) return false;
 	out.resize(destLen);
 	return true;
 }
 
-RecordFilter* TranslateFilter;
+// Strings of the default context, used by SubRecordData::GetString()
 StringsManager* g_StringsManager = nullptr;
 
+// Backs the context-less C API.
+EspContext& GetDefaultContext()
+{
+	static EspContext DefaultContext;
+	return DefaultContext;
+}
+
 // Parse subrecords from memory buffer with filter
 void ParseSubRecords(const uint8_t* data, size_t dataSize, EspRecord& rec,
 	const RecordFilter& filter, const char recordSig[4])
@@ -249,14 +599,14 @@ void ParseSubRecords(const uint8_t* data, size_t dataSize, EspRecord& rec,
 		const SubRecordHeader* sub = reinterpret_cast<const SubRecordHeader*>(data + offset);
 		if (offset + sizeof(SubRecordHeader) + sub->Size > dataSize) break;
 
-		rec.AddSubRecord(sub->Sig, data + offset + sizeof(SubRecordHeader), sub->Size,*TranslateFilter);
+		rec.AddSubRecord(sub->Sig, data + offset + sizeof(SubRecordHeader), sub->Size, filter);
 
 		offset += sizeof(SubRecordHeader) + sub->Size;
 	}
 }
 
 // Parse subrecords from stream with filter
-void ParseSubRecordsStream(std::ifstream& f, uint32_t recordSize, EspRecord& rec,
+void ParseSubRecordsStream(std::istream& f, uint32_t recordSize, EspRecord& rec,
 	const RecordFilter& filter, const char recordSig[4])
 {
 	uint32_t bytesRead = 0;
@@ -285,12 +635,45 @@ void ParseSubRecordsStream(std::ifstream& f, uint32_t recordSize, EspRecord& rec
 			bytesRead += sub.Size;
 		}
 
-		rec.AddSubRecord(sub.Sig, buf.data(), sub.Size,*TranslateFilter);
+		rec.AddSubRecord(sub.Sig, buf.data(), sub.Size, filter);
+	}
+}
+
+// Collects the MAST names of the TES4 header whose payload starts at f.
+// The filter drops MAST, so they are read here and f is left where it was.
+void ReadMasters(std::istream& f, uint32_t DataSize, std::vector<std::string>& Masters)
+{
+	std::streampos Start = f.tellg();
+	std::vector<uint8_t> Data(DataSize);
+	if (DataSize == 0 || !f.read(reinterpret_cast<char*>(Data.data()), DataSize))
+	{
+		f.clear();
+		f.seekg(Start);
+		return;
+	}
+	f.seekg(Start);
+
+	size_t Pos = 0;
+	while (Pos + 6 <= Data.size())
+	{
+		uint16_t Size;
+		std::memcpy(&Size, Data.data() + Pos + 4, 2);
+		if (Pos + 6 + Size > Data.size())
+			break;
+
+		if (std::memcmp(Data.data() + Pos, "MAST", 4) == 0)
+		{
+			const char* Name = reinterpret_cast<const char*>(Data.data() + Pos + 6);
+			Masters.push_back(std::string(Name, std::find(Name, Name + Size, '\0')));
+		}
+		Pos += 6 + Size;
 	}
 }
 
-void ParseRecord(std::ifstream& f, const char Sig[4], EspData& doc, const RecordFilter& filter)
+void ParseRecord(std::istream& f, const char Sig[4], EspData& doc, const RecordFilter& filter)
 {
+	int64_t recordOffset = static_cast<int64_t>(f.tellg()) - 4;
+
 	RecordHeader hdr{};
 	std::memcpy(hdr.Sig, Sig, 4);
 	Read(f, hdr.DataSize);
@@ -300,14 +683,24 @@ void ParseRecord(std::ifstream& f, const char Sig[4], EspData& doc, const Record
 	Read(f, hdr.Version);
 	Read(f, hdr.Unknown);
 
+	// TES4 comes first, so every later record knows whether 4-byte fields are StringIDs.
+	if (std::memcmp(hdr.Sig, "TES4", 4) == 0)
+	{
+		doc.IsLocalizedPlugin = (hdr.Flags & 0x80) != 0;
+		ReadMasters(f, hdr.DataSize, doc.Masters);
+	}
+
 	EspRecord rec(hdr.Sig, hdr.FormID, hdr.Flags);
+	rec.SourceOffset = recordOffset;
+	rec.InLocalizedPlugin = doc.IsLocalizedPlugin;
 
 	if (IsCompressed(hdr))
 	{
 		if (hdr.DataSize < 4)
 		{
 			f.seekg(hdr.DataSize, std::ios::cur);
-			doc.AddRecord(rec,*TranslateFilter);
+			doc.IndexEditorID(rec);
+			doc.AddRecord(rec, filter);
 			return;
 		}
 
@@ -329,10 +722,11 @@ void ParseRecord(std::ifstream& f, const char Sig[4], EspData& doc, const Record
 		ParseSubRecordsStream(f, hdr.DataSize, rec, filter, hdr.Sig);
 	}
 
-	doc.AddRecord(rec, *TranslateFilter);
+	doc.IndexEditorID(rec);
+	doc.AddRecord(rec, filter);
 }
 
-void ParseCellGroup(std::ifstream& f, EspData& doc, const RecordFilter& filter, uint32_t groupSize)
+void ParseCellGroup(std::istream& f, EspData& doc, const RecordFilter& filter, uint32_t groupSize)
 {
 	uint32_t bytesRead = 0;
 
@@ -402,6 +796,8 @@ void ParseCellGroup(std::ifstream& f, EspData& doc, const RecordFilter& filter,
 				break;
 			}
 
+			int64_t recordOffset = static_cast<int64_t>(posBeforeRead);
+
 			RecordHeader hdr{};
 			std::memcpy(hdr.Sig, sig, 4);
 			Read(f, hdr.DataSize);
@@ -421,6 +817,8 @@ void ParseCellGroup(std::ifstream& f, EspData& doc, const RecordFilter& filter,
 			}
 
 			EspRecord Record(hdr.Sig, hdr.FormID, hdr.Flags);
+			Record.SourceOffset = recordOffset;
+			Record.InLocalizedPlugin = doc.IsLocalizedPlugin;
 
 			if (IsCompressed(hdr))
 			{
@@ -449,9 +847,10 @@ void ParseCellGroup(std::ifstream& f, EspData& doc, const RecordFilter& filter,
 				ParseSubRecordsStream(f, hdr.DataSize, Record, filter, hdr.Sig);
 			}
 
-			if (Record.CanTranslate())
+			doc.IndexEditorID(Record);
+			if (Record.CanTranslate(doc.Strings))
 			{
-				doc.AddRecord(Record,*TranslateFilter);
+				doc.AddRecord(Record, filter);
 			}
 
 			bytesRead += recordTotalSize;
@@ -473,7 +872,7 @@ void ParseCellGroup(std::ifstream& f, EspData& doc, const RecordFilter& filter,
 }
 
 // Iterative group parsing with filter
-void ParseGroupIterative(std::ifstream& f, EspData& doc, const RecordFilter& filter)
+void ParseGroupIterative(std::istream& f, EspData& doc, const RecordFilter& filter)
 {
 	struct GroupState
 	{
@@ -573,6 +972,8 @@ void ParseGroupIterative(std::ifstream& f, EspData& doc, const RecordFilter& fil
 				continue;
 			}
 
+			int64_t recordOffset = static_cast<int64_t>(f.tellg()) - 4;
+
 			RecordHeader hdr{};
 			std::memcpy(hdr.Sig, sig, 4);
 			Read(f, hdr.DataSize);
@@ -591,6 +992,8 @@ void ParseGroupIterative(std::ifstream& f, EspData& doc, const RecordFilter& fil
 			}
 
 			EspRecord Record(hdr.Sig, hdr.FormID, hdr.Flags);
+			Record.SourceOffset = recordOffset;
+			Record.InLocalizedPlugin = doc.IsLocalizedPlugin;
 
 			if (IsCompressed(hdr))
 			{
@@ -619,9 +1022,10 @@ void ParseGroupIterative(std::ifstream& f, EspData& doc, const RecordFilter& fil
 				ParseSubRecordsStream(f, hdr.DataSize, Record, filter, hdr.Sig);
 			}
 
-			if (Record.CanTranslate())
+			doc.IndexEditorID(Record);
+			if (Record.CanTranslate(doc.Strings))
 			{
-				doc.AddRecord(Record,*TranslateFilter);
+				doc.AddRecord(Record, filter);
 			}
 
 			state.remaining -= recordTotalSize;
@@ -629,23 +1033,9 @@ void ParseGroupIterative(std::ifstream& f, EspData& doc, const RecordFilter& fil
 	}
 }
 
-std::wstring LastSetPath;
-EspData* Data;
-void Clear();
-
-int ReadEsp(const wchar_t* EspPath, const RecordFilter& Filter)
+// Parses every top-level entry from F's position to its end into Doc.
+void ParseToEnd(std::istream& F, EspData& Doc, const RecordFilter& Filter)
 {
-	Clear();
-	LastSetPath = EspPath;
-	Data = new EspData();
-
-	std::ifstream F(EspPath, std::ios::binary);
-	if (!F.is_open())
-	{
-		std::cerr << "Failed to open ESP: " << EspPath << "\n";
-		return 1;
-	}
-
 	while (F.good() && F.peek() != EOF)
 	{
 		char Sig[4];
@@ -653,35 +1043,175 @@ int ReadEsp(const wchar_t* EspPath, const RecordFilter& Filter)
 
 		if (IsGRUP(Sig))
 		{
-			ParseGroupIterative(F, *Data, Filter);
+			ParseGroupIterative(F, Doc, Filter);
 		}
 		else
 		{
-			ParseRecord(F, Sig, *Data, Filter);
+			ParseRecord(F, Sig, Doc, Filter);
 		}
 	}
+}
+
+// Parses a whole plugin from F into a fresh document on Ctx. Filter is only
+// read, so one filter can serve contexts on several threads.
+int ReadEspStream(EspContext& Ctx, std::istream& F, const RecordFilter& Filter)
+{
+	Ctx.Data = new EspData();
+	Ctx.Data->Strings = Ctx.Strings;
+
+	ParseToEnd(F, *Ctx.Data, Filter);
+
+	Ctx.Data->Finalize();
+	Ctx.PublishSnapshot();
 	return 0;
 }
 
+int ReadEspStream(EspContext& Ctx, std::istream& F)
+{
+	return ReadEspStream(Ctx, F, *Ctx.Filter);
+}
+
+bool ReadFileBytes(const wchar_t* Path, std::vector<uint8_t>& Out);
+int ReadSourceStream(EspContext& Ctx, const wchar_t* EspPath, const RecordFilter& Filter);
+bool CanReloadGroups(const EspContext& Ctx, const wchar_t* EspPath, const RecordFilter& Filter);
+bool ReloadChangedGroups(EspContext& Ctx, const wchar_t* EspPath, const std::vector<uint8_t>& Bytes, const RecordFilter& Filter);
+
+// Reading the path Ctx already holds, with the same filter, reparses only the
+// top-level groups whose bytes changed since and keeps the rest. Any other
+// read streams the file.
+int ReadEsp(EspContext& Ctx, const wchar_t* EspPath, const RecordFilter& Filter)
+{
+	if (CanReloadGroups(Ctx, EspPath, Filter))
+	{
+		std::vector<uint8_t> Bytes;
+		if (ReadFileBytes(EspPath, Bytes) && ReloadChangedGroups(Ctx, EspPath, Bytes, Filter))
+			return 0;
+	}
+
+	Ctx.ClearData();
+	int Result = ReadSourceStream(Ctx, EspPath, Filter);
+	if (Result == 0)
+	{
+		Ctx.LastSetPath = EspPath;
+	}
+	return Result;
+}
+
+int ReadEsp(EspContext& Ctx, const wchar_t* EspPath)
+{
+	if (!Ctx.Filter)
+	{
+		Ctx.ClearData();
+		return 1;
+	}
+
+	return ReadEsp(Ctx, EspPath, *Ctx.Filter);
+}
+
+// The context keeps the bytes as the source for a later save.
+int ReadEspBytes(EspContext& Ctx, const std::shared_ptr<const std::vector<uint8_t> >& Bytes)
+{
+	Ctx.ClearData();
+
+	if (!Ctx.Filter)
+		return 1;
+
+	Ctx.SourceBytes = Bytes;
+
+	MemoryStreamBuf Buffer(Bytes->data(), Bytes->size());
+	std::istream F(&Buffer);
+	return ReadEspStream(Ctx, F);
+}
+
+int ReadEspFromMemory(EspContext& Ctx, const uint8_t* Bytes, size_t Size)
+{
+	return ReadEspBytes(Ctx, std::make_shared<const std::vector<uint8_t> >(Bytes, Bytes + Size));
+}
+
+// Inflates the plugin entry, and its strings entries when Language is set,
+// straight into memory. Nothing else in the archive is touched. The strings
+// replace Ctx.Strings only once the plugin itself has been read.
+int ReadEspFromZip(EspContext& Ctx, const wchar_t* ZipPath, const char* PluginName, const char* Language)
+{
+	Ctx.ClearData();
+
+	ZipArchive Zip;
+	if (!Zip.Open(ZipPath))
+	{
+		std::wcerr << L"Failed to open archive: " << ZipPath << L"\n";
+		return 1;
+	}
+
+	std::string PluginEntry = Zip.FindPlugin(PluginName);
+	std::shared_ptr<std::vector<uint8_t> > Bytes = std::make_shared<std::vector<uint8_t> >();
+	if (PluginEntry.empty() || !Zip.Extract(PluginEntry, *Bytes))
+	{
+		std::cerr << "Plugin not found in archive: " << (PluginName ? PluginName : "*.esp") << "\n";
+		return 1;
+	}
+
+	StringsManager Loaded;
+	if (Language)
+	{
+		std::vector<std::vector<uint8_t> > Files(StringsTypeCount);
+		std::vector<std::string> Names(StringsTypeCount);
+		for (int i = 0; i < StringsTypeCount; ++i)
+		{
+			Names[i] = Zip.FindStrings(PluginEntry, Language, StringsFileExtension(static_cast<StringsFileType>(i)));
+			if (!Names[i].empty())
+			{
+				Zip.Extract(Names[i], Files[i]);
+			}
+		}
+		Loaded.LoadStringsFromMemory(Files, Names, Language);
+	}
+
+	int Result = ReadEspBytes(Ctx, Bytes);
+	if (Result == 0 && Language)
+	{
+		Ctx.Strings->Swap(Loaded);
+		Ctx.PublishSnapshot();
+	}
+	return Result;
+}
+
 int C_ReadEsp(const wchar_t* EspPath)
 {
-	return ReadEsp(EspPath, *TranslateFilter);
+	return C_Ctx_ReadEsp(&GetDefaultContext(), EspPath);
+}
+
+int C_ReadEspFromMemory(const uint8_t* Data, size_t Size)
+{
+	return C_Ctx_ReadEspFromMemory(&GetDefaultContext(), Data, Size);
+}
+
+int C_ReadEspFromZip(const wchar_t* ZipPath, const char* PluginName, const char* Language)
+{
+	return C_Ctx_ReadEspFromZip(&GetDefaultContext(), ZipPath, PluginName, Language);
 }
 
 void C_InitDefaultFilter()
 {
-	if (TranslateFilter) delete TranslateFilter;
-	TranslateFilter = new RecordFilter();
+	EspContext& Ctx = GetDefaultContext();
+	std::lock_guard<std::mutex> Guard(Ctx.Lock);
+
+	if (Ctx.Filter) delete Ctx.Filter;
+	Ctx.Filter = new RecordFilter();
 }
 
-void C_ClearFilter()
+void ClearFilter(RecordFilter* Filter)
 {
-	if (TranslateFilter)
+	if (Filter)
 	{
-		TranslateFilter->CurrentConfig.clear();
+		Filter->CurrentConfig.clear();
 	}
 }
 
+void C_ClearFilter()
+{
+	C_Ctx_ClearFilter(&GetDefaultContext());
+}
+
 static std::string WStringToUtf8(const std::wstring& wstr)
 {
 	if (wstr.empty()) return std::string();
@@ -691,9 +1221,9 @@ static std::string WStringToUtf8(const std::wstring& wstr)
 	return result;
 }
 
-int C_SetDefaultFilter()
+int SetDefaultFilter(RecordFilter* Filter)
 {
-	if (TranslateFilter)
+	if (Filter)
 	{
 		std::unordered_map<std::string, std::vector<std::string>> Config =
 		{
@@ -742,21 +1272,26 @@ int C_SetDefaultFilter()
 		   {"WRLD", {"FULL"}},
 		};
 
-		TranslateFilter->LoadFromConfig(Config);
+		Filter->LoadFromConfig(Config);
 
-		return (int)TranslateFilter->CurrentConfig.size();
+		return (int)Filter->CurrentConfig.size();
 	}
 	
 	return -1;
 }
 
- int C_SetFilter(const char* ParentSig,const char** ChildSigs,int ChildCount)
+int C_SetDefaultFilter()
+{
+	return C_Ctx_SetDefaultFilter(&GetDefaultContext());
+}
+
+int SetFilter(RecordFilter* Filter, const char* ParentSig, const char** ChildSigs, int ChildCount)
 {
-	 if (TranslateFilter)
+	 if (Filter)
 	 {
 		 std::string Parent(ParentSig);
 
-		 std::vector<std::string>& Vec = TranslateFilter->CurrentConfig[Parent];
+		 std::vector<std::string>& Vec = Filter->CurrentConfig[Parent];
 
 		 for (int i = 0; i < ChildCount; ++i)
 		 {
@@ -768,10 +1303,15 @@ int C_SetDefaultFilter()
 	 return -1;
 }
 
+ int C_SetFilter(const char* ParentSig,const char** ChildSigs,int ChildCount)
+{
+	 return C_Ctx_SetFilter(&GetDefaultContext(), ParentSig, ChildSigs, ChildCount);
+}
+
 
 void Init()
 {
-	g_StringsManager = new StringsManager();
+	g_StringsManager = GetDefaultContext().Strings;
 }
 
 void WaitForExit()
@@ -780,9 +1320,9 @@ void WaitForExit()
 }
 
 
-void GetCanTransCount()
+void GetCanTransCount(const EspData& Doc)
 {
-	int GetTotal = Data->GetRecordsSubCount() + Data->GetCellRecordsSubCount();
+	int GetTotal = Doc.GetRecordsSubCount() + Doc.GetCellRecordsSubCount();
 	std::cout << "CanTransCount: " << GetTotal << "\n\n";
 }
 
@@ -815,9 +1355,8 @@ void C_Close()
 	Close();
 }
 
-EspRecord** C_SearchBySig(const char* ParentSig,const char* ChildSig,int* OutCount)
+EspRecord** CopySearchResults(const std::vector<const EspRecord*>& Matches, int* OutCount)
 {
-	std::vector<EspRecord> Matches = Data->SearchBySig(ParentSig, ChildSig);
 	*OutCount = static_cast<int>(Matches.size());
 
 	if (Matches.empty())
@@ -826,12 +1365,22 @@ EspRecord** C_SearchBySig(const char* ParentSig,const char* ChildSig,int* OutCou
 	EspRecord** Result = new EspRecord * [*OutCount];
 	for (int i = 0; i < *OutCount; ++i)
 	{
-		Result[i] = new EspRecord(Matches[i]);
+		Result[i] = new EspRecord(*Matches[i]);
 	}
 
 	return Result;
 }
 
+EspRecord** C_SearchRecords(const char* Utf8Query, int ExactMatch, int* OutCount)
+{
+	return C_Ctx_SearchRecords(&GetDefaultContext(), Utf8Query, ExactMatch, OutCount);
+}
+
+EspRecord** C_SearchBySig(const char* ParentSig,const char* ChildSig,int* OutCount)
+{
+	return C_Ctx_SearchBySig(&GetDefaultContext(), ParentSig, ChildSig, OutCount);
+}
+
 void FreeSearchResults(EspRecord** Arr, int Count)
 {
 	if (!Arr) return;
@@ -853,10 +1402,12 @@ int main()
 	C_InitDefaultFilter();
 	C_SetDefaultFilter();
 
+	EspContext& Ctx = GetDefaultContext();
+
 	const wchar_t* EspPath = TEXT("C:\\Users\\52508\\Desktop\\1TestMod\\Interesting NPCs - 4.5 to 4.54 Update-29194-4-54-1681353795\\Data\\3DNPC.esp");
 
 	std::cout << "Starting ESP parsing with filter...\n";
-	if (TranslateFilter->IsEnabled())
+	if (Ctx.Filter->IsEnabled())
 	{
 		std::cout << "Filter is enabled - only specified records will be parsed.\n";
 	}
@@ -864,20 +1415,20 @@ int main()
 		std::cout << "Filter is disabled - all records will be parsed.\n";
 	}
 
-	int state = ReadEsp(EspPath, *TranslateFilter);
+	int state = ReadEsp(Ctx, EspPath);
 
 	if (state == 0)
 	{
 		std::cout << "Finished reading ESP.\n";
-		std::cout << "Total records parsed: " << Data->GetTotalCount() << "\n";
+		std::cout << "Total records parsed: " << Ctx.Data->GetTotalCount() << "\n";
 
 		// Print statistics
-		Data->PrintStatistics();
+		Ctx.Data->PrintStatistics();
 
 		//Test Query Cells
-		std::cout << "CellCount: " << Data->SearchBySig("CELL").size() << "\n\n";
+		std::cout << "CellCount: " << Ctx.Data->SearchBySig("CELL").size() << "\n\n";
 
-		GetCanTransCount();
+		GetCanTransCount(*Ctx.Data);
 	}
 	else
 	{
@@ -891,526 +1442,3537 @@ int main()
 	return 0;
 }
 
+void AssignSubRecordText(SubRecordData& Sub, const char* NewUtf8Data)
+{
+	if (NewUtf8Data)
+	{
+		Sub.Data.assign(
+			NewUtf8Data,
+			NewUtf8Data + std::strlen(NewUtf8Data));
+	}
+	else
+	{
+		Sub.Data.clear();
+	}
+
+	Sub.StringID = 0;//If you modify the text directly, it will no longer be supported by stringsfile.
+	Sub.IsLocalized = false;
+	Sub.ContentHash = Fnv1a(FNV1A_BASIS, Sub.Data.data(), Sub.Data.size());
+}
+
 //Quick Modify Data
-//vector The pointer will be reallocated... damn it.
-bool ModifySubRecordByOffset(int IsCell,int RecordOffset,int SubOffset,const char* NewUtf8Data)
+//Offsets shift when the vectors change; prefer ModifySubRecordByHandle.
+//The Modify functions return the edited record (null if nothing matched) so the caller can publish it.
+EspRecord* ModifySubRecordByOffset(EspData* Data, int IsCell,int RecordOffset,int SubOffset,const char* NewUtf8Data)
 {
 	if (!Data)
-		return false;
+		return nullptr;
 
-	std::vector<EspRecord>& Records =
+	RecordStore& Records =
 		(IsCell == 1) ? Data->CellRecords : Data->Records;
 
 	if (RecordOffset < 0 || RecordOffset >= (int)Records.size())
-		return false;
+		return nullptr;
+
+	if (SubOffset < 0 || SubOffset >= (int)Records[RecordOffset].SubRecords.size())
+		return nullptr;
 
-	EspRecord& Rec = Records[RecordOffset];
+	EspRecord& Rec = Records.Edit(RecordOffset);
 
 	if (SubOffset < 0 || SubOffset >= (int)Rec.SubRecords.size())
-		return false;
+		return nullptr;
 
 	SubRecordData& Sub = Rec.SubRecords[SubOffset];
 
-	if (NewUtf8Data)
-	{
-		Sub.Data.assign(
-			NewUtf8Data,
-			NewUtf8Data + std::strlen(NewUtf8Data));
-	}
-	else
-	{
-		Sub.Data.clear();
-	}
+	AssignSubRecordText(Sub, NewUtf8Data);
+	Rec.Dirty = true;
 
-	Sub.StringID = 0;
-	Sub.IsLocalized = false;
+	return &Rec;
+}
 
-	return true;
+EspRecord* ModifySubRecordByHandle(EspData* Data, EspHandle SubHandle, const char* NewUtf8Data)
+{
+	if (!Data)
+		return nullptr;
+
+	const SubRecordLocation* Loc = Data->SubRecordHandles.Get(SubHandle);
+	SubRecordData* Sub = Data->ResolveSubRecord(SubHandle);
+	if (!Loc || !Sub)
+		return nullptr;
+
+	AssignSubRecordText(*Sub, NewUtf8Data);
+
+	EspRecord* Rec = Data->ResolveRecord(Loc->Record);
+	Rec->Dirty = true;
+	return Rec;
 }
 
 
 bool C_ModifySubRecordByOffset(int IsCell, int RecordOffset, int SubOffset, const char* NewUtf8Data)
 {
-	return ModifySubRecordByOffset(IsCell, RecordOffset, SubOffset, NewUtf8Data);
+	return C_Ctx_ModifySubRecordByOffset(&GetDefaultContext(), IsCell, RecordOffset, SubOffset, NewUtf8Data);
 }
 
-bool C_ModifySubRecord(uint32_t FormID, const char* RecordSig, const char* SubSig, int OccurrenceIndex, int GlobalIndex, const char* NewUtf8Data)
+EspRecord* ModifySubRecord(EspData* Data, uint32_t FormID, const char* RecordSig, const char* SubSig, int OccurrenceIndex, int GlobalIndex, const char* NewUtf8Data)
 {
+	if (!Data)
+		return nullptr;
+
 	std::string StrRecordSig = RecordSig ? RecordSig : "";
 	std::string StrSubSig = SubSig ? SubSig : "";
-	std::string StrNewData = NewUtf8Data ? NewUtf8Data : "";
 
-	for (auto& Rec : Data->Records)
+	for (RecordStore* Store : { &Data->Records, &Data->CellRecords })
 	{
-		if (Rec.FormID == FormID && Rec.Sig == StrRecordSig)
+		for (size_t i = 0; i < Store->size(); ++i)
 		{
-			for (auto& Sub : Rec.SubRecords)
-			{
-				if (Sub.Sig == StrSubSig && Sub.OccurrenceIndex == OccurrenceIndex && Sub.GlobalIndex == GlobalIndex)
-				{
-					Sub.Data.assign(StrNewData.begin(), StrNewData.end());
-					Sub.StringID = 0;//If you modify the text directly, it will no longer be supported by stringsfile.
-					Sub.IsLocalized = false;
-					return true;
-				}
-			}
-		}
-	}
+			const EspRecord& Found = (*Store)[i];
+			if (Found.FormID != FormID || Found.Sig != StrRecordSig)
+				continue;
 
-	for (auto& Rec : Data->CellRecords)
-	{
-		if (Rec.FormID == FormID && Rec.Sig == StrRecordSig)
-		{
-			for (auto& Sub : Rec.SubRecords)
+			for (size_t j = 0; j < Found.SubRecords.size(); ++j)
 			{
+				const SubRecordData& Sub = Found.SubRecords[j];
 				if (Sub.Sig == StrSubSig && Sub.OccurrenceIndex == OccurrenceIndex && Sub.GlobalIndex == GlobalIndex)
 				{
-					Sub.Data.assign(StrNewData.begin(), StrNewData.end());
-					Sub.StringID = 0;
-					Sub.IsLocalized = false;
-					return true;
+					EspRecord& Rec = Store->Edit(i);
+					AssignSubRecordText(Rec.SubRecords[j], NewUtf8Data);
+					Rec.Dirty = true;
+					return &Rec;
 				}
 			}
 		}
 	}
 
-	return false;
+	return nullptr;
+}
+
+bool C_ModifySubRecord(uint32_t FormID, const char* RecordSig, const char* SubSig, int OccurrenceIndex, int GlobalIndex, const char* NewUtf8Data)
+{
+	return C_Ctx_ModifySubRecord(&GetDefaultContext(), FormID, RecordSig, SubSig, OccurrenceIndex, GlobalIndex, NewUtf8Data);
 }
 
-bool SaveEsp(const char* SavePath);
+bool SaveEsp(EspContext& Ctx, const char* SavePath, const EspSaveOptions& Options);
+bool SaveEspToBuffer(EspContext& Ctx, const EspSaveOptions& Options, std::vector<uint8_t>& Out);
 
 bool C_SaveEsp(const char* Utf8Path)
 {
-	if (!Utf8Path) return false;
+	return C_Ctx_SaveEsp(&GetDefaultContext(), Utf8Path);
+}
+
+bool C_SaveEspEx(const char* Utf8Path, const EspSaveOptions* Options)
+{
+	return C_Ctx_SaveEspEx(&GetDefaultContext(), Utf8Path, Options);
+}
+
+uint8_t* C_SaveEspToBuffer(const EspSaveOptions* Options, size_t* OutSize)
+{
+	return C_Ctx_SaveEspToBuffer(&GetDefaultContext(), Options, OutSize);
+}
 
-	return SaveEsp(Utf8Path);
+void C_FreeEspBuffer(uint8_t* Buffer)
+{
+	delete[] Buffer;
 }
 
-const EspRecord* GetRecord(char* Key)
+const EspRecord* GetRecord(const EspData& Doc, char* Key)
 {
 	if (!Key)
 		return {};
 
 	std::string UniqueKey(Key);
 
-	auto Item = Data->FindByUniqueKey(UniqueKey);
+	auto Item = Doc.FindByUniqueKey(UniqueKey);
 
 	return Item;
 }
 
-void Clear()
+void C_Clear()
 {
-	delete Data;
-	Data = nullptr;
-
-	LastSetPath = TEXT("");
+	C_Ctx_Clear(&GetDefaultContext());
 }
 
-void C_Clear()
+void Close()
+{
+	EspContext& Ctx = GetDefaultContext();
+	std::lock_guard<std::mutex> Guard(Ctx.Lock);
+
+	delete Ctx.Filter;
+	Ctx.Filter = nullptr;
+
+	Ctx.ClearData();
+}
+
+#pragma region ContextApi
+
+EspContext* C_CreateContext()
+{
+	return new EspContext();
+}
+
+void C_DestroyContext(EspContext* Ctx)
+{
+	if (Ctx && Ctx != &GetDefaultContext())
+	{
+		delete Ctx;
+	}
+}
+
+EspContext* C_GetDefaultContext()
+{
+	return &GetDefaultContext();
+}
+
+int C_Ctx_SetDefaultFilter(EspContext* Ctx)
+{
+	if (!Ctx) return -1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	return SetDefaultFilter(Ctx->Filter);
+}
+
+int C_Ctx_SetFilter(EspContext* Ctx, const char* ParentSig, const char** ChildSigs, int ChildCount)
+{
+	if (!Ctx) return -1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	return SetFilter(Ctx->Filter, ParentSig, ChildSigs, ChildCount);
+}
+
+void C_Ctx_ClearFilter(EspContext* Ctx)
+{
+	if (!Ctx) return;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	ClearFilter(Ctx->Filter);
+}
+
+bool C_Ctx_LoadStrings(EspContext* Ctx, const char* Utf8EspPath, const char* Language)
+{
+	if (!Ctx || !Utf8EspPath) return false;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	bool Loaded = Ctx->Strings->LoadStringsFile(Utf8EspPath, Language ? Language : "english");
+	Ctx->PublishSnapshot();
+	return Loaded;
+}
+
+bool C_Ctx_LoadStringsFromBsa(EspContext* Ctx, const char* Utf8BsaPath, const char* Utf8EspPath, const char* Language)
+{
+	if (!Ctx || !Utf8BsaPath || !Utf8EspPath) return false;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	bool Loaded = Ctx->Strings->LoadStringsFromBsa(Utf8BsaPath, Utf8EspPath, Language ? Language : "english");
+	Ctx->PublishSnapshot();
+	return Loaded;
+}
+
+int C_Ctx_AddStringsLanguage(EspContext* Ctx, const char* Language)
+{
+	if (!Ctx || !Language) return -1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	return static_cast<int>(Ctx->Strings->AddLanguage(Language));
+}
+
+int C_Ctx_ReadEsp(EspContext* Ctx, const wchar_t* EspPath)
+{
+	if (!Ctx || !EspPath) return 1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	return ReadEsp(*Ctx, EspPath);
+}
+
+int C_Ctx_ReadEspFromMemory(EspContext* Ctx, const uint8_t* Data, size_t Size)
+{
+	if (!Ctx || (!Data && Size > 0)) return 1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	return ReadEspFromMemory(*Ctx, Data, Size);
+}
+
+int C_Ctx_ReadEspFromZip(EspContext* Ctx, const wchar_t* ZipPath, const char* PluginName, const char* Language)
+{
+	if (!Ctx || !ZipPath) return 1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	return ReadEspFromZip(*Ctx, ZipPath, PluginName, Language);
+}
+
+// Searches run on the current snapshot and never wait for an edit in progress.
+EspRecord** C_Ctx_SearchBySig(EspContext* Ctx, const char* ParentSig, const char* ChildSig, int* OutCount)
+{
+	*OutCount = 0;
+	if (!Ctx || !ParentSig) return nullptr;
+
+	std::shared_ptr<const EspSnapshot> Snap = Ctx->PinSnapshot();
+	if (!Snap) return nullptr;
+
+	return CopySearchResults(Snap->SearchBySig(ParentSig, ChildSig ? ChildSig : ""), OutCount);
+}
+
+EspRecord** C_Ctx_SearchRecords(EspContext* Ctx, const char* Utf8Query, int ExactMatch, int* OutCount)
+{
+	*OutCount = 0;
+	if (!Ctx || !Utf8Query) return nullptr;
+
+	std::shared_ptr<const EspSnapshot> Snap = Ctx->PinSnapshot();
+	if (!Snap) return nullptr;
+
+	return CopySearchResults(Snap->SearchRecords(Utf8Query, ExactMatch != 0), OutCount);
+}
+
+const char* C_Ctx_SubRecordData_GetString(EspContext* Ctx, const SubRecordData* subRecord)
+{
+	if (!Ctx || !subRecord) return nullptr;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	Ctx->StringBuffer = subRecord->GetString(Ctx->Strings);
+	return Ctx->StringBuffer.c_str();
+}
+
+int C_Ctx_SubRecordData_GetStringUtf8(EspContext* Ctx, const SubRecordData* subRecord, uint8_t* buffer, int bufferSize)
+{
+	if (!Ctx || !subRecord) return -1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	return CopyStringUtf8(subRecord->GetString(Ctx->Strings), buffer, bufferSize);
+}
+
+int C_Ctx_SubRecordData_GetStringInLanguageUtf8(EspContext* Ctx, const SubRecordData* subRecord, int Language, uint8_t* buffer, int bufferSize)
+{
+	if (!Ctx || !subRecord || Language < 0) return -1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (static_cast<size_t>(Language) >= Ctx->Strings->GetLanguageCount())
+		return -1;
+
+	Ctx->Strings->LoadLanguage(Language);
+
+	return CopyStringUtf8(subRecord->GetString(Ctx->Strings, Language), buffer, bufferSize);
+}
+
+int C_Ctx_SubRecordData_GetStringsInLanguagesUtf8(EspContext* Ctx, const SubRecordData* subRecord, const int* Languages, int Count, uint8_t** Buffers, int bufferSize, int* OutLengths)
+{
+	if (!Ctx || !subRecord || !Languages || !OutLengths || Count < 0) return -1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	std::vector<size_t> Indices(Count);
+	for (int i = 0; i < Count; ++i)
+	{
+		if (Languages[i] < 0 || static_cast<size_t>(Languages[i]) >= Ctx->Strings->GetLanguageCount())
+			return -1;
+		Indices[i] = static_cast<size_t>(Languages[i]);
+	}
+
+	if (!subRecord->IsLocalized || subRecord->Data.empty())
+	{
+		const std::string Text = subRecord->GetString(Ctx->Strings);
+		for (int i = 0; i < Count; ++i)
+		{
+			OutLengths[i] = CopyStringUtf8(Text, Buffers ? Buffers[i] : nullptr, bufferSize);
+		}
+		return Count;
+	}
+
+	std::vector<StringView> Views(Count);
+	int Found = static_cast<int>(Ctx->Strings->GetStringViews(subRecord->StringsType, subRecord->StringID, Indices.data(), Views.data(), Indices.size()));
+
+	for (int i = 0; i < Count; ++i)
+	{
+		const std::string Text = Views[i].found() ? Views[i].str() : "<StringID:" + std::to_string(subRecord->StringID) + ">";
+		OutLengths[i] = CopyStringUtf8(Text, Buffers ? Buffers[i] : nullptr, bufferSize);
+	}
+	return Found;
+}
+
+bool C_Ctx_ModifySubRecordByOffset(EspContext* Ctx, int IsCell, int RecordOffset, int SubOffset, const char* NewUtf8Data)
+{
+	if (!Ctx) return false;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	EspRecord* Rec = ModifySubRecordByOffset(Ctx->Data, IsCell, RecordOffset, SubOffset, NewUtf8Data);
+	if (!Rec) return false;
+
+	Ctx->PublishEdits();
+	return true;
+}
+
+bool C_Ctx_ModifySubRecord(EspContext* Ctx, uint32_t FormID, const char* RecordSig, const char* SubSig, int OccurrenceIndex, int GlobalIndex, const char* NewUtf8Data)
+{
+	if (!Ctx) return false;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	EspRecord* Rec = ModifySubRecord(Ctx->Data, FormID, RecordSig, SubSig, OccurrenceIndex, GlobalIndex, NewUtf8Data);
+	if (!Rec) return false;
+
+	Ctx->PublishEdits();
+	return true;
+}
+
+bool C_Ctx_SaveEsp(EspContext* Ctx, const char* Utf8Path)
+{
+	return C_Ctx_SaveEspEx(Ctx, Utf8Path, nullptr);
+}
+
+// Options may be null: best compression, one worker per core.
+bool C_Ctx_SaveEspEx(EspContext* Ctx, const char* Utf8Path, const EspSaveOptions* Options)
+{
+	if (!Ctx || !Utf8Path) return false;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	EspSaveOptions Effective = { ESP_COMPRESS_BEST, 0, 0 };
+	if (Options)
+	{
+		Effective = *Options;
+	}
+
+	return SaveEsp(*Ctx, Utf8Path, Effective);
+}
+
+// Options may be null, as for C_Ctx_SaveEspEx. String tables are never written.
+uint8_t* C_Ctx_SaveEspToBuffer(EspContext* Ctx, const EspSaveOptions* Options, size_t* OutSize)
+{
+	if (OutSize) *OutSize = 0;
+	if (!Ctx || !OutSize) return nullptr;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	EspSaveOptions Effective = { ESP_COMPRESS_BEST, 0, 0 };
+	if (Options)
+	{
+		Effective = *Options;
+	}
+
+	std::vector<uint8_t> Bytes;
+	if (!SaveEspToBuffer(*Ctx, Effective, Bytes))
+		return nullptr;
+
+	uint8_t* Buffer = new uint8_t[Bytes.empty() ? 1 : Bytes.size()];
+	if (!Bytes.empty())
+	{
+		std::memcpy(Buffer, Bytes.data(), Bytes.size());
+	}
+	*OutSize = Bytes.size();
+	return Buffer;
+}
+
+void C_Ctx_Clear(EspContext* Ctx)
+{
+	if (!Ctx) return;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	Ctx->ClearData();
+}
+
+uint64_t C_Ctx_GetRecordHandle(EspContext* Ctx, int IsCell, int RecordOffset)
+{
+	if (!Ctx || RecordOffset < 0) return INVALID_ESP_HANDLE;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return INVALID_ESP_HANDLE;
+
+	return Ctx->Data->GetRecordHandle(IsCell == 1, static_cast<size_t>(RecordOffset));
+}
+
+// Returns the total number of matches; fills at most Capacity handles.
+int C_Ctx_SearchBySigHandles(EspContext* Ctx, const char* ParentSig, const char* ChildSig, uint64_t* OutHandles, int Capacity)
+{
+	if (!Ctx || !ParentSig) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	std::string Parent(ParentSig);
+	std::string Child(ChildSig ? ChildSig : "");
+
+	int Count = 0;
+	auto Collect = [&](const RecordStore& Vec)
+		{
+			for (const auto& Rec : Vec)
+			{
+				if (Parent != "ALL" && Rec.Sig != Parent)
+					continue;
+
+				bool Match = Child.empty() || Child == "ALL";
+				for (size_t i = 0; !Match && i < Rec.SubRecords.size(); ++i)
+				{
+					Match = Rec.SubRecords[i].Sig == Child;
+				}
+
+				if (!Match)
+					continue;
+
+				if (OutHandles && Count < Capacity)
+				{
+					OutHandles[Count] = Rec.Handle;
+				}
+				Count++;
+			}
+		};
+
+	Collect(Ctx->Data->Records);
+	Collect(Ctx->Data->CellRecords);
+
+	return Count;
+}
+
+bool C_Ctx_IsHandleValid(EspContext* Ctx, uint64_t Handle)
+{
+	if (!Ctx) return false;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return false;
+
+	const EspData& Doc = *Ctx->Data;
+	return Doc.ResolveRecord(Handle) != NULL || Doc.ResolveSubRecord(Handle) != NULL;
+}
+
+// The returned pointer is live (not a copy), for reading only, and valid
+// until the next call that changes the document; keep the handle, not the
+// pointer. It is not a snapshot: an edit on another thread is not isolated
+// from it.
+EspRecord* C_Ctx_ResolveRecord(EspContext* Ctx, uint64_t RecordHandle)
+{
+	if (!Ctx) return nullptr;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return nullptr;
+
+	const EspData& Doc = *Ctx->Data;
+	return const_cast<EspRecord*>(Doc.ResolveRecord(RecordHandle));
+}
+
+const SubRecordData* C_Ctx_ResolveSubRecord(EspContext* Ctx, uint64_t SubRecordHandle)
+{
+	if (!Ctx) return nullptr;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return nullptr;
+
+	const EspData& Doc = *Ctx->Data;
+	return Doc.ResolveSubRecord(SubRecordHandle);
+}
+
+bool C_Ctx_ModifySubRecordByHandle(EspContext* Ctx, uint64_t SubRecordHandle, const char* NewUtf8Data)
+{
+	if (!Ctx) return false;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	EspRecord* Rec = ModifySubRecordByHandle(Ctx->Data, SubRecordHandle, NewUtf8Data);
+	if (!Rec) return false;
+
+	Ctx->PublishEdits();
+	return true;
+}
+
+uint64_t C_Ctx_FindByEditorID(EspContext* Ctx, const char* EditorID)
+{
+	if (!Ctx || !EditorID) return INVALID_ESP_HANDLE;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return INVALID_ESP_HANDLE;
+
+	const EditorIDIndex::Entry* Match = Ctx->Data->EditorIDs.FindExact(EditorID);
+	return Match ? Match->Handle : INVALID_ESP_HANDLE;
+}
+
+int C_Ctx_SearchEditorIDPrefix(EspContext* Ctx, const char* Prefix, uint64_t* OutHandles, int Capacity)
+{
+	if (!Ctx || !Prefix) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	return CopyHandles(Ctx->Data->SearchEditorIDPrefix(Prefix), OutHandles, Capacity);
+}
+
+int C_Ctx_SearchEditorIDGlob(EspContext* Ctx, const char* Pattern, uint64_t* OutHandles, int Capacity)
+{
+	if (!Ctx || !Pattern) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	return CopyHandles(Ctx->Data->SearchEditorIDGlob(Pattern), OutHandles, Capacity);
+}
+
+uint32_t C_Ctx_FindFormIDByEditorID(EspContext* Ctx, const char* EditorID, char* OutSig)
+{
+	if (!Ctx || !EditorID) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	const EditorIDIndex::Entry* Match = Ctx->Data->EditorIDs.FindExact(EditorID);
+	if (!Match) return 0;
+
+	if (OutSig)
+	{
+		std::memcpy(OutSig, Match->Sig.data(), 4);
+	}
+	return Match->FormID;
+}
+
+int CopyFormIDs(const std::vector<const EditorIDIndex::Entry*>& Matches, uint32_t* OutFormIDs, int Capacity)
+{
+	const int Count = static_cast<int>(Matches.size());
+	if (OutFormIDs)
+	{
+		for (int i = 0; i < Count && i < Capacity; ++i)
+		{
+			OutFormIDs[i] = Matches[i]->FormID;
+		}
+	}
+	return Count;
+}
+
+int C_Ctx_SearchEditorIDPrefixFormIDs(EspContext* Ctx, const char* Prefix, uint32_t* OutFormIDs, int Capacity)
+{
+	if (!Ctx || !Prefix) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	std::vector<const EditorIDIndex::Entry*> Matches;
+	Ctx->Data->EditorIDs.FindPrefix(Prefix, Matches);
+	return CopyFormIDs(Matches, OutFormIDs, Capacity);
+}
+
+int C_Ctx_SearchEditorIDGlobFormIDs(EspContext* Ctx, const char* Pattern, uint32_t* OutFormIDs, int Capacity)
+{
+	if (!Ctx || !Pattern) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	std::vector<const EditorIDIndex::Entry*> Matches;
+	Ctx->Data->EditorIDs.FindGlob(Pattern, Matches);
+	return CopyFormIDs(Matches, OutFormIDs, Capacity);
+}
+
+int C_Ctx_SearchPayloadHash(EspContext* Ctx, uint64_t Hash, uint64_t* OutHandles, int Capacity)
+{
+	if (!Ctx) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	return CopyHandles(Ctx->Data->FindByPayloadHash(Hash), OutHandles, Capacity);
+}
+
+int C_Ctx_SearchContentHash(EspContext* Ctx, uint64_t Hash, uint64_t* OutHandles, int Capacity)
+{
+	if (!Ctx) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	return CopyHandles(Ctx->Data->FindByContentHash(Hash), OutHandles, Capacity);
+}
+
+#pragma endregion
+
+#pragma region SnapshotApi
+
+EspSnapshotPin* C_Ctx_PinSnapshot(EspContext* Ctx)
+{
+	if (!Ctx) return nullptr;
+
+	std::shared_ptr<const EspSnapshot> Snap = Ctx->PinSnapshot();
+	if (!Snap) return nullptr;
+
+	EspSnapshotPin* Pin = new EspSnapshotPin();
+	Pin->Snapshot = Snap;
+	return Pin;
+}
+
+void C_Snapshot_Release(EspSnapshotPin* Pin)
+{
+	delete Pin;
+}
+
+uint64_t C_Snapshot_GetVersion(const EspSnapshotPin* Pin)
+{
+	return Pin ? Pin->Snapshot->Version : 0;
+}
+
+int C_Snapshot_GetRecordCount(const EspSnapshotPin* Pin, int IsCell)
+{
+	return Pin ? static_cast<int>(Pin->Snapshot->Size(IsCell == 1)) : 0;
+}
+
+EspRecord** C_Snapshot_SearchBySig(const EspSnapshotPin* Pin, const char* ParentSig, const char* ChildSig, int* OutCount)
+{
+	*OutCount = 0;
+	if (!Pin || !ParentSig) return nullptr;
+
+	return CopySearchResults(Pin->Snapshot->SearchBySig(ParentSig, ChildSig ? ChildSig : ""), OutCount);
+}
+
+EspRecord** C_Snapshot_SearchRecords(const EspSnapshotPin* Pin, const char* Utf8Query, int ExactMatch, int* OutCount)
+{
+	*OutCount = 0;
+	if (!Pin || !Utf8Query) return nullptr;
+
+	return CopySearchResults(Pin->Snapshot->SearchRecords(Utf8Query, ExactMatch != 0), OutCount);
+}
+
+#pragma endregion
+
+#pragma region QueryApi
+
+QueryExpr* C_Query_RecordSig(const char* Sig)
+{
+	return Sig ? new QueryExpr(QueryExpr::RecordSig(Sig)) : nullptr;
+}
+
+QueryExpr* C_Query_SubSig(const char* Sig)
+{
+	return Sig ? new QueryExpr(QueryExpr::SubSig(Sig)) : nullptr;
+}
+
+QueryExpr* C_Query_FormIDRange(uint32_t Min, uint32_t Max)
+{
+	return new QueryExpr(QueryExpr::FormIDRange(Min, Max));
+}
+
+QueryExpr* C_Query_HasFlags(uint32_t Mask)
+{
+	return new QueryExpr(QueryExpr::HasFlags(Mask));
+}
+
+QueryExpr* C_Query_EditorID(const char* GlobPattern)
+{
+	return GlobPattern ? new QueryExpr(QueryExpr::EditorID(GlobPattern)) : nullptr;
+}
+
+QueryExpr* C_Query_Localized(int IsLocalized)
+{
+	return new QueryExpr(QueryExpr::Localized(IsLocalized != 0));
+}
+
+QueryExpr* C_Query_TextContains(const char* Utf8Text)
+{
+	return Utf8Text ? new QueryExpr(QueryExpr::TextContains(Utf8Text)) : nullptr;
+}
+
+QueryExpr* C_Query_Translatable(int CanTranslate)
+{
+	return new QueryExpr(QueryExpr::Translatable(CanTranslate != 0));
+}
+
+QueryExpr* C_Query_And(const QueryExpr* A, const QueryExpr* B)
+{
+	if (!A || !B) return nullptr;
+	return new QueryExpr(*A && *B);
+}
+
+QueryExpr* C_Query_Or(const QueryExpr* A, const QueryExpr* B)
+{
+	if (!A || !B) return nullptr;
+	return new QueryExpr(*A || *B);
+}
+
+QueryExpr* C_Query_Not(const QueryExpr* A)
+{
+	if (!A) return nullptr;
+	return new QueryExpr(!*A);
+}
+
+void C_Query_Free(QueryExpr* Expr)
+{
+	delete Expr;
+}
+
+int C_Ctx_QueryExecute(EspContext* Ctx, const QueryExpr* Expr, int EachSubRecord, int Offset, int Limit, uint64_t* OutRecordHandles, uint64_t* OutSubHandles, int Capacity)
+{
+	if (!Ctx || Offset < 0 || Limit < 0) return 0;
+	if (!OutRecordHandles || Capacity < 0) Capacity = 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	EspQuery Query(*Ctx->Data);
+	if (Expr) Query.Where(*Expr);
+	Query.EachSubRecord(EachSubRecord != 0).Offset(Offset).Limit(Limit);
+
+	int Total = 0;
+	for (EspQuery::Iterator It = Query.begin(); It != Query.end(); ++It)
+	{
+		if (Total < Capacity)
+		{
+			OutRecordHandles[Total] = It->Record->Handle;
+			if (OutSubHandles)
+			{
+				OutSubHandles[Total] = It->Sub ? It->Sub->Handle : INVALID_ESP_HANDLE;
+			}
+		}
+		Total++;
+	}
+
+	return Total;
+}
+
+int C_Ctx_QueryCount(EspContext* Ctx, const QueryExpr* Expr, int EachSubRecord)
+{
+	if (!Ctx) return 0;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return 0;
+
+	EspQuery Query(*Ctx->Data);
+	if (Expr) Query.Where(*Expr);
+	Query.EachSubRecord(EachSubRecord != 0);
+
+	return static_cast<int>(Query.Count());
+}
+
+#pragma endregion
+
+#pragma region SaveFunc
+
+// StringID to write in place of an edited subrecord's text (localized saves).
+typedef std::unordered_map<const SubRecordData*, uint32_t> StringIDMap;
+
+// Bytes to write for an edited subrecord: its StringID in a localized save, else its data.
+const uint8_t* EditedSubRecordBytes(const SubRecordData& Sub, const StringIDMap* StringIDs, uint32_t& IDScratch, size_t& Size)
+{
+	if (StringIDs)
+	{
+		StringIDMap::const_iterator ID = StringIDs->find(&Sub);
+		if (ID != StringIDs->end())
+		{
+			IDScratch = ID->second;
+			Size = 4;
+			return reinterpret_cast<const uint8_t*>(&IDScratch);
+		}
+	}
+
+	Size = Sub.Data.size();
+	return Sub.Data.data();
+}
+
+// Splices the record's subrecords back into its original subrecord stream.
+// Both are in file order, so a single merge by SourceIndex finds every edit.
+// The first pass only sizes the output, the second fills it.
+std::vector<uint8_t> ModifySubRecords(
+	const uint8_t* OriginalData,
+	size_t OriginalSize,
+	const EspRecord* ModifiedRecord,
+	const StringIDMap* StringIDs = nullptr)
+{
+	const std::vector<SubRecordData>& Subs = ModifiedRecord->SubRecords;
+	uint32_t IDScratch = 0;
+
+	size_t ResultSize = 0;
+	size_t End = 0;
+	{
+		size_t Offset = 0;
+		size_t Next = 0;
+
+		for (int Index = 0; Offset + sizeof(SubRecordHeader) <= OriginalSize; ++Index)
+		{
+			SubRecordHeader SH;
+			std::memcpy(&SH, OriginalData + Offset, sizeof(SH));
+
+			if (Offset + sizeof(SubRecordHeader) + SH.Size > OriginalSize)
+			{
+				std::cerr << "Warning: Corrupted subrecord data at offset " << Offset << "\n";
+				break;
+			}
+
+			size_t Size = SH.Size;
+			if (Next < Subs.size() && Subs[Next].SourceIndex == Index)
+			{
+				if (std::memcmp(Subs[Next].Sig.data(), SH.Sig, 4) == 0)
+				{
+					EditedSubRecordBytes(Subs[Next], StringIDs, IDScratch, Size);
+					if (Size > 0xFFFF)
+					{
+						std::cerr << "Error: Subrecord " << Subs[Next].Sig << " size exceeds 65535 bytes\n";
+						return {};
+					}
+				}
+				++Next;
+			}
+
+			ResultSize += sizeof(SubRecordHeader) + Size;
+			Offset += sizeof(SubRecordHeader) + SH.Size;
+		}
+		End = Offset;
+	}
+
+	std::vector<uint8_t> Result(ResultSize);
+	uint8_t* Write = Result.data();
+
+	size_t Offset = 0;
+	size_t Next = 0;
+
+	for (int Index = 0; Offset < End; ++Index)
+	{
+		SubRecordHeader SH;
+		std::memcpy(&SH, OriginalData + Offset, sizeof(SH));
+		const size_t OriginalSubSize = sizeof(SubRecordHeader) + SH.Size;
+
+		const SubRecordData* Edited = nullptr;
+		if (Next < Subs.size() && Subs[Next].SourceIndex == Index)
+		{
+			if (std::memcmp(Subs[Next].Sig.data(), SH.Sig, 4) == 0)
+			{
+				Edited = &Subs[Next];
+			}
+			++Next;
+		}
+
+		if (Edited)
+		{
+			size_t Size = 0;
+			const uint8_t* Bytes = EditedSubRecordBytes(*Edited, StringIDs, IDScratch, Size);
+
+			SH.Size = static_cast<uint16_t>(Size);
+			std::memcpy(Write, &SH, sizeof(SH));
+			if (Size > 0)
+			{
+				std::memcpy(Write + sizeof(SH), Bytes, Size);
+			}
+			Write += sizeof(SH) + Size;
+		}
+		else
+		{
+			std::memcpy(Write, OriginalData + Offset, OriginalSubSize);
+			Write += OriginalSubSize;
+		}
+
+		Offset += OriginalSubSize;
+	}
+
+	return Result;
+}
+
+int CompressionLevelFor(int Policy, const std::vector<uint8_t>& OriginalPayload)
+{
+	switch (Policy)
+	{
+	case ESP_COMPRESS_FASTEST:
+		return Z_BEST_SPEED;
+	case ESP_COMPRESS_MATCH_ORIGINAL:
+		// FLEVEL in the zlib header: 0 fastest, 1 fast, 2 default, 3 maximum.
+		if (OriginalPayload.size() >= 6)
+		{
+			static const int Levels[4] = { 1, 3, 6, 9 };
+			return Levels[OriginalPayload[5] >> 6];
+		}
+		return Z_DEFAULT_COMPRESSION;
+	default:
+		return Z_BEST_COMPRESSION;
+	}
+}
+
+// Rebuilds one edited record from its source bytes: header and payload,
+// inflated, spliced with the edited subrecords and deflated again.
+// OriginalSize receives the size of the record in the source.
+bool EncodeRecord(EspSource& Src, const EspRecord& Rec, int Policy, const StringIDMap* StringIDs, std::vector<uint8_t>& Out, uint64_t& OriginalSize)
+{
+	RecordHeader HDR{};
+	if (!Src.Seek(static_cast<uint64_t>(Rec.SourceOffset)) || !Src.Read(&HDR, sizeof(HDR)))
+		return false;
+
+	OriginalSize = sizeof(HDR) + static_cast<uint64_t>(HDR.DataSize);
+
+	std::vector<uint8_t> OriginalData(HDR.DataSize);
+	if (!Src.Read(OriginalData.data(), HDR.DataSize))
+		return false;
+
+	std::vector<uint8_t> WorkingData;
+	bool WasCompressed = IsCompressed(HDR);
+
+	if (WasCompressed)
+	{
+		uint32_t UncompressedSize;
+		std::memcpy(&UncompressedSize, OriginalData.data(), 4);
+
+		if (!ZlibDecompress(OriginalData.data() + 4,
+			OriginalData.size() - 4,
+			WorkingData,
+			UncompressedSize))
+		{
+			std::cerr << "Error: Decompression failed for " << Rec.Sig
+				<< " FormID 0x" << std::hex << HDR.FormID << std::dec << "\n";
+			return false;
+		}
+	}
+	else
+	{
+		WorkingData.swap(OriginalData);
+	}
+
+	WorkingData = ModifySubRecords(WorkingData.data(), WorkingData.size(), &Rec, StringIDs);
+
+	std::vector<uint8_t> FinalData;
+	if (WasCompressed)
+	{
+		std::vector<uint8_t> Compressed;
+		if (!ZlibCompress(WorkingData.data(), WorkingData.size(), Compressed, CompressionLevelFor(Policy, OriginalData)))
+		{
+			std::cerr << "Error: Compression failed for " << Rec.Sig
+				<< " FormID 0x" << std::hex << HDR.FormID << std::dec << "\n";
+			return false;
+		}
+
+		FinalData.resize(4 + Compressed.size());
+		uint32_t UncompSize = static_cast<uint32_t>(WorkingData.size());
+		std::memcpy(FinalData.data(), &UncompSize, 4);
+		std::memcpy(FinalData.data() + 4, Compressed.data(), Compressed.size());
+	}
+	else
+	{
+		FinalData.swap(WorkingData);
+	}
+
+	HDR.DataSize = static_cast<uint32_t>(FinalData.size());
+
+	Out.resize(sizeof(HDR) + FinalData.size());
+	std::memcpy(Out.data(), &HDR, sizeof(HDR));
+	if (!FinalData.empty())
+	{
+		std::memcpy(Out.data() + sizeof(HDR), FinalData.data(), FinalData.size());
+	}
+	return true;
+}
+
+// Which parts of the source must be rebuilt. Everything else is copied verbatim.
+// Edited records are re-encoded by a worker pool in file order. The writer
+// asks for the size change of a GRUP before writing its header (SizeDelta)
+// and then takes each record's bytes as it reaches it (TakeEncoded).
+class SavePlan
+{
+public:
+	// Edited records, sorted by SourceOffset.
+	std::vector<const EspRecord*> Dirty;
+	std::vector<char> CopyBuffer;
+
+	SavePlan(const EspData& Doc, const EspSource& Source, const EspSaveOptions& Options, const StringIDMap* StringIDs)
+		: Dirty(Doc.GetDirtyRecords()), CopyBuffer(1 << 20), Source_(Source),
+		Policy_(Options.CompressionPolicy), StringIDs_(StringIDs), Encoded_(Dirty.size()), OriginalSize_(Dirty.size(), 0),
+		State_(Dirty.size(), Pending), NextToEncode_(0), NextToWrite_(0), RequiredEnd_(0), Window_(0), Stop_(false)
+	{
+		size_t ThreadCount = Options.ThreadCount > 0 ? static_cast<size_t>(Options.ThreadCount) : std::thread::hardware_concurrency();
+		if (ThreadCount > Dirty.size()) ThreadCount = Dirty.size();
+
+		// One edited record is not worth a thread; the writer encodes it itself.
+		if (ThreadCount > 1)
+		{
+			Window_ = ThreadCount * 64;
+			for (size_t i = 0; i < ThreadCount; ++i)
+			{
+				Workers_.push_back(std::thread(&SavePlan::WorkerMain, this));
+			}
+		}
+	}
+
+	~SavePlan()
+	{
+		{
+			std::lock_guard<std::mutex> Guard(Lock_);
+			Stop_ = true;
+		}
+		Changed_.notify_all();
+
+		for (size_t i = 0; i < Workers_.size(); ++i)
+		{
+			Workers_[i].join();
+		}
+	}
+
+	// Index into Dirty of the record at Offset, or -1.
+	int64_t FindDirty(uint64_t Offset) const
+	{
+		size_t Index = LowerBound(Offset);
+		return (Index < Dirty.size() && static_cast<uint64_t>(Dirty[Index]->SourceOffset) == Offset) ? static_cast<int64_t>(Index) : -1;
+	}
+
+	// A GRUP is dirty when an edited record lies inside its byte range.
+	bool AnyDirtyIn(uint64_t Begin, uint64_t End) const
+	{
+		return LowerBound(Begin) < LowerBound(End);
+	}
+
+	// How much the edited records in [Begin, End) grow (or shrink) the output.
+	bool SizeDelta(uint64_t Begin, uint64_t End, int64_t& Delta)
+	{
+		size_t First = LowerBound(Begin);
+		size_t Last = LowerBound(End);
+
+		if (!WaitEncoded(First, Last))
+			return false;
+
+		std::lock_guard<std::mutex> Guard(Lock_);
+		Delta = 0;
+		for (size_t i = First; i < Last; ++i)
+		{
+			Delta += static_cast<int64_t>(Encoded_[i].size()) - static_cast<int64_t>(OriginalSize_[i]);
+		}
+		return true;
+	}
+
+	// Complete bytes (header + payload) of Dirty[Index] and its size in the source.
+	bool TakeEncoded(size_t Index, std::vector<uint8_t>& Out, uint64_t& OriginalSize)
+	{
+		if (!WaitEncoded(Index, Index + 1))
+			return false;
+
+		{
+			std::lock_guard<std::mutex> Guard(Lock_);
+			Out.swap(Encoded_[Index]);
+			std::vector<uint8_t>().swap(Encoded_[Index]);
+			OriginalSize = OriginalSize_[Index];
+			NextToWrite_ = Index + 1;
+		}
+		Changed_.notify_all();
+		return true;
+	}
+
+private:
+	enum EncodeState { Pending, Done, Failed };
+
+	const EspSource& Source_;
+	int Policy_;
+	const StringIDMap* StringIDs_;
+	std::vector<std::vector<uint8_t> > Encoded_;
+	std::vector<uint64_t> OriginalSize_;
+	std::vector<EncodeState> State_;
+	size_t NextToEncode_;
+	size_t NextToWrite_;
+	// The writer is blocked until everything below this is encoded.
+	size_t RequiredEnd_;
+	// How far workers may otherwise run ahead of the writer, bounding memory use.
+	size_t Window_;
+	bool Stop_;
+	std::mutex Lock_;
+	std::condition_variable Changed_;
+	std::vector<std::thread> Workers_;
+	std::unique_ptr<EspSource> InlineSource_;
+
+	size_t LowerBound(uint64_t Offset) const
+	{
+		return std::lower_bound(Dirty.begin(), Dirty.end(), Offset,
+			[](const EspRecord* Rec, uint64_t Off) { return static_cast<uint64_t>(Rec->SourceOffset) < Off; }) - Dirty.begin();
+	}
+
+	bool WaitEncoded(size_t First, size_t Last)
+	{
+		if (First >= Last)
+			return true;
+
+		if (Workers_.empty())
+		{
+			for (size_t i = First; i < Last; ++i)
+			{
+				if (State_[i] != Pending)
+					continue;
+
+				if (!InlineSource_)
+				{
+					InlineSource_ = Source_.Reopen();
+				}
+				State_[i] = EncodeRecord(*InlineSource_, *Dirty[i], Policy_, StringIDs_, Encoded_[i], OriginalSize_[i]) ? Done : Failed;
+			}
+		}
+		else
+		{
+			std::unique_lock<std::mutex> Guard(Lock_);
+
+			// Records the writer skipped must not hold back the window.
+			if (First > NextToWrite_) NextToWrite_ = First;
+			if (Last > RequiredEnd_) RequiredEnd_ = Last;
+			Changed_.notify_all();
+
+			Changed_.wait(Guard, [&]
+				{
+					for (size_t i = First; i < Last; ++i)
+					{
+						if (State_[i] == Pending) return false;
+					}
+					return true;
+				});
+		}
+
+		for (size_t i = First; i < Last; ++i)
+		{
+			if (State_[i] != Done)
+			{
+				std::cerr << "Error: Failed to rebuild " << Dirty[i]->Sig
+					<< " FormID 0x" << std::hex << Dirty[i]->FormID << std::dec << "\n";
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void WorkerMain()
+	{
+		std::unique_ptr<EspSource> Src = Source_.Reopen();
+
+		for (;;)
+		{
+			size_t Index;
+			{
+				std::unique_lock<std::mutex> Guard(Lock_);
+				Changed_.wait(Guard, [&]
+					{
+						return Stop_ || NextToEncode_ >= Dirty.size() ||
+							NextToEncode_ < NextToWrite_ + Window_ || NextToEncode_ < RequiredEnd_;
+					});
+
+				if (Stop_ || NextToEncode_ >= Dirty.size())
+					return;
+
+				Index = NextToEncode_++;
+			}
+
+			std::vector<uint8_t> Bytes;
+			uint64_t OriginalSize = 0;
+			bool Ok = EncodeRecord(*Src, *Dirty[Index], Policy_, StringIDs_, Bytes, OriginalSize);
+
+			{
+				std::lock_guard<std::mutex> Guard(Lock_);
+				Encoded_[Index].swap(Bytes);
+				OriginalSize_[Index] = OriginalSize;
+				State_[Index] = Ok ? Done : Failed;
+			}
+			Changed_.notify_all();
+		}
+	}
+
+	SavePlan(const SavePlan&);
+	SavePlan& operator=(const SavePlan&);
+};
+
+// Streams [Src.Position(), End) of the source to Out, forward only.
+// Untouched GRUPs and records are copied as raw byte ranges; the size of a
+// dirty GRUP is known before its header is written, so nothing is patched later.
+bool WriteRange(SavePlan& Plan, EspSource& Src, EspSink& Out, uint64_t End)
+{
+	while (Src.Position() < End)
+	{
+		uint64_t Start = Src.Position();
+
+		// Trailing bytes too short to be a record are kept as they are.
+		if (End - Start < 24)
+		{
+			std::cerr << "Warning: Copying " << (End - Start) << " trailing bytes\n";
+			if (!Src.CopyTo(Out, End - Start, Plan.CopyBuffer))
+				return false;
+			break;
+		}
+
+		uint8_t Header[24];
+		if (!Src.Read(Header, sizeof(Header)))
+			return false;
+
+		if (IsGRUP(reinterpret_cast<const char*>(Header)))
+		{
+			GroupHeader GH;
+			std::memcpy(&GH, Header, sizeof(GH));
+
+			if (GH.Size < 24 || Start + GH.Size > End)
+			{
+				std::cerr << "Error: Invalid GRUP size: " << GH.Size << " at position " << Start << "\n";
+				return false;
+			}
+
+			uint64_t GrupEnd = Start + GH.Size;
+
+			if (!Plan.AnyDirtyIn(Start, GrupEnd))
+			{
+				if (!Out.Write(&GH, sizeof(GH)) || !Src.CopyTo(Out, GH.Size - 24, Plan.CopyBuffer))
+					return false;
+				continue;
+			}
+
+			int64_t Delta = 0;
+			if (!Plan.SizeDelta(Start, GrupEnd, Delta))
+				return false;
+
+			GH.Size = static_cast<uint32_t>(static_cast<int64_t>(GH.Size) + Delta);
+
+			if (!Out.Write(&GH, sizeof(GH)) || !WriteRange(Plan, Src, Out, GrupEnd))
+				return false;
+		}
+		else
+		{
+			RecordHeader HDR;
+			std::memcpy(&HDR, Header, sizeof(HDR));
+
+			if (Start + 24 + HDR.DataSize > End)
+			{
+				std::cerr << "Error: Record overruns its GRUP at position " << Start << "\n";
+				return false;
+			}
+
+			int64_t DirtyIndex = Plan.FindDirty(Start);
+
+			if (DirtyIndex >= 0)
+			{
+				std::vector<uint8_t> Encoded;
+				uint64_t OriginalSize = 0;
+				if (!Plan.TakeEncoded(static_cast<size_t>(DirtyIndex), Encoded, OriginalSize))
+					return false;
+
+				if (!Src.Skip(HDR.DataSize) || !Out.Write(Encoded.data(), Encoded.size()))
+					return false;
+			}
+			else
+			{
+				if (!Out.Write(&HDR, sizeof(HDR)) || !Src.CopyTo(Out, HDR.DataSize, Plan.CopyBuffer))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Writes Doc applied to the plugin in Src. Out is only ever appended to.
+// StringIDs, if given, replaces the text of edited localized subrecords.
+bool SaveEspTo(const EspData& Doc, EspSource& Src, EspSink& Out, const EspSaveOptions& Options, const StringIDMap* StringIDs)
+{
+	SavePlan Plan(Doc, Src, Options, StringIDs);
+
+	if (!Src.Seek(0))
+		return false;
+
+	return WriteRange(Plan, Src, Out, Src.Size()) && Out.Flush();
+}
+
+bool IsLocalizedPlugin(EspSource& Src)
+{
+	RecordHeader HDR{};
+	if (!Src.Seek(0) || !Src.Read(&HDR, sizeof(HDR)))
+		return false;
+
+	return std::memcmp(HDR.Sig, "TES4", 4) == 0 && (HDR.Flags & 0x80) != 0;
+}
+
+// Edited localized subrecords get a new StringID, counting up from
+// NextFreeID in file order: their old one may be shared with subrecords the
+// filter did not keep, so it is left to them. Their text goes into the table
+// for their subrecord type.
+void CollectLocalizedEdits(const EspData& Doc, uint32_t NextFreeID, StringIDMap& IDs, StringsTable* Tables)
+{
+	std::vector<const EspRecord*> Dirty = Doc.GetDirtyRecords();
+	for (const EspRecord* Rec : Dirty)
+	{
+		for (const auto& Sub : Rec->SubRecords)
+		{
+			if (Sub.IsLocalized || Sub.SourceStringID == 0)
+				continue;
+
+			uint32_t ID = NextFreeID++;
+			IDs[&Sub] = ID;
+
+			std::string Text(Sub.Data.begin(), std::find(Sub.Data.begin(), Sub.Data.end(), 0));
+			Tables[StringsFileTypeFor(Rec->Sig, Sub.Sig)].Set(ID, Text);
+		}
+	}
+}
+
+bool MoveFileReplacing(const std::string& From, const std::string& To)
+{
+#ifdef _WIN32
+	return MoveFileExA(From.c_str(), To.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return std::rename(From.c_str(), To.c_str()) == 0;
+#endif
+}
+
+// The strings files of one save. Each table is written as <file>.tmp, and a
+// file it replaces is kept as <file>.bak until the whole save has gone
+// through, so a failure at any step can put every file back.
+struct StagedStringTables
+{
+	std::vector<std::string> Paths;
+	std::vector<bool> BackedUp;   // the file existed and is now <file>.bak
+	size_t Committed;             // Paths[0, Committed) hold the new tables
+
+	StagedStringTables() : Committed(0) {}
+};
+
+// Puts back the files the committed tables replaced and removes the rest.
+void RollBackStringTables(StagedStringTables& Staged)
+{
+	for (size_t i = 0; i < Staged.Committed; ++i)
+	{
+		if (Staged.BackedUp[i])
+			MoveFileReplacing(Staged.Paths[i] + ".bak", Staged.Paths[i]);
+		else
+			std::remove(Staged.Paths[i].c_str());
+	}
+	for (size_t i = Staged.Committed; i < Staged.Paths.size(); ++i)
+	{
+		if (Staged.BackedUp[i])
+			MoveFileReplacing(Staged.Paths[i] + ".bak", Staged.Paths[i]);
+		std::remove((Staged.Paths[i] + ".tmp").c_str());
+	}
+	Staged.Committed = 0;
+}
+
+// Writes each table next to its strings file as <file>.tmp.
+bool StageStringTables(const StringsManager& Strings, const std::string& EspPath, const std::string& Language, const StringsTable* Tables, StagedStringTables& Staged)
+{
+	for (int i = 0; i < StringsTypeCount; ++i)
+	{
+		std::string Path = Strings.BuildStringsPath(EspPath, Language, StringsFileExtension(Tables[i].GetType()));
+		Staged.Paths.push_back(Path);
+		Staged.BackedUp.push_back(false);
+
+		size_t Slash = Path.find_last_of("/\\");
+		if (Slash != std::string::npos)
+		{
+			CreateDirectoryA(Path.substr(0, Slash).c_str(), NULL);
+		}
+
+		if (!Tables[i].Save(Path + ".tmp"))
+		{
+			std::cerr << "Error: Cannot write strings file: " << Path << "\n";
+			RollBackStringTables(Staged);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Moves the staged tables over the strings files, keeping each replaced file
+// as <file>.bak. Rolls every file back if one cannot be moved, e.g. because
+// it is still mapped somewhere.
+bool CommitStringTables(StagedStringTables& Staged)
+{
+	for (size_t i = 0; i < Staged.Paths.size(); ++i)
+	{
+		const std::string& Path = Staged.Paths[i];
+		if (std::ifstream(Path.c_str(), std::ios::binary).is_open())
+		{
+			if (!MoveFileReplacing(Path, Path + ".bak"))
+			{
+				std::cerr << "Error: Cannot replace strings file: " << Path << "\n";
+				RollBackStringTables(Staged);
+				return false;
+			}
+			Staged.BackedUp[i] = true;
+		}
+
+		if (!MoveFileReplacing(Path + ".tmp", Path))
+		{
+			std::cerr << "Error: Cannot replace strings file: " << Path << "\n";
+			RollBackStringTables(Staged);
+			return false;
+		}
+		Staged.Committed = i + 1;
+	}
+	return true;
+}
+
+// Drops the backups once the save is complete. A backup still mapped by a
+// pinned snapshot stays behind and is replaced by the next save.
+void FinishStringTables(const StagedStringTables& Staged)
+{
+	for (size_t i = 0; i < Staged.Paths.size(); ++i)
+	{
+		if (Staged.BackedUp[i])
+			std::remove((Staged.Paths[i] + ".bak").c_str());
+	}
+}
+
+// The plugin the context was read from: its file, or its bytes for a read from memory.
+std::unique_ptr<EspSource> OpenContextSource(const EspContext& Ctx)
+{
+	if (Ctx.SourceBytes)
+		return std::unique_ptr<EspSource>(new MemorySource(Ctx.SourceBytes));
+
+	if (Ctx.LastSetPath.empty())
+		return nullptr;
+
+	std::unique_ptr<FileSource> Src(new FileSource(Ctx.LastSetPath));
+	if (!Src->IsOpen())
+		return nullptr;
+
+	return std::unique_ptr<EspSource>(Src.release());
+}
+
+bool SaveEsp(EspContext& Ctx, const char* SavePath, const EspSaveOptions& Options)
+{
+	std::unique_ptr<EspSource> Source = OpenContextSource(Ctx);
+	if (!Ctx.Data || !Source)
+	{
+		//std::cerr << "Error: No source ESP file path set\n";
+		return false;
+	}
+	EspSource& Src = *Source;
+
+	bool KeepStringIDs = Options.WriteStringTables != 0 && IsLocalizedPlugin(Src);
+
+	StringsTable Tables[StringsTypeCount] = {
+		StringsTable(StringsTypeStrings), StringsTable(StringsTypeDLStrings), StringsTable(StringsTypeILStrings) };
+	StringIDMap StringIDs;
+	std::string Language = Ctx.Strings->GetCurrentLanguage();
+
+	if (KeepStringIDs)
+	{
+		// Start from the strings the context loaded, loose, from an archive or
+		// from memory, so untouched strings carry over.
+		if (Ctx.Strings->GetStringCount() == 0)
+		{
+			std::cerr << "Error: No strings loaded for a localized plugin; load them before saving string tables\n";
+			return false;
+		}
+
+		uint32_t MaxID = 0;
+		for (int i = 0; i < StringsTypeCount; ++i)
+		{
+			Ctx.Strings->CopyStrings(Tables[i].GetType(), Tables[i]);
+			if (Tables[i].MaxID() > MaxID) MaxID = Tables[i].MaxID();
+		}
+
+		CollectLocalizedEdits(*Ctx.Data, MaxID + 1, StringIDs, Tables);
+	}
+
+	// The plugin and its tables are all written to temp files first. Nothing
+	// is replaced until every one of them is complete, and the plugin goes
+	// last so that it never refers to strings that are not in place.
+	StagedStringTables Staged;
+	if (KeepStringIDs && !StageStringTables(*Ctx.Strings, SavePath, Language, Tables, Staged))
+		return false;
+
+	const std::string TempPath = std::string(SavePath) + ".tmp";
+	bool Success = false;
+	{
+		FileSink Out(TempPath.c_str());
+		if (Out.IsOpen())
+		{
+			//std::cout << "Processing: " << Ctx.LastSetPath << " -> " << SavePath << "\n";
+			Success = SaveEspTo(*Ctx.Data, Src, Out, Options, KeepStringIDs ? &StringIDs : nullptr) && Out.Flush();
+		}
+	}
+
+	// The source may be the file being replaced.
+	Source.reset();
+
+	if (Success && KeepStringIDs)
+	{
+		// Saving over the plugin the strings were read from replaces the
+		// files Ctx.Strings and the current snapshot have mapped.
+		Ctx.Strings->ReleaseMappings();
+		Ctx.PublishSnapshot();
+		Success = CommitStringTables(Staged);
+	}
+
+	if (Success && !MoveFileReplacing(TempPath, SavePath))
+	{
+		std::cerr << "Error: Cannot replace plugin: " << SavePath << "\n";
+		Success = false;
+	}
+
+	if (Success)
+	{
+		FinishStringTables(Staged);
+	}
+	else
+	{
+		RollBackStringTables(Staged);
+		std::remove(TempPath.c_str());
+	}
+
+	if (Success)
+	{
+		std::cout << "Successfully saved modified ESP to: " << SavePath << "\n";
+	}
+	else
+	{
+		std::cerr << "Failed to save ESP file\n";
+	}
+
+	return Success;
+}
+
+// Edited localized subrecords are inlined: there is no path for string tables.
+bool SaveEspToBuffer(EspContext& Ctx, const EspSaveOptions& Options, std::vector<uint8_t>& Out)
+{
+	std::unique_ptr<EspSource> Src = OpenContextSource(Ctx);
+	if (!Ctx.Data || !Src)
+		return false;
+
+	MemorySink Sink(Out);
+	return SaveEspTo(*Ctx.Data, *Src, Sink, Options, nullptr);
+}
+
+#pragma endregion
+
+#pragma region ApplyTranslations
+
+inline uint32_t PackSig(const char* Sig)
+{
+	uint32_t Packed = 0;
+	if (Sig && std::strlen(Sig) >= 4)
+	{
+		std::memcpy(&Packed, Sig, 4);
+	}
+	return Packed;
+}
+
+// An edit with its signatures packed for cheap comparison.
+struct StreamEdit
+{
+	uint32_t FormID;
+	uint32_t RecordSig;
+	uint32_t SubSig;
+	int OccurrenceIndex;
+	const char* Text;
+
+	bool operator<(const StreamEdit& Other) const
+	{
+		if (FormID != Other.FormID) return FormID < Other.FormID;
+		if (RecordSig != Other.RecordSig) return RecordSig < Other.RecordSig;
+		if (SubSig != Other.SubSig) return SubSig < Other.SubSig;
+		return OccurrenceIndex < Other.OccurrenceIndex;
+	}
+};
+
+// State for one C_ApplyTranslations run. Prepare encodes the edited records
+// in a first pass only to learn their sizes; the write pass encodes each one
+// again, so no more than one encoded record is held at a time.
+class TranslationStream
+{
+public:
+	TranslationStream(const EspTranslationEdit* Edits, int EditCount, int Policy)
+		: Applied(0), CopyBuffer(1 << 20), Policy_(Policy)
+	{
+		Edits_.reserve(EditCount);
+		for (int i = 0; i < EditCount; ++i)
+		{
+			StreamEdit E;
+			E.FormID = Edits[i].FormID;
+			E.RecordSig = PackSig(Edits[i].RecordSig);
+			E.SubSig = PackSig(Edits[i].SubSig);
+			E.OccurrenceIndex = Edits[i].OccurrenceIndex;
+			E.Text = Edits[i].Utf8Text;
+
+			if (E.RecordSig == 0 || E.SubSig == 0)
+				continue;
+
+			Edits_.push_back(E);
+			EditedSigs_.insert(E.RecordSig);
+		}
+		std::sort(Edits_.begin(), Edits_.end());
+	}
+
+	int Applied;
+	std::vector<char> CopyBuffer;
+
+	// Top-level GRUPs of a record type nobody edits can be copied whole.
+	// CELL, WRLD and DIAL groups also hold children of other types.
+	bool CanSkipGroup(const GroupHeader& GH) const
+	{
+		if (GH.GroupType != 0)
+			return false;
+
+		if (std::memcmp(GH.Label, "CELL", 4) == 0 || std::memcmp(GH.Label, "WRLD", 4) == 0 || std::memcmp(GH.Label, "DIAL", 4) == 0)
+			return false;
+
+		return EditedSigs_.count(PackSig(GH.Label)) == 0;
+	}
+
+	// Walks [Src.Position(), End) ahead of writing and encodes every record
+	// that has edits, so each GRUP's new size is known before its header is
+	// written.
+	bool Prepare(EspSource& Src, uint64_t End)
+	{
+		while (Src.Position() < End)
+		{
+			uint64_t Start = Src.Position();
+			if (End - Start < 24)
+				return Src.Skip(End - Start);
+
+			uint8_t Header[24];
+			if (!Src.Read(Header, sizeof(Header)))
+				return false;
+
+			if (IsGRUP(reinterpret_cast<const char*>(Header)))
+			{
+				GroupHeader GH;
+				std::memcpy(&GH, Header, sizeof(GH));
+
+				if (GH.Size < 24 || Start + GH.Size > End)
+				{
+					std::cerr << "Error: Invalid GRUP size: " << GH.Size << " at position " << Start << "\n";
+					return false;
+				}
+
+				bool Ok = CanSkipGroup(GH) ? Src.Skip(GH.Size - 24) : Prepare(Src, Start + GH.Size);
+				if (!Ok)
+					return false;
+			}
+			else
+			{
+				RecordHeader HDR;
+				std::memcpy(&HDR, Header, sizeof(HDR));
+
+				if (Start + 24 + HDR.DataSize > End)
+				{
+					std::cerr << "Error: Record overruns its GRUP at position " << Start << "\n";
+					return false;
+				}
+
+				if (!PrepareRecord(Src, Start, HDR))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	bool IsEdited(uint64_t Offset) const
+	{
+		size_t Index = LowerBound(Offset);
+		return Index < Sizes_.size() && Sizes_[Index].Offset == Offset;
+	}
+
+	bool AnyEditedIn(uint64_t Begin, uint64_t End) const
+	{
+		return LowerBound(Begin) < LowerBound(End);
+	}
+
+	// How much the edited records in [Begin, End) grow (or shrink) the output.
+	int64_t SizeDelta(uint64_t Begin, uint64_t End) const
+	{
+		int64_t Delta = 0;
+		for (size_t i = LowerBound(Begin); i < Sizes_.size() && Sizes_[i].Offset < End; ++i)
+		{
+			Delta += static_cast<int64_t>(Sizes_[i].NewSize) - static_cast<int64_t>(Sizes_[i].OriginalSize);
+		}
+		return Delta;
+	}
+
+	// Encodes the edited record at Start, whose header was just read, once
+	// more and writes it. Encoding is deterministic, so it must come out at
+	// the size Prepare gave its GRUPs.
+	bool WriteRecord(EspSource& Src, uint64_t Start, const RecordHeader& HDR, EspSink& Out)
+	{
+		int Edits = 0;
+		if (!EncodeRecord(Src, HDR, Edits))
+			return false;
+
+		const RecordSize& Size = Sizes_[LowerBound(Start)];
+		if (Encoded_.size() != Size.NewSize)
+		{
+			std::cerr << "Error: FormID 0x" << std::hex << HDR.FormID << std::dec << " encoded to a different size on the second pass\n";
+			return false;
+		}
+		return Out.Write(Encoded_.data(), Encoded_.size());
+	}
+
+private:
+	// An edited record in the source and its size in the output.
+	struct RecordSize
+	{
+		uint64_t Offset;
+		uint64_t OriginalSize;
+		uint64_t NewSize;
+	};
+
+	size_t LowerBound(uint64_t Offset) const
+	{
+		size_t Low = 0, High = Sizes_.size();
+		while (Low < High)
+		{
+			size_t Mid = (Low + High) / 2;
+			if (Sizes_[Mid].Offset < Offset) Low = Mid + 1;
+			else High = Mid;
+		}
+		return Low;
+	}
+
+	// Reads the payload of the record whose header was just read and, if it
+	// has edits, encodes it to learn its new size.
+	bool PrepareRecord(EspSource& Src, uint64_t Start, const RecordHeader& HDR)
+	{
+		int Edits = 0;
+		if (!EncodeRecord(Src, HDR, Edits))
+			return false;
+
+		if (Edits == 0 && Encoded_.empty())
+			return true;
+
+		RecordSize Size;
+		Size.Offset = Start;
+		Size.OriginalSize = 24 + static_cast<uint64_t>(HDR.DataSize);
+		Size.NewSize = Encoded_.size();
+		Sizes_.push_back(Size);
+		Applied += Edits;
+		return true;
+	}
+
+	// Reads the payload of the record whose header was just read and encodes
+	// it with its edits into Encoded_. Encoded_ is left empty (and the payload
+	// skipped) when no edit names the record; Edits counts the edits applied.
+	bool EncodeRecord(EspSource& Src, RecordHeader HDR, int& Edits)
+	{
+		Encoded_.clear();
+
+		StreamEdit Key = { HDR.FormID, PackSig(HDR.Sig), 0, 0, nullptr };
+		std::vector<StreamEdit>::const_iterator First = std::lower_bound(Edits_.begin(), Edits_.end(), Key);
+
+		std::vector<StreamEdit>::const_iterator Last = First;
+		while (Last != Edits_.end() && Last->FormID == Key.FormID && Last->RecordSig == Key.RecordSig)
+			++Last;
+
+		if (First == Last)
+			return Src.Skip(HDR.DataSize);
+
+		Payload_.resize(HDR.DataSize);
+		if (HDR.DataSize > 0 && !Src.Read(Payload_.data(), HDR.DataSize))
+			return false;
+
+		bool WasCompressed = IsCompressed(HDR);
+		const std::vector<uint8_t>* Original = &Payload_;
+
+		if (WasCompressed)
+		{
+			uint32_t UncompressedSize = 0;
+			if (Payload_.size() < 4)
+				return true;
+
+			std::memcpy(&UncompressedSize, Payload_.data(), 4);
+			if (!ZlibDecompress(Payload_.data() + 4, Payload_.size() - 4, Inflated_, UncompressedSize))
+			{
+				std::cerr << "Error: Decompression failed for FormID 0x" << std::hex << HDR.FormID << std::dec << "\n";
+				return false;
+			}
+			Original = &Inflated_;
+		}
+
+		Rebuilt_.clear();
+		Occurrences_.clear();
+
+		size_t Offset = 0;
+		while (Offset + sizeof(SubRecordHeader) <= Original->size())
+		{
+			SubRecordHeader SH;
+			std::memcpy(&SH, Original->data() + Offset, sizeof(SH));
+
+			size_t SubEnd = Offset + sizeof(SubRecordHeader) + SH.Size;
+			if (SubEnd > Original->size())
+			{
+				std::cerr << "Warning: Corrupted subrecord data at offset " << Offset << "\n";
+				break;
+			}
+
+			uint32_t SubSig = PackSig(SH.Sig);
+			int Occurrence = NextOccurrence(SubSig);
+
+			const StreamEdit* Edit = nullptr;
+			for (std::vector<StreamEdit>::const_iterator It = First; It != Last; ++It)
+			{
+				if (It->SubSig == SubSig && It->OccurrenceIndex == Occurrence)
+				{
+					Edit = &*It;
+					break;
+				}
+			}
+
+			size_t TextSize = (Edit && Edit->Text) ? std::strlen(Edit->Text) : 0;
+			if (Edit && TextSize <= 0xFFFF)
+			{
+				SH.Size = static_cast<uint16_t>(TextSize);
+				const uint8_t* HeaderBytes = reinterpret_cast<const uint8_t*>(&SH);
+				Rebuilt_.insert(Rebuilt_.end(), HeaderBytes, HeaderBytes + sizeof(SH));
+				Rebuilt_.insert(Rebuilt_.end(), Edit->Text, Edit->Text + TextSize);
+				++Edits;
+			}
+			else
+			{
+				if (Edit)
+				{
+					std::cerr << "Error: Subrecord text exceeds 65535 bytes, kept original\n";
+				}
+				Rebuilt_.insert(Rebuilt_.end(), Original->begin() + Offset, Original->begin() + SubEnd);
+			}
+
+			Offset = SubEnd;
+		}
+		Rebuilt_.insert(Rebuilt_.end(), Original->begin() + Offset, Original->end());
+
+		if (!WasCompressed)
+		{
+			HDR.DataSize = static_cast<uint32_t>(Rebuilt_.size());
+			Append(Encoded_, &HDR, sizeof(HDR));
+			Append(Encoded_, Rebuilt_.data(), Rebuilt_.size());
+			return true;
+		}
+
+		if (!ZlibCompress(Rebuilt_.data(), Rebuilt_.size(), Deflated_, CompressionLevelFor(Policy_, Payload_)))
+		{
+			std::cerr << "Error: Compression failed for FormID 0x" << std::hex << HDR.FormID << std::dec << "\n";
+			return false;
+		}
+
+		uint32_t UncompressedSize = static_cast<uint32_t>(Rebuilt_.size());
+		HDR.DataSize = static_cast<uint32_t>(4 + Deflated_.size());
+		Append(Encoded_, &HDR, sizeof(HDR));
+		Append(Encoded_, &UncompressedSize, 4);
+		Append(Encoded_, Deflated_.data(), Deflated_.size());
+		return true;
+	}
+
+	static void Append(std::vector<uint8_t>& Out, const void* Data, size_t Size)
+	{
+		const uint8_t* Bytes = static_cast<const uint8_t*>(Data);
+		Out.insert(Out.end(), Bytes, Bytes + Size);
+	}
+
+	std::vector<StreamEdit> Edits_;
+	std::unordered_set<uint32_t> EditedSigs_;
+	int Policy_;
+	std::vector<RecordSize> Sizes_;   // sorted by Offset
+
+	std::vector<uint8_t> Payload_;
+	std::vector<uint8_t> Inflated_;
+	std::vector<uint8_t> Rebuilt_;
+	std::vector<uint8_t> Deflated_;
+	std::vector<uint8_t> Encoded_;
+	std::vector<std::pair<uint32_t, int> > Occurrences_;
+
+	int NextOccurrence(uint32_t SubSig)
+	{
+		for (size_t i = 0; i < Occurrences_.size(); ++i)
+		{
+			if (Occurrences_[i].first == SubSig)
+				return Occurrences_[i].second++;
+		}
+		Occurrences_.push_back(std::make_pair(SubSig, 1));
+		return 0;
+	}
+};
+
+// Streams [Src.Position(), End) to Out after Stream.Prepare has run over the
+// same range. GRUP headers are written with their final size, so Out is only
+// ever appended to.
+bool StreamTranslatedRange(TranslationStream& Stream, EspSource& Src, EspSink& Out, uint64_t End)
+{
+	while (Src.Position() < End)
+	{
+		uint64_t Start = Src.Position();
+
+		if (End - Start < 24)
+		{
+			std::cerr << "Warning: Copying " << (End - Start) << " trailing bytes\n";
+			if (!Src.CopyTo(Out, End - Start, Stream.CopyBuffer))
+				return false;
+			break;
+		}
+
+		uint8_t Header[24];
+		if (!Src.Read(Header, sizeof(Header)))
+			return false;
+
+		if (IsGRUP(reinterpret_cast<const char*>(Header)))
+		{
+			GroupHeader GH;
+			std::memcpy(&GH, Header, sizeof(GH));
+
+			if (GH.Size < 24 || Start + GH.Size > End)
+			{
+				std::cerr << "Error: Invalid GRUP size: " << GH.Size << " at position " << Start << "\n";
+				return false;
+			}
+
+			uint64_t GrupEnd = Start + GH.Size;
+
+			if (!Stream.AnyEditedIn(Start, GrupEnd))
+			{
+				if (!Out.Write(&GH, sizeof(GH)) || !Src.CopyTo(Out, GH.Size - 24, Stream.CopyBuffer))
+					return false;
+				continue;
+			}
+
+			GH.Size = static_cast<uint32_t>(static_cast<int64_t>(GH.Size) + Stream.SizeDelta(Start, GrupEnd));
+
+			if (!Out.Write(&GH, sizeof(GH)) || !StreamTranslatedRange(Stream, Src, Out, GrupEnd))
+				return false;
+		}
+		else
+		{
+			RecordHeader HDR;
+			std::memcpy(&HDR, Header, sizeof(HDR));
+
+			if (Start + 24 + HDR.DataSize > End)
+			{
+				std::cerr << "Error: Record overruns its GRUP at position " << Start << "\n";
+				return false;
+			}
+
+			if (Stream.IsEdited(Start))
+			{
+				if (!Stream.WriteRecord(Src, Start, HDR, Out))
+					return false;
+			}
+			else
+			{
+				if (!Out.Write(&HDR, sizeof(HDR)) || !Src.CopyTo(Out, HDR.DataSize, Stream.CopyBuffer))
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int C_ApplyTranslations(const wchar_t* SourcePath, const char* Utf8OutPath, const EspTranslationEdit* Edits, int EditCount, const EspSaveOptions* Options)
+{
+	if (!SourcePath || !Utf8OutPath || (EditCount > 0 && !Edits))
+		return -1;
+
+	FileSource Src(SourcePath);
+	if (!Src.IsOpen())
+		return -1;
+
+	FileSink Out(Utf8OutPath);
+	if (!Out.IsOpen())
+		return -1;
+
+	TranslationStream Stream(Edits, EditCount < 0 ? 0 : EditCount, Options ? Options->CompressionPolicy : ESP_COMPRESS_BEST);
+
+	if (!Stream.Prepare(Src, Src.Size()) || !Src.Seek(0) || !StreamTranslatedRange(Stream, Src, Out, Src.Size()) || !Out.Flush())
+	{
+		std::cerr << "Failed to apply translations to: " << Utf8OutPath << "\n";
+		return -1;
+	}
+
+	return Stream.Applied;
+}
+
+#pragma endregion
+
+#pragma region Diagnostics
+
+// Describes where Offset falls in the plugin: the chain of GRUPs and the record.
+std::string DescribeSourceOffset(EspSource& Src, uint64_t Offset)
+{
+	std::ostringstream Out;
+	Out << std::hex << std::uppercase;
+
+	uint64_t Pos = 0;
+	uint64_t End = Src.Size();
+
+	while (Pos + 24 <= End)
+	{
+		uint8_t Header[24];
+		if (!Src.Seek(Pos) || !Src.Read(Header, sizeof(Header)))
+			break;
+
+		if (IsGRUP(reinterpret_cast<const char*>(Header)))
+		{
+			GroupHeader GH;
+			std::memcpy(&GH, Header, sizeof(GH));
+			if (GH.Size < 24)
+				break;
+
+			if (Offset >= Pos + GH.Size)
+			{
+				Pos += GH.Size;
+				continue;
+			}
+
+			Out << "GRUP ";
+			if (GH.GroupType == 0)
+			{
+				Out << "'" << std::string(GH.Label, 4) << "'";
+			}
+			else
+			{
+				uint32_t Label;
+				std::memcpy(&Label, GH.Label, 4);
+				Out << "type " << std::dec << GH.GroupType << std::hex << " label 0x" << Label;
+			}
+			Out << " @0x" << Pos;
+
+			if (Offset < Pos + 24)
+			{
+				Out << ", header +" << std::dec << (Offset - Pos);
+				return Out.str();
+			}
+
+			Out << " > ";
+			End = Pos + GH.Size;
+			Pos += 24;
+			continue;
+		}
+
+		RecordHeader HDR;
+		std::memcpy(&HDR, Header, sizeof(HDR));
+		uint64_t RecordEnd = Pos + 24 + HDR.DataSize;
+
+		if (Offset < RecordEnd)
+		{
+			Out << std::string(HDR.Sig, 4) << " 0x" << std::setw(8) << std::setfill('0') << HDR.FormID
+				<< " @0x" << Pos << ", " << (Offset < Pos + 24 ? "header" : "data") << " +" << std::dec << (Offset - Pos);
+			if (IsCompressed(HDR))
+				Out << " (compressed)";
+			return Out.str();
+		}
+		Pos = RecordEnd;
+	}
+
+	Out << "past the last record";
+	return Out.str();
+}
+
+int VerifyRoundTrip(EspContext& Ctx, const EspSaveOptions& Options, std::string& Report)
+{
+	std::unique_ptr<EspSource> Src = OpenContextSource(Ctx);
+	if (!Ctx.Data || !Src)
+	{
+		Report = "No document loaded";
+		return -1;
+	}
+
+	std::vector<uint8_t> Saved;
+	MemorySink Sink(Saved);
+	if (!SaveEspTo(*Ctx.Data, *Src, Sink, Options, nullptr))
+	{
+		Report = "Save failed";
+		return -1;
+	}
+
+	const uint64_t SourceSize = Src->Size();
+	const uint64_t Common = SourceSize < Saved.size() ? SourceSize : Saved.size();
+
+	std::vector<uint8_t> Chunk(1 << 20);
+	uint64_t Diverges = Common;
+
+	if (!Src->Seek(0))
+		return -1;
+
+	for (uint64_t Pos = 0; Pos < Common; Pos += Chunk.size())
+	{
+		size_t Size = Chunk.size();
+		if (Common - Pos < Size) Size = static_cast<size_t>(Common - Pos);
+
+		if (!Src->Read(Chunk.data(), Size))
+			return -1;
+
+		if (std::memcmp(Chunk.data(), Saved.data() + Pos, Size) != 0)
+		{
+			size_t i = 0;
+			while (Chunk[i] == Saved[static_cast<size_t>(Pos) + i]) ++i;
+			Diverges = Pos + i;
+			break;
+		}
+	}
+
+	if (Diverges == Common && SourceSize == Saved.size())
+	{
+		std::ostringstream Out;
+		Out << "Identical, " << SourceSize << " bytes";
+		Report = Out.str();
+		return 0;
+	}
+
+	std::ostringstream Out;
+	Out << "First difference at 0x" << std::hex << std::uppercase << Diverges << std::dec
+		<< " (source " << SourceSize << " bytes, saved " << Saved.size() << "): "
+		<< DescribeSourceOffset(*Src, Diverges);
+	Report = Out.str();
+	return 1;
+}
+
+int C_Ctx_VerifyRoundTrip(EspContext* Ctx, const EspSaveOptions* Options, uint8_t* Report, int ReportSize)
+{
+	if (!Ctx) return -1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	EspSaveOptions Effective = { ESP_COMPRESS_BEST, 0, 0 };
+	if (Options)
+	{
+		Effective = *Options;
+	}
+
+	std::string Text;
+	int Result = VerifyRoundTrip(*Ctx, Effective, Text);
+
+	if (Report && ReportSize > 0)
+	{
+		size_t Length = Text.size() < static_cast<size_t>(ReportSize - 1) ? Text.size() : static_cast<size_t>(ReportSize - 1);
+		std::memcpy(Report, Text.data(), Length);
+		Report[Length] = 0;
+	}
+	return Result;
+}
+
+// Plugin files (.esp, .esm, .esl) directly inside Directory, by name.
+std::vector<std::wstring> ListPlugins(const std::wstring& Directory)
+{
+	std::vector<std::wstring> Plugins;
+
+	WIN32_FIND_DATAW Found;
+	HANDLE Find = FindFirstFileW((Directory + L"\\*").c_str(), &Found);
+	if (Find == INVALID_HANDLE_VALUE)
+		return Plugins;
+
+	do
+	{
+		if (Found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+
+		std::wstring Name = Found.cFileName;
+		size_t Dot = Name.find_last_of(L'.');
+		if (Dot == std::wstring::npos)
+			continue;
+
+		std::wstring Extension = Name.substr(Dot);
+		std::transform(Extension.begin(), Extension.end(), Extension.begin(), ::towlower);
+		if (Extension == L".esp" || Extension == L".esm" || Extension == L".esl")
+		{
+			Plugins.push_back(Directory + L"\\" + Name);
+		}
+	} while (FindNextFileW(Find, &Found));
+
+	FindClose(Find);
+	std::sort(Plugins.begin(), Plugins.end());
+	return Plugins;
+}
+
+struct BenchmarkTimes
+{
+	double Read;
+	double Modify;
+	double Save;
+	uint64_t Bytes;
+	uint64_t Records;
+	uint64_t Edits;
+
+	BenchmarkTimes() : Read(0), Modify(0), Save(0), Bytes(0), Records(0), Edits(0) {}
+};
+
+double SecondsSince(std::chrono::steady_clock::time_point Start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+}
+
+bool BenchmarkPlugin(const std::wstring& Path, BenchmarkTimes& Times)
+{
+	EspContext Ctx;
+	SetDefaultFilter(Ctx.Filter);
+
+	std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+	if (ReadEsp(Ctx, Path.c_str()) != 0)
+		return false;
+	Times.Read += SecondsSince(Start);
+
+	std::unique_ptr<EspSource> Src = OpenContextSource(Ctx);
+	Times.Bytes += Src ? Src->Size() : 0;
+	Times.Records += Ctx.Data->Records.size() + Ctx.Data->CellRecords.size();
+
+	// Rewrite every kept subrecord with its own text through the public path.
+	// Localized subrecords hold a StringID, and no strings are loaded here,
+	// so they are left alone.
+	std::vector<EspHandle> Handles;
+	for (const RecordStore* Vec : { &Ctx.Data->Records, &Ctx.Data->CellRecords })
+	{
+		for (const auto& Rec : *Vec)
+		{
+			for (const auto& Sub : Rec.SubRecords)
+			{
+				if (!Sub.IsLocalized)
+					Handles.push_back(Sub.Handle);
+			}
+		}
+	}
+
+	Start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < Handles.size(); ++i)
+	{
+		const SubRecordData* Sub = static_cast<const EspData*>(Ctx.Data)->ResolveSubRecord(Handles[i]);
+		std::string Text = Sub->GetString(Ctx.Data->Strings);
+		C_Ctx_ModifySubRecordByHandle(&Ctx, Handles[i], Text.c_str());
+	}
+	Times.Modify += SecondsSince(Start);
+	Times.Edits += Handles.size();
+
+	EspSaveOptions Options = { ESP_COMPRESS_BEST, 0, 0 };
+	std::vector<uint8_t> Saved;
+
+	Start = std::chrono::steady_clock::now();
+	bool Success = SaveEspToBuffer(Ctx, Options, Saved);
+	Times.Save += SecondsSince(Start);
+	return Success;
+}
+
+void PrintBenchmarkRow(const std::string& Name, const BenchmarkTimes& T)
+{
+	const double MB = T.Bytes / (1024.0 * 1024.0);
+	std::cout << std::fixed << std::setprecision(1)
+		<< Name << ": " << MB << " MB, " << T.Records << " records, " << T.Edits << " edits\n"
+		<< "  read   " << std::setw(8) << T.Read * 1000 << " ms  " << std::setw(8) << (T.Read > 0 ? MB / T.Read : 0) << " MB/s  "
+		<< std::setw(10) << (T.Read > 0 ? T.Records / T.Read : 0) << " records/s\n"
+		<< "  modify " << std::setw(8) << T.Modify * 1000 << " ms  " << std::setw(10) << (T.Modify > 0 ? T.Edits / T.Modify : 0) << " edits/s\n"
+		<< "  save   " << std::setw(8) << T.Save * 1000 << " ms  " << std::setw(8) << (T.Save > 0 ? MB / T.Save : 0) << " MB/s  "
+		<< std::setw(10) << (T.Save > 0 ? T.Records / T.Save : 0) << " records/s\n";
+	std::cout.unsetf(std::ios::fixed);
+}
+
+int C_BenchmarkDirectory(const wchar_t* Directory, int Iterations)
+{
+	if (!Directory) return -1;
+	if (Iterations < 1) Iterations = 1;
+
+	std::vector<std::wstring> Plugins = ListPlugins(Directory);
+	if (Plugins.empty())
+		return -1;
+
+	BenchmarkTimes Total;
+	int Measured = 0;
+
+	for (size_t i = 0; i < Plugins.size(); ++i)
+	{
+		BenchmarkTimes Times;
+		bool Ok = true;
+		for (int Run = 0; Run < Iterations && Ok; ++Run)
+		{
+			Ok = BenchmarkPlugin(Plugins[i], Times);
+		}
+
+		std::string Name = WStringToUtf8(Plugins[i]);
+		if (!Ok)
+		{
+			std::cerr << "Benchmark failed: " << Name << "\n";
+			continue;
+		}
+
+		PrintBenchmarkRow(Name, Times);
+
+		Total.Read += Times.Read;
+		Total.Modify += Times.Modify;
+		Total.Save += Times.Save;
+		Total.Bytes += Times.Bytes;
+		Total.Records += Times.Records;
+		Total.Edits += Times.Edits;
+		++Measured;
+	}
+
+	std::ostringstream Name;
+	Name << "Total (" << Measured << " plugins x " << Iterations << ")";
+	PrintBenchmarkRow(Name.str(), Total);
+	return Measured;
+}
+
+#pragma endregion
+
+#pragma region OpenPlugin
+
+// Reads the plugin on the calling thread while each strings file loads on its
+// own thread into a separate manager, which replaces Ctx.Strings at the end.
+// Records are parsed before their strings exist, so a localized record is kept
+// for its StringIDs even when all of its strings turn out to be blank.
+int OpenPlugin(EspContext& Ctx, const wchar_t* EspPath, const std::string& Language, EspOpenTimings& Timings)
+{
+	std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+	const std::string Utf8Path = WStringToUtf8(EspPath);
+
+	StringsManager Loaded;
+	Loaded.Reset(Language, Utf8Path);
+
+	// The loaders' messages are not printed; the timings go to Timings.
+	std::ostringstream Logs[StringsTypeCount];
+	std::vector<std::thread> Loaders;
+
+	for (int i = 0; i < StringsTypeCount; ++i)
+	{
+		Loaders.push_back(std::thread([&, i]()
+			{
+				std::chrono::steady_clock::time_point TypeStart = std::chrono::steady_clock::now();
+				Loaded.LoadStringsType(static_cast<StringsFileType>(i), Logs[i]);
+				Timings.StringsSeconds[i] = SecondsSince(TypeStart);
+			}));
+	}
+
+	Ctx.Strings->Clear();
+
+	std::chrono::steady_clock::time_point PluginStart = std::chrono::steady_clock::now();
+	int Result = ReadEsp(Ctx, EspPath);
+	Timings.PluginSeconds = SecondsSince(PluginStart);
+
+	for (size_t i = 0; i < Loaders.size(); ++i)
+	{
+		Loaders[i].join();
+	}
+
+	Ctx.Strings->Swap(Loaded);
+	Ctx.PublishSnapshot();
+	Timings.TotalSeconds = SecondsSince(Start);
+
+	return Result;
+}
+
+int C_OpenPlugin(const wchar_t* EspPath, const char* Language, EspOpenTimings* Timings)
+{
+	return C_Ctx_OpenPlugin(&GetDefaultContext(), EspPath, Language, Timings);
+}
+
+int C_Ctx_OpenPlugin(EspContext* Ctx, const wchar_t* EspPath, const char* Language, EspOpenTimings* Timings)
+{
+	if (!Ctx || !EspPath) return 1;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	EspOpenTimings Local;
+	return OpenPlugin(*Ctx, EspPath, Language ? Language : "english", Timings ? *Timings : Local);
+}
+
+#pragma endregion
+
+#pragma region LoadOrder
+
+// Reads the new plugins in parallel, each into its own context, then appends
+// them in the order given and folds them into the override index.
+int AddPlugins(EspLoadOrder& Order, const std::vector<std::wstring>& Paths, const char* Language, int ThreadCount)
+{
+	std::vector<std::wstring> Pending;
+	for (size_t i = 0; i < Paths.size(); ++i)
+	{
+		std::string Name = WStringToUtf8(Paths[i]);
+		if (Order.FindPlugin(Name) < 0 && std::find(Pending.begin(), Pending.end(), Paths[i]) == Pending.end())
+		{
+			Pending.push_back(Paths[i]);
+		}
+	}
+
+	std::vector<std::unique_ptr<EspContext> > Contexts(Pending.size());
+	std::vector<int> Results(Pending.size(), 1);
+	std::atomic<size_t> Next(0);
+
+	auto Work = [&]()
+		{
+			for (size_t i = Next++; i < Pending.size(); i = Next++)
+			{
+				std::unique_ptr<EspContext> Ctx(new EspContext());
+				SetDefaultFilter(Ctx->Filter);
+				if (Language)
+				{
+					Ctx->Strings->LoadStringsFile(WStringToUtf8(Pending[i]), Language);
+				}
+				Results[i] = ReadEsp(*Ctx, Pending[i].c_str());
+				Contexts[i] = std::move(Ctx);
+			}
+		};
+
+	size_t Workers = ThreadCount > 0 ? static_cast<size_t>(ThreadCount) : std::thread::hardware_concurrency();
+	if (Workers > Pending.size()) Workers = Pending.size();
+
+	std::vector<std::thread> Threads;
+	for (size_t i = 1; i < Workers; ++i)
+	{
+		Threads.push_back(std::thread(Work));
+	}
+	Work();
+	for (size_t i = 0; i < Threads.size(); ++i)
+	{
+		Threads[i].join();
+	}
+
+	int Added = 0;
+	for (size_t i = 0; i < Pending.size(); ++i)
+	{
+		if (Results[i] != 0)
+		{
+			std::cerr << "Failed to add plugin: " << WStringToUtf8(Pending[i]) << "\n";
+			continue;
+		}
+
+		Order.Append(Pending[i], WStringToUtf8(Pending[i]), std::move(Contexts[i]));
+		++Added;
+	}
+
+	Order.UpdateIndex();
+	return Added;
+}
+
+EspLoadOrder* C_CreateLoadOrder()
+{
+	return new EspLoadOrder();
+}
+
+void C_DestroyLoadOrder(EspLoadOrder* Order)
+{
+	delete Order;
+}
+
+int C_LoadOrder_AddPlugins(EspLoadOrder* Order, const wchar_t** Paths, int Count, const char* Language, int ThreadCount)
+{
+	if (!Order || (!Paths && Count > 0) || Count < 0) return -1;
+	std::lock_guard<std::mutex> Guard(Order->Lock);
+
+	std::vector<std::wstring> List;
+	for (int i = 0; i < Count; ++i)
+	{
+		if (Paths[i])
+		{
+			List.push_back(Paths[i]);
+		}
+	}
+
+	return AddPlugins(*Order, List, Language, ThreadCount);
+}
+
+int C_LoadOrder_GetPluginCount(EspLoadOrder* Order)
+{
+	if (!Order) return 0;
+	std::lock_guard<std::mutex> Guard(Order->Lock);
+
+	return static_cast<int>(Order->GetPluginCount());
+}
+
+EspContext* C_LoadOrder_GetContext(EspLoadOrder* Order, int PluginIndex)
+{
+	if (!Order) return nullptr;
+	std::lock_guard<std::mutex> Guard(Order->Lock);
+
+	if (PluginIndex < 0 || static_cast<size_t>(PluginIndex) >= Order->GetPluginCount())
+		return nullptr;
+
+	return Order->GetPlugin(PluginIndex).Context.get();
+}
+
+int C_LoadOrder_FindWinner(EspLoadOrder* Order, const char* PluginName, uint32_t FormID, uint64_t* OutRecordHandle)
+{
+	if (!Order || !PluginName) return -1;
+	std::lock_guard<std::mutex> Guard(Order->Lock);
+
+	int Plugin = Order->FindPlugin(PluginName);
+	if (Plugin < 0)
+		return -1;
+
+	const EspLoadOrder::Winner* W = Order->FindWinner(Plugin, FormID);
+	if (!W)
+		return -1;
+
+	if (OutRecordHandle)
+	{
+		*OutRecordHandle = W->Record;
+	}
+	return static_cast<int>(W->Plugin);
+}
+
+int C_LoadOrder_SearchBySigHandles(EspLoadOrder* Order, const char* ParentSig, const char* ChildSig, int* OutPlugins, uint64_t* OutHandles, int Capacity)
+{
+	if (!Order || !ParentSig) return 0;
+	std::lock_guard<std::mutex> Guard(Order->Lock);
+
+	std::string Parent(ParentSig);
+	std::string Child(ChildSig ? ChildSig : "");
+
+	int Count = 0;
+	Order->ForEachWinner([&](size_t Plugin, const EspRecord& Rec)
+		{
+			if (Parent != "ALL" && Rec.Sig != Parent)
+				return;
+
+			bool Match = Child.empty() || Child == "ALL";
+			for (size_t i = 0; !Match && i < Rec.SubRecords.size(); ++i)
+			{
+				Match = Rec.SubRecords[i].Sig == Child;
+			}
+
+			if (!Match)
+				return;
+
+			if (Count < Capacity)
+			{
+				if (OutPlugins) OutPlugins[Count] = static_cast<int>(Plugin);
+				if (OutHandles) OutHandles[Count] = Rec.Handle;
+			}
+			++Count;
+		});
+
+	return Count;
+}
+
+#pragma endregion
+
+#pragma region Batch
+
+void SummarizePlugin(const EspData& Doc, EspBatchResult& Result)
+{
+	uint64_t Hash = FNV1A_BASIS;
+	for (const RecordStore* Vec : { &Doc.Records, &Doc.CellRecords })
+	{
+		for (const auto& Rec : *Vec)
+		{
+			Hash = Fnv1a(Hash, &Rec.FormID, sizeof(Rec.FormID));
+			Hash = Fnv1a(Hash, Rec.Sig.data(), Rec.Sig.size());
+			for (const auto& Sub : Rec.SubRecords)
+			{
+				Hash = Fnv1a(Hash, Sub.Sig.data(), Sub.Sig.size());
+				if (Sub.IsLocalized)
+				{
+					// The payload is only a StringID; hash the text it stands for.
+					std::string Text = Sub.GetString(Doc.Strings);
+					Hash = Fnv1a(Hash, Text.data(), Text.size());
+				}
+				else
+				{
+					Hash = Fnv1a(Hash, Sub.Data.data(), Sub.Data.size());
+				}
+			}
+			Result.SubRecords += Rec.SubRecords.size();
+		}
+	}
+
+	Result.Records = Doc.Records.size() + Doc.CellRecords.size();
+	Result.TextHash = Hash;
+}
+
+// Largest plugins are handed out first so that one big master does not start
+// last and leave the other workers idle at the end; the rest is taken from a
+// shared cursor by whichever worker is free.
+int BatchProcess(std::vector<std::wstring> Paths, const EspBatchOptions& Options, EspBatchCallback Callback, void* UserData)
+{
+	// A borrowed filter is copied under its context's lock, so that context
+	// stays usable while the batch runs; the workers share the copy.
+	RecordFilter Filter;
+	bool Borrowed = false;
+	if (Options.FilterFrom)
+	{
+		std::lock_guard<std::mutex> Guard(Options.FilterFrom->Lock);
+		if (Options.FilterFrom->Filter)
+		{
+			Filter = *Options.FilterFrom->Filter;
+			Borrowed = true;
+		}
+	}
+	if (!Borrowed)
+	{
+		SetDefaultFilter(&Filter);
+	}
+
+	std::vector<std::pair<uint64_t, size_t> > Order(Paths.size());
+	for (size_t i = 0; i < Paths.size(); ++i)
+	{
+		std::ifstream F(Paths[i].c_str(), std::ios::binary | std::ios::ate);
+		Order[i] = std::make_pair(F.is_open() ? static_cast<uint64_t>(F.tellg()) : 0, i);
+	}
+	std::sort(Order.begin(), Order.end(), [](const std::pair<uint64_t, size_t>& A, const std::pair<uint64_t, size_t>& B)
+		{
+			return A.first > B.first;
+		});
+
+	std::atomic<size_t> Next(0);
+	std::atomic<int> Read(0);
+	std::mutex CallbackLock;
+
+	auto Work = [&]()
+		{
+			EspContext Ctx;
+			for (size_t i = Next++; i < Order.size(); i = Next++)
+			{
+				const std::wstring& Path = Paths[Order[i].second];
+				std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+
+				EspBatchResult Result = {};
+				Result.Path = Path.c_str();
+				Result.Context = &Ctx;
+				Result.Bytes = Order[i].first;
+
+				if (Options.Language)
+				{
+					Ctx.Strings->LoadStringsFile(WStringToUtf8(Path), Options.Language);
+				}
+
+				Result.Status = ReadEsp(Ctx, Path.c_str(), Filter);
+				if (Result.Status == 0)
+				{
+					SummarizePlugin(*Ctx.Data, Result);
+					++Read;
+				}
+				Result.Seconds = SecondsSince(Start);
+
+				if (Callback)
+				{
+					std::lock_guard<std::mutex> Guard(CallbackLock);
+					Callback(&Result, UserData);
+				}
+
+				Ctx.ClearData();
+				Ctx.Strings->Clear();
+			}
+		};
+
+	size_t Workers = Options.ThreadCount > 0 ? static_cast<size_t>(Options.ThreadCount) : std::thread::hardware_concurrency();
+	if (Workers > Paths.size()) Workers = Paths.size();
+
+	std::vector<std::thread> Threads;
+	for (size_t i = 1; i < Workers; ++i)
+	{
+		Threads.push_back(std::thread(Work));
+	}
+	if (Workers > 0)
+	{
+		Work();
+	}
+	for (size_t i = 0; i < Threads.size(); ++i)
+	{
+		Threads[i].join();
+	}
+
+	return Read;
+}
+
+int C_BatchProcessDirectory(const wchar_t* Directory, const EspBatchOptions* Options, EspBatchCallback Callback, void* UserData)
+{
+	if (!Directory) return -1;
+
+	EspBatchOptions Defaults = { 0, NULL, NULL };
+	return BatchProcess(ListPlugins(Directory), Options ? *Options : Defaults, Callback, UserData);
+}
+
+int C_BatchProcessFiles(const wchar_t** Paths, int Count, const EspBatchOptions* Options, EspBatchCallback Callback, void* UserData)
+{
+	if ((!Paths && Count > 0) || Count < 0) return -1;
+
+	std::vector<std::wstring> List;
+	for (int i = 0; i < Count; ++i)
+	{
+		if (Paths[i])
+		{
+			List.push_back(Paths[i]);
+		}
+	}
+
+	EspBatchOptions Defaults = { 0, NULL, NULL };
+	return BatchProcess(List, Options ? *Options : Defaults, Callback, UserData);
+}
+
+#pragma endregion
+
+#pragma region Diff
+
+struct EspDiff
+{
+	std::vector<EspDiffEntry> Entries;
+};
+
+// A top-level GRUP (or the TES4 header) of a plugin image.
+struct TopLevelEntry
+{
+	std::string Label;
+	size_t Offset;
+	size_t Size;
+	uint64_t Hash;
+};
+
+bool ReadFileBytes(const wchar_t* Path, std::vector<uint8_t>& Out)
+{
+	std::ifstream F(Path, std::ios::binary | std::ios::ate);
+	if (!F.is_open())
+		return false;
+
+	Out.resize(static_cast<size_t>(F.tellg()));
+	F.seekg(0);
+	return Out.empty() || static_cast<bool>(F.read(reinterpret_cast<char*>(Out.data()), Out.size()));
+}
+
+// Label and size of the top-level entry whose 24-byte header is given, with
+// Remaining bytes left in the file from its start. False if it overruns them.
+bool DescribeTopLevel(const uint8_t* Header, uint64_t Remaining, TopLevelEntry& E)
+{
+	uint32_t Size;
+	std::memcpy(&Size, Header + 4, 4);
+
+	if (IsGRUP(reinterpret_cast<const char*>(Header)))
+	{
+		E.Label.assign(reinterpret_cast<const char*>(Header + 8), 4);
+		E.Size = Size;
+	}
+	else
+	{
+		E.Label.assign(reinterpret_cast<const char*>(Header), 4);
+		E.Size = 24 + static_cast<size_t>(Size);
+	}
+
+	return E.Size >= 24 && E.Size <= Remaining;
+}
+
+// Splits a plugin image into its top-level entries and hashes each one.
+bool ScanTopLevel(const std::vector<uint8_t>& Bytes, std::vector<TopLevelEntry>& Entries)
+{
+	size_t Pos = 0;
+	while (Pos + 24 <= Bytes.size())
+	{
+		TopLevelEntry E;
+		E.Offset = Pos;
+		if (!DescribeTopLevel(Bytes.data() + Pos, Bytes.size() - Pos, E))
+			return false;
+
+		E.Hash = Fnv1a(FNV1A_BASIS, Bytes.data() + Pos, E.Size);
+		Entries.push_back(E);
+		Pos += E.Size;
+	}
+	return Pos == Bytes.size();
+}
+
+// Parses the TES4 header and the given top-level groups only.
+void ParseTopLevel(const std::vector<uint8_t>& Bytes, const std::vector<const TopLevelEntry*>& Groups, EspData& Doc, const RecordFilter& Filter)
+{
+	MemoryStreamBuf Buffer(Bytes.data(), Bytes.size());
+	std::istream F(&Buffer);
+
+	char Sig[4];
+	if (F.read(Sig, 4) && !IsGRUP(Sig))
+	{
+		ParseRecord(F, Sig, Doc, Filter);
+	}
+
+	for (size_t i = 0; i < Groups.size(); ++i)
+	{
+		F.clear();
+		F.seekg(Groups[i]->Offset + 4);
+		ParseGroupIterative(F, Doc, Filter);
+	}
+
+	Doc.Finalize();
+}
+
+// A StringID compares by its text when strings are loaded.
+bool ResolvesText(const SubRecordData& Sub, const StringsManager* Strings)
+{
+	return Sub.IsLocalized && Strings && Strings->GetStringCount() > 0;
+}
+
+// The bytes a subrecord is compared by: the resolved text or its data.
+const std::string& DiffContent(const SubRecordData& Sub, const StringsManager* Strings, std::string& Scratch)
+{
+	if (ResolvesText(Sub, Strings))
+	{
+		Scratch = Sub.GetString(Strings);
+	}
+	else
+	{
+		Scratch.assign(Sub.Data.begin(), Sub.Data.end());
+	}
+	return Scratch;
+}
+
+void AddDiffEntry(EspDiff& Diff, const EspRecord& Rec, const SubRecordData& Sub, EspDiffChange Change)
 {
-	Clear();
+	EspDiffEntry E = {};
+	E.FormID = Rec.FormID;
+	std::memcpy(E.RecordSig, Rec.Sig.c_str(), Rec.Sig.size() < 4 ? Rec.Sig.size() : 4);
+	std::memcpy(E.SubSig, Sub.Sig.c_str(), Sub.Sig.size() < 4 ? Sub.Sig.size() : 4);
+	E.OccurrenceIndex = Sub.OccurrenceIndex;
+	E.Change = Change;
+	Diff.Entries.push_back(E);
 }
 
-void Close()
-{
-	delete TranslateFilter;
-	TranslateFilter = nullptr;
+// Either record may be null when it exists on one side only.
+void DiffRecord(EspDiff& Diff, const EspRecord* Old, const StringsManager* OldStrings, const EspRecord* New, const StringsManager* NewStrings)
+{
+	// Subrecords are matched by (Sig, OccurrenceIndex).
+	std::unordered_map<uint64_t, const SubRecordData*> OldSubs;
+	if (Old)
+	{
+		for (const auto& Sub : Old->SubRecords)
+		{
+			OldSubs[(static_cast<uint64_t>(PackSig(Sub.Sig.c_str())) << 32) | static_cast<uint32_t>(Sub.OccurrenceIndex)] = &Sub;
+		}
+	}
+
+	std::string OldScratch, NewScratch;
+	if (New)
+	{
+		for (const auto& Sub : New->SubRecords)
+		{
+			std::unordered_map<uint64_t, const SubRecordData*>::iterator It
+				= OldSubs.find((static_cast<uint64_t>(PackSig(Sub.Sig.c_str())) << 32) | static_cast<uint32_t>(Sub.OccurrenceIndex));
+			if (It == OldSubs.end())
+			{
+				AddDiffEntry(Diff, *New, Sub, ESP_DIFF_ADDED);
+				continue;
+			}
+
+			// Stored hashes first; bytes only to confirm a match. Resolved
+			// texts have no stored hash and are compared directly.
+			bool Same;
+			if (!ResolvesText(*It->second, OldStrings) && !ResolvesText(Sub, NewStrings))
+			{
+				Same = It->second->ContentHash == Sub.ContentHash && It->second->Data == Sub.Data;
+			}
+			else
+			{
+				Same = DiffContent(*It->second, OldStrings, OldScratch) == DiffContent(Sub, NewStrings, NewScratch);
+			}
+
+			if (!Same)
+			{
+				AddDiffEntry(Diff, *New, Sub, ESP_DIFF_CHANGED);
+			}
+			OldSubs.erase(It);
+		}
+	}
 
-	Clear();
+	if (Old)
+	{
+		for (const auto& Sub : Old->SubRecords)
+		{
+			if (OldSubs.count((static_cast<uint64_t>(PackSig(Sub.Sig.c_str())) << 32) | static_cast<uint32_t>(Sub.OccurrenceIndex)))
+			{
+				AddDiffEntry(Diff, *Old, Sub, ESP_DIFF_REMOVED);
+			}
+		}
+	}
 }
 
+// The TES4 header has the localized flag.
+bool IsLocalizedImage(const std::vector<uint8_t>& Bytes)
+{
+	return Bytes.size() >= 24 && std::memcmp(Bytes.data(), "TES4", 4) == 0 && (Bytes[8] & 0x80) != 0;
+}
 
-#pragma region SaveFunc
-
-std::vector<uint8_t> ModifySubRecords(
-	const std::vector<uint8_t>& OriginalData,
-	EspRecord* ModifiedRecord)
+bool DiffPlugins(const wchar_t* OldPath, const wchar_t* NewPath, const char* Language, EspDiff& Diff)
 {
-	std::vector<uint8_t> Result;
-	size_t Offset = 0;
+	std::vector<uint8_t> Bytes[2];
+	std::vector<TopLevelEntry> Entries[2];
+	const wchar_t* Paths[2] = { OldPath, NewPath };
 
-	std::unordered_map<std::string, std::unordered_map<int, const SubRecordData*>> ModifiedSubsMap;
-	for (const auto& Sub : ModifiedRecord->SubRecords)
+	for (int i = 0; i < 2; ++i)
 	{
-		std::string Key = Sub.Sig;
-		ModifiedSubsMap[Key][Sub.OccurrenceIndex] = &Sub;
+		if (!ReadFileBytes(Paths[i], Bytes[i]) || !ScanTopLevel(Bytes[i], Entries[i]))
+		{
+			std::cerr << "Failed to read plugin for diff: " << WStringToUtf8(Paths[i]) << "\n";
+			return false;
+		}
 	}
 
-	std::unordered_map<std::string, int> CurrentOccurrence;
+	// Groups whose bytes did not change hold no changes; parse only the rest.
+	// Localized text lives in the strings files, which the group bytes do not
+	// cover, so nothing is skipped when it is compared.
+	const bool CompareStrings = Language && (IsLocalizedImage(Bytes[0]) || IsLocalizedImage(Bytes[1]));
 
-	while (Offset + sizeof(SubRecordHeader) <= OriginalData.size())
+	std::unordered_map<std::string, const TopLevelEntry*> OldGroups;
+	for (size_t i = 0; i < Entries[0].size(); ++i)
 	{
-		SubRecordHeader SH;
-		std::memcpy(&SH, OriginalData.data() + Offset, sizeof(SH));
+		OldGroups[Entries[0][i].Label] = &Entries[0][i];
+	}
 
-		if (Offset + sizeof(SubRecordHeader) + SH.Size > OriginalData.size())
+	std::vector<const TopLevelEntry*> Changed[2];
+	std::unordered_set<std::string> Unchanged;
+	for (size_t i = 0; i < Entries[1].size(); ++i)
+	{
+		const TopLevelEntry& E = Entries[1][i];
+		if (!IsGRUP(reinterpret_cast<const char*>(Bytes[1].data() + E.Offset)))
+			continue;
+
+		std::unordered_map<std::string, const TopLevelEntry*>::const_iterator It = OldGroups.find(E.Label);
+		if (!CompareStrings && It != OldGroups.end() && It->second->Size == E.Size && It->second->Hash == E.Hash
+			&& std::memcmp(Bytes[0].data() + It->second->Offset, Bytes[1].data() + E.Offset, E.Size) == 0)
 		{
-			std::cerr << "Warning: Corrupted subrecord data at offset " << Offset << "\n";
-			break;
+			Unchanged.insert(E.Label);
+		}
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		for (size_t j = 0; j < Entries[i].size(); ++j)
+		{
+			const TopLevelEntry& E = Entries[i][j];
+			if (IsGRUP(reinterpret_cast<const char*>(Bytes[i].data() + E.Offset)) && !Unchanged.count(E.Label))
+			{
+				Changed[i].push_back(&E);
+			}
 		}
+	}
 
-		std::string SubSig(SH.Sig, 4);
+	RecordFilter Filter;
+	SetDefaultFilter(&Filter);
 
-		int Occurrence = CurrentOccurrence[SubSig]++;
+	StringsManager Strings[2];
+	EspData Docs[2];
+	for (int i = 0; i < 2; ++i)
+	{
+		if (Language)
+		{
+			Strings[i].LoadStringsFile(WStringToUtf8(Paths[i]), Language);
+			Docs[i].Strings = &Strings[i];
+		}
+		ParseTopLevel(Bytes[i], Changed[i], Docs[i], Filter);
+	}
 
-		bool IsModified = false;
-		const SubRecordData* ModifiedSub = nullptr;
+	// Records are matched by (FormID, Sig).
+	std::unordered_map<uint64_t, const EspRecord*> OldRecords;
+	for (const RecordStore* Vec : { &Docs[0].Records, &Docs[0].CellRecords })
+	{
+		for (const auto& Rec : *Vec)
+		{
+			OldRecords[(static_cast<uint64_t>(Rec.FormID) << 32) | PackSig(Rec.Sig.c_str())] = &Rec;
+		}
+	}
 
-		auto SigIt = ModifiedSubsMap.find(SubSig);
-		if (SigIt != ModifiedSubsMap.end())
+	for (const RecordStore* Vec : { &Docs[1].Records, &Docs[1].CellRecords })
+	{
+		for (const auto& Rec : *Vec)
 		{
-			auto OccIt = SigIt->second.find(Occurrence);
-			if (OccIt != SigIt->second.end())
+			std::unordered_map<uint64_t, const EspRecord*>::iterator It = OldRecords.find((static_cast<uint64_t>(Rec.FormID) << 32) | PackSig(Rec.Sig.c_str()));
+			if (It == OldRecords.end())
 			{
-				ModifiedSub = OccIt->second;
-				IsModified = true;
+				DiffRecord(Diff, NULL, NULL, &Rec, Docs[1].Strings);
+				continue;
 			}
+
+			DiffRecord(Diff, It->second, Docs[0].Strings, &Rec, Docs[1].Strings);
+			OldRecords.erase(It);
 		}
+	}
 
-		if (IsModified && ModifiedSub)
+	for (const RecordStore* Vec : { &Docs[0].Records, &Docs[0].CellRecords })
+	{
+		for (const auto& Rec : *Vec)
 		{
-			if (ModifiedSub->Data.size() > 0xFFFF)
+			if (OldRecords.count((static_cast<uint64_t>(Rec.FormID) << 32) | PackSig(Rec.Sig.c_str())))
 			{
-				std::cerr << "Error: Subrecord " << SubSig << " size exceeds 65535 bytes\n";
-				return {};
+				DiffRecord(Diff, &Rec, Docs[0].Strings, NULL, NULL);
 			}
+		}
+	}
 
-			SubRecordHeader NewSH = SH;
-			NewSH.Size = static_cast<uint16_t>(ModifiedSub->Data.size());
+	return true;
+}
 
-			Result.insert(Result.end(),
-				reinterpret_cast<uint8_t*>(&NewSH),
-				reinterpret_cast<uint8_t*>(&NewSH) + sizeof(NewSH));
+EspDiff* C_DiffPlugins(const wchar_t* OldPath, const wchar_t* NewPath, const char* Language)
+{
+	if (!OldPath || !NewPath) return nullptr;
 
-			Result.insert(Result.end(),
-				ModifiedSub->Data.begin(),
-				ModifiedSub->Data.end());
-		}
-		else
-		{
-			Result.insert(Result.end(),
-				OriginalData.begin() + Offset,
-				OriginalData.begin() + Offset + sizeof(SubRecordHeader) + SH.Size);
-		}
+	std::unique_ptr<EspDiff> Diff(new EspDiff());
+	if (!DiffPlugins(OldPath, NewPath, Language, *Diff))
+		return nullptr;
 
-		Offset += sizeof(SubRecordHeader) + SH.Size;
-	}
+	return Diff.release();
+}
 
-	return Result;
+int C_Diff_GetCount(const EspDiff* Diff)
+{
+	return Diff ? static_cast<int>(Diff->Entries.size()) : 0;
 }
 
-bool ProcessFileContent(std::ifstream& Fin, std::ofstream& Fout, int64_t RemainingSize);
-bool ProcessGRUP(std::ifstream& Fin, std::ofstream& Fout, const char Sig[4]);
-bool ProcessGRUPContent(std::ifstream& Fin, std::ofstream& Fout, int64_t ContentSize);
-bool ProcessRecord(std::ifstream& Fin, std::ofstream& Fout, const char Sig[4]);
+const EspDiffEntry* C_Diff_GetEntries(const EspDiff* Diff)
+{
+	return Diff && !Diff->Entries.empty() ? Diff->Entries.data() : nullptr;
+}
 
-bool ProcessFileContent(std::ifstream& Fin, std::ofstream& Fout, int64_t RemainingSize)
+void C_Diff_Free(EspDiff* Diff)
 {
-	int64_t BytesProcessed = 0;
+	delete Diff;
+}
 
-	while (Fin.good() && Fin.peek() != EOF)
-	{
-		if (RemainingSize >= 0 && BytesProcessed >= RemainingSize)
-		{
-			break;
-		}
+#pragma endregion
 
-		char Sig[4];
-		std::streampos PosBeforeSig = Fin.tellg();
-		if (!Fin.read(Sig, 4)) break;
+#pragma region Reload
+
+// Parses one top-level entry and appends it to Doc.SourceGroups.
+void ParseSourceEntry(std::istream& F, const TopLevelEntry& E, EspData& Doc, const RecordFilter& Filter)
+{
+	const size_t GrupsBefore = Doc.GrupCount;
+
+	F.clear();
+	F.seekg(E.Offset);
 
+	char Sig[4];
+	if (F.read(Sig, 4))
+	{
 		if (IsGRUP(Sig))
 		{
-			if (!ProcessGRUP(Fin, Fout, Sig))
-			{
-				std::cerr << "Error: Failed to process GRUP at position " << PosBeforeSig << "\n";
-				return false;
-			}
+			ParseGroupIterative(F, Doc, Filter);
 		}
 		else
 		{
-			if (!ProcessRecord(Fin, Fout, Sig))
-			{
-				std::cerr << "Error: Failed to process record at position " << PosBeforeSig << "\n";
-				return false;
-			}
+			ParseRecord(F, Sig, Doc, Filter);
 		}
-
-		std::streampos PosAfterProcess = Fin.tellg();
-		int64_t Consumed = static_cast<int64_t>(PosAfterProcess) - static_cast<int64_t>(PosBeforeSig);
-		BytesProcessed += Consumed;
 	}
 
-	return true;
+	SourceGroup G;
+	G.Label = E.Label;
+	G.Offset = E.Offset;
+	G.Size = E.Size;
+	G.Hash = E.Hash;
+	G.GrupCount = Doc.GrupCount - GrupsBefore;
+	Doc.SourceGroups.push_back(G);
 }
 
-bool ProcessGRUP(std::ifstream& Fin, std::ofstream& Fout, const char Sig[4])
+// Reads a file through a buffer of its own and hashes the bytes of the range
+// given to BeginHash, in file order, as they pass. Seeking forward over bytes
+// of that range reads them, so none is missed; seeking back never hashes a
+// byte twice.
+class HashingFileBuf : public std::streambuf
 {
-	GroupHeader GH{};
-	std::memcpy(GH.Sig, Sig, 4);
-
-	Read(Fin, GH.Size);
-	Fin.read(GH.Label, 4);
-	Read(Fin, GH.GroupType);
-	Read(Fin, GH.Stamp);
-	Read(Fin, GH.Unknown);
-
-	if (GH.Size < 24)
+public:
+	explicit HashingFileBuf(const wchar_t* Path, size_t BufferSize = 1 << 20)
+		: File_(Path, std::ios::binary | std::ios::ate), Buffer_(BufferSize), Size_(0), Start_(0), FilePos_(0),
+		Hash_(FNV1A_BASIS), HashedTo_(0), HashEnd_(0)
 	{
-		std::cerr << "Error: Invalid GRUP size: " << GH.Size << "\n";
-		return false;
+		if (File_.is_open())
+		{
+			Size_ = static_cast<uint64_t>(File_.tellg());
+			File_.seekg(0);
+		}
+		setg(Buffer_.data(), Buffer_.data(), Buffer_.data());
 	}
 
-	std::streampos GrupHeaderPos = Fout.tellp();
-	Fout.write(reinterpret_cast<char*>(&GH), sizeof(GH));
-
-	std::streampos GrupContentStart = Fout.tellp();
-
-	int64_t ContentSize = GH.Size - 24;
-
-	bool Success = ProcessGRUPContent(Fin, Fout, ContentSize);
+	bool IsOpen() const
+	{
+		return File_.is_open();
+	}
 
-	if (!Success)
+	uint64_t Size() const
 	{
-		return false;
+		return Size_;
 	}
 
-	std::streampos GrupContentEnd = Fout.tellp();
-	uint32_t ActualContentSize = static_cast<uint32_t>(GrupContentEnd - GrupContentStart);
-	uint32_t ActualGrupSize = ActualContentSize + 24;
+	void BeginHash(uint64_t Begin, uint64_t End)
+	{
+		Hash_ = FNV1A_BASIS;
+		HashedTo_ = Begin;
+		HashEnd_ = End;
+	}
 
-	if (ActualGrupSize != GH.Size)
+	// FNV-1a of the range since BeginHash, reading whatever of it was not read yet.
+	uint64_t TakeHash()
 	{
-		std::streampos SavedPos = Fout.tellp();
-		Fout.seekp(GrupHeaderPos + std::streamoff(4));
-		Fout.write(reinterpret_cast<char*>(&ActualGrupSize), sizeof(ActualGrupSize));
-		Fout.seekp(SavedPos);
+		while (HashedTo_ < HashEnd_)
+		{
+			if ((HashedTo_ < Start_ || HashedTo_ >= BufferEnd()) && !Load(HashedTo_))
+				break;
+
+			HashBuffer();
+		}
+		return Hash_;
 	}
 
-	return true;
-}
+protected:
+	int_type underflow()
+	{
+		if (gptr() == egptr() && !Load(BufferEnd()))
+			return traits_type::eof();
 
-bool ProcessGRUPContent(std::ifstream& Fin, std::ofstream& Fout, int64_t ContentSize)
-{
-	std::streampos ContentStart = Fin.tellg();
-	int64_t BytesProcessed = 0;
+		return traits_type::to_int_type(*gptr());
+	}
 
-	while (BytesProcessed < ContentSize && Fin.good())
+	pos_type seekoff(off_type Offset, std::ios_base::seekdir Dir, std::ios_base::openmode)
 	{
-		if (ContentSize - BytesProcessed < 4)
+		uint64_t Base = Dir == std::ios_base::beg ? 0 : (Dir == std::ios_base::cur ? Start_ + (gptr() - eback()) : Size_);
+		int64_t Target = static_cast<int64_t>(Base) + Offset;
+		if (Target < 0 || static_cast<uint64_t>(Target) > Size_)
+			return pos_type(off_type(-1));
+
+		const uint64_t To = static_cast<uint64_t>(Target);
+		// Bytes of the hashed range are read on the way rather than skipped.
+		while (To > BufferEnd() && HashedTo_ >= Start_ && HashedTo_ < HashEnd_)
 		{
-			int64_t Remaining = ContentSize - BytesProcessed;
-			Fin.seekg(Remaining, std::ios::cur);
-			BytesProcessed += Remaining;
-			break;
+			if (!Load(BufferEnd()))
+				break;
 		}
 
-		char Sig[4];
-		std::streampos PosBeforeRead = Fin.tellg();
-		if (!Fin.read(Sig, 4))
+		if (To < Start_ || To > BufferEnd())
 		{
-			std::cerr << "Error: Failed to read signature in GRUP content\n";
-			break;
+			Load(To);
 		}
 
-		if (IsGRUP(Sig))
-		{
-			if (!ProcessGRUP(Fin, Fout, Sig))
-			{
-				return false;
-			}
-		}
-		else
+		setg(eback(), eback() + (To - Start_), egptr());
+		return pos_type(off_type(To));
+	}
+
+	pos_type seekpos(pos_type Position, std::ios_base::openmode Which)
+	{
+		return seekoff(off_type(Position), std::ios_base::beg, Which);
+	}
+
+private:
+	std::ifstream File_;
+	std::vector<char> Buffer_;
+	uint64_t Size_;
+	uint64_t Start_;     // file offset of the buffer
+	uint64_t FilePos_;   // where File_ reads next
+	uint64_t Hash_;
+	uint64_t HashedTo_;
+	uint64_t HashEnd_;
+
+	uint64_t BufferEnd() const
+	{
+		return Start_ + (egptr() - eback());
+	}
+
+	void HashBuffer()
+	{
+		uint64_t End = BufferEnd() < HashEnd_ ? BufferEnd() : HashEnd_;
+		if (HashedTo_ < Start_ || HashedTo_ >= End)
+			return;
+
+		Hash_ = Fnv1a(Hash_, eback() + (HashedTo_ - Start_), static_cast<size_t>(End - HashedTo_));
+		HashedTo_ = End;
+	}
+
+	// Refills the buffer from Pos, hashing what the old one holds first.
+	bool Load(uint64_t Pos)
+	{
+		HashBuffer();
+
+		if (Pos != FilePos_)
 		{
-			if (!ProcessRecord(Fin, Fout, Sig))
-			{
-				return false;
-			}
+			File_.clear();
+			File_.seekg(static_cast<std::streamoff>(Pos));
 		}
+		File_.read(Buffer_.data(), Buffer_.size());
+		size_t Got = static_cast<size_t>(File_.gcount());
+		File_.clear();
+
+		Start_ = Pos;
+		FilePos_ = Pos + Got;
+		setg(Buffer_.data(), Buffer_.data(), Buffer_.data() + Got);
+		return Got > 0;
+	}
+};
 
-		std::streampos PosAfterProcess = Fin.tellg();
-		int64_t Consumed = static_cast<int64_t>(PosAfterProcess - PosBeforeRead);
-		BytesProcessed += Consumed;
+// Full read that also remembers each top-level entry's size and hash. The
+// file is streamed: each entry is hashed as it is parsed, not held whole.
+int ReadSourceStream(EspContext& Ctx, const wchar_t* EspPath, const RecordFilter& Filter)
+{
+	HashingFileBuf Buffer(EspPath);
+	if (!Buffer.IsOpen())
+	{
+		std::cerr << "Failed to open ESP: " << EspPath << "\n";
+		return 1;
 	}
+	std::istream F(&Buffer);
+
+	Ctx.Data = new EspData();
+	Ctx.Data->Strings = Ctx.Strings;
+	Ctx.Data->SourceFilterRevision = Filter.GetRevision();
 
-	if (BytesProcessed < ContentSize)
+	uint64_t Pos = 0;
+	while (Pos + 24 <= Buffer.Size())
 	{
-		int64_t Remaining = ContentSize - BytesProcessed;
-		std::cerr << "Warning: Skipping " << Remaining << " unprocessed bytes in GRUP\n";
-		Fin.seekg(Remaining, std::ios::cur);
+		uint8_t Header[24];
+		TopLevelEntry E;
+		F.clear();
+		if (!F.seekg(static_cast<std::streamoff>(Pos)) || !F.read(reinterpret_cast<char*>(Header), sizeof(Header))
+			|| !DescribeTopLevel(Header, Buffer.Size() - Pos, E))
+			break;
+
+		E.Offset = static_cast<size_t>(Pos);
+		E.Hash = 0;
+		Buffer.BeginHash(Pos, Pos + E.Size);
+		ParseSourceEntry(F, E, *Ctx.Data, Filter);
+		Ctx.Data->SourceGroups.back().Hash = Buffer.TakeHash();
+		Pos += E.Size;
 	}
-	else if (BytesProcessed > ContentSize)
+
+	// A damaged tail: read what parses, as a plain stream read would, and
+	// leave no groups for a reload to reuse
+	if (Pos != Buffer.Size())
 	{
-		int64_t Excess = BytesProcessed - ContentSize;
-		std::cerr << "Warning: Consumed " << Excess << " extra bytes, rewinding\n";
-		Fin.seekg(-Excess, std::ios::cur);
+		Ctx.Data->SourceGroups.clear();
+		F.clear();
+		F.seekg(static_cast<std::streamoff>(Pos));
+		ParseToEnd(F, *Ctx.Data, Filter);
 	}
 
-	return true;
+	Ctx.Data->Finalize();
+	Ctx.PublishSnapshot();
+	return 0;
 }
 
+// A reload needs the last read to have been a full read of the same file
+// with the same filter.
+bool CanReloadGroups(const EspContext& Ctx, const wchar_t* EspPath, const RecordFilter& Filter)
+{
+	const EspData* Old = Ctx.Data;
+	return Old && !Old->SourceGroups.empty() && Ctx.LastSetPath == EspPath && Old->SourceFilterRevision == Filter.GetRevision();
+}
 
-bool ProcessRecord(std::ifstream& Fin, std::ofstream& Fout, const char Sig[4])
+// Splices a new version of the plugin Ctx holds into its document. Entries
+// whose size and hash match the last read keep their records, and so their
+// handles; the others are parsed again. Returns false when a full read is
+// needed instead: another file or filter, edited records, a changed TES4
+// header (localization, masters), or top-level labels that are not unique.
+bool ReloadChangedGroups(EspContext& Ctx, const wchar_t* EspPath, const std::vector<uint8_t>& Bytes, const RecordFilter& Filter)
 {
-	RecordHeader HDR{};
-	std::memcpy(HDR.Sig, Sig, 4);
+	EspData* Old = Ctx.Data;
+	if (!CanReloadGroups(Ctx, EspPath, Filter))
+		return false;
 
-	Read(Fin, HDR.DataSize);
-	Read(Fin, HDR.Flags);
-	Read(Fin, HDR.FormID);
-	Read(Fin, HDR.VersionCtrl);
-	Read(Fin, HDR.Version);
-	Read(Fin, HDR.Unknown);
+	std::vector<TopLevelEntry> Entries;
+	if (!ScanTopLevel(Bytes, Entries))
+		return false;
 
-	EspRecord* Rec = NULL;
+	std::unordered_map<std::string, size_t> OldByLabel;
+	for (size_t i = 0; i < Old->SourceGroups.size(); ++i)
+	{
+		if (!OldByLabel.insert(std::make_pair(Old->SourceGroups[i].Label, i)).second)
+			return false;
+	}
 
-	for (auto& record : Data->Records)
+	// For each new entry, the old group it repeats unchanged, or -1.
+	std::unordered_set<std::string> NewLabels;
+	std::vector<int> KeptFrom(Entries.size(), -1);
+	for (size_t i = 0; i < Entries.size(); ++i)
 	{
-		if (record.FormID == HDR.FormID &&
-			record.Sig == std::string(Sig, 4))
+		const TopLevelEntry& E = Entries[i];
+		if (!NewLabels.insert(E.Label).second)
+			return false;
+
+		std::unordered_map<std::string, size_t>::const_iterator It = OldByLabel.find(E.Label);
+		if (It != OldByLabel.end() && Old->SourceGroups[It->second].Size == E.Size && Old->SourceGroups[It->second].Hash == E.Hash)
 		{
-			Rec = &record;
-			break;
+			KeptFrom[i] = static_cast<int>(It->second);
+		}
+		else if (E.Label == "TES4")
+		{
+			return false;
 		}
 	}
 
-	if (!Rec)
+	// Every record, and every EditorID entry, belongs to the old group its
+	// offset falls in.
+	auto GroupOf = [Old](int64_t SourceOffset) -> int
+		{
+			if (SourceOffset < 0)
+				return -1;
+
+			std::vector<SourceGroup>::const_iterator G = std::upper_bound(Old->SourceGroups.begin(), Old->SourceGroups.end(), static_cast<uint64_t>(SourceOffset),
+				[](uint64_t Offset, const SourceGroup& Group) { return Offset < Group.Offset; });
+			return static_cast<int>(G - Old->SourceGroups.begin()) - 1;
+		};
+
+	std::vector<std::vector<const EspRecord*> > Owned(Old->SourceGroups.size());
+	for (const RecordStore* Vec : { &Old->Records, &Old->CellRecords })
 	{
-		for (auto& record : Data->CellRecords)
+		for (const auto& Rec : *Vec)
 		{
-			if (record.FormID == HDR.FormID &&
-				record.Sig == std::string(Sig, 4))
-			{
-				Rec = &record;
-				break;
-			}
+			const int Group = GroupOf(Rec.SourceOffset);
+			if (Rec.Dirty || Group < 0)
+				return false;
+
+			Owned[Group].push_back(&Rec);
 		}
 	}
 
-	if (Rec != NULL)
+	std::vector<std::vector<const EditorIDIndex::Entry*> > OwnedEditorIDs(Old->SourceGroups.size());
+	const std::vector<EditorIDIndex::Entry>& OldEditorIDs = Old->EditorIDs.GetEntries();
+	for (size_t i = 0; i < OldEditorIDs.size(); ++i)
 	{
-		std::vector<uint8_t> OriginalData(HDR.DataSize);
-		Fin.read(reinterpret_cast<char*>(OriginalData.data()), HDR.DataSize);
+		const int Group = GroupOf(OldEditorIDs[i].SourceOffset);
+		if (Group >= 0)
+		{
+			OwnedEditorIDs[Group].push_back(&OldEditorIDs[i]);
+		}
+	}
 
-		std::vector<uint8_t> WorkingData;
-		bool WasCompressed = IsCompressed(HDR);
+	std::unique_ptr<EspData> Doc(new EspData());
+	Doc->Strings = Old->Strings;
+	Doc->IsLocalizedPlugin = Old->IsLocalizedPlugin;
+	Doc->Masters = Old->Masters;
+	Doc->SourceFilterRevision = Old->SourceFilterRevision;
+	Doc->RecordHandles = std::move(Old->RecordHandles);
+	Doc->SubRecordHandles = std::move(Old->SubRecordHandles);
 
-		if (WasCompressed)
-		{
-			uint32_t UncompressedSize;
-			std::memcpy(&UncompressedSize, OriginalData.data(), 4);
+	MemoryStreamBuf Buffer(Bytes.data(), Bytes.size());
+	std::istream F(&Buffer);
 
-			if (!ZlibDecompress(OriginalData.data() + 4,
-				OriginalData.size() - 4,
-				WorkingData,
-				UncompressedSize))
-			{
-				std::cerr << "Error: Decompression failed for " << std::string(Sig, 4)
-					<< " FormID 0x" << std::hex << HDR.FormID << std::dec << "\n";
-				return false;
-			}
-		}
-		else
+	std::vector<bool> Kept(Old->SourceGroups.size(), false);
+	for (size_t i = 0; i < Entries.size(); ++i)
+	{
+		if (KeptFrom[i] < 0)
 		{
-			WorkingData = OriginalData;
+			ParseSourceEntry(F, Entries[i], *Doc, Filter);
+			continue;
 		}
 
-		WorkingData = ModifySubRecords(WorkingData, Rec);
+		const SourceGroup& From = Old->SourceGroups[KeptFrom[i]];
+		const int64_t Shift = static_cast<int64_t>(Entries[i].Offset) - static_cast<int64_t>(From.Offset);
 
-		std::vector<uint8_t> FinalData;
-		if (WasCompressed)
+		const std::vector<const EspRecord*>& Records = Owned[KeptFrom[i]];
+		for (size_t j = 0; j < Records.size(); ++j)
 		{
-			std::vector<uint8_t> Compressed;
-			if (!ZlibCompress(WorkingData.data(), WorkingData.size(), Compressed))
-			{
-				std::cerr << "Error: Compression failed for " << std::string(Sig, 4)
-					<< " FormID 0x" << std::hex << HDR.FormID << std::dec << "\n";
-				return false;
-			}
-
-			FinalData.resize(4 + Compressed.size());
-			uint32_t UncompSize = static_cast<uint32_t>(WorkingData.size());
-			std::memcpy(FinalData.data(), &UncompSize, 4);
-			std::memcpy(FinalData.data() + 4, Compressed.data(), Compressed.size());
+			EspRecord Rec(*Records[j]);
+			Rec.SourceOffset += Shift;
+			Doc->KeepRecord(Rec);
 		}
-		else
+
+		const std::vector<const EditorIDIndex::Entry*>& EditorIDs = OwnedEditorIDs[KeptFrom[i]];
+		for (size_t j = 0; j < EditorIDs.size(); ++j)
 		{
-			FinalData = WorkingData;
+			Doc->EditorIDs.Add(EditorIDs[j]->Key, EditorIDs[j]->FormID, EditorIDs[j]->Sig, EditorIDs[j]->SourceOffset + Shift);
 		}
 
-		HDR.DataSize = static_cast<uint32_t>(FinalData.size());
-
-		Fout.write(Sig, 4);
-		Fout.write(reinterpret_cast<char*>(&HDR.DataSize), sizeof(HDR.DataSize));
-		Fout.write(reinterpret_cast<char*>(&HDR.Flags), sizeof(HDR.Flags));
-		Fout.write(reinterpret_cast<char*>(&HDR.FormID), sizeof(HDR.FormID));
-		Fout.write(reinterpret_cast<char*>(&HDR.VersionCtrl), sizeof(HDR.VersionCtrl));
-		Fout.write(reinterpret_cast<char*>(&HDR.Version), sizeof(HDR.Version));
-		Fout.write(reinterpret_cast<char*>(&HDR.Unknown), sizeof(HDR.Unknown));
-		Fout.write(reinterpret_cast<char*>(FinalData.data()), FinalData.size());
+		SourceGroup G = From;
+		G.Offset = Entries[i].Offset;
+		Doc->SourceGroups.push_back(G);
+		Doc->GrupCount += From.GrupCount;
+		Kept[KeptFrom[i]] = true;
 	}
-	else
-	{
-		uint32_t TotalSize = 24 + HDR.DataSize;
-		std::vector<uint8_t> CompleteRecord(TotalSize);
 
-		std::memcpy(CompleteRecord.data(), Sig, 4);
-		std::memcpy(CompleteRecord.data() + 4, &HDR.DataSize, sizeof(HDR.DataSize));
-		std::memcpy(CompleteRecord.data() + 8, &HDR.Flags, sizeof(HDR.Flags));
-		std::memcpy(CompleteRecord.data() + 12, &HDR.FormID, sizeof(HDR.FormID));
-		std::memcpy(CompleteRecord.data() + 16, &HDR.VersionCtrl, sizeof(HDR.VersionCtrl));
-		std::memcpy(CompleteRecord.data() + 20, &HDR.Version, sizeof(HDR.Version));
-		std::memcpy(CompleteRecord.data() + 22, &HDR.Unknown, sizeof(HDR.Unknown));
-
-		Fin.read(reinterpret_cast<char*>(CompleteRecord.data() + 24), HDR.DataSize);
+	for (size_t i = 0; i < Owned.size(); ++i)
+	{
+		if (Kept[i])
+			continue;
 
-		Fout.write(reinterpret_cast<char*>(CompleteRecord.data()), TotalSize);
+		for (size_t j = 0; j < Owned[i].size(); ++j)
+		{
+			Doc->ReleaseHandles(*Owned[i][j]);
+		}
 	}
 
+	Doc->Finalize();
+
+	delete Ctx.Data;
+	Ctx.Data = Doc.release();
+	Ctx.SourceBytes.reset();
+	Ctx.PublishSnapshot();
 	return true;
 }
 
+#pragma endregion
 
-bool SaveEsp(const char* SavePath)
+#pragma region TranslationMemory
+
+struct EspTmLookup
 {
-	if (LastSetPath.empty())
-	{
-		//std::cerr << "Error: No source ESP file path set\n";
-		return false;
-	}
+	std::vector<std::string> Sources;
+	std::vector<std::string> Targets;
+	std::vector<EspTmMatch> Matches;
+	std::vector<EspTranslationEdit> Edits; // hits only
+};
 
-	std::ifstream Fin(LastSetPath, std::ios::binary);
-	if (!Fin.is_open())
-	{
-		//std::cerr << "Error: Cannot open source ESP file: " << LastSetPath << "\n";
-		return false;
-	}
+TranslationMemory* C_OpenTranslationMemory(const char* Utf8Path)
+{
+	if (!Utf8Path) return nullptr;
 
-	std::ofstream Fout(SavePath, std::ios::binary);
-	if (!Fout.is_open())
+	std::unique_ptr<TranslationMemory> Tm(new TranslationMemory());
+	if (!Tm->Open(Utf8Path))
 	{
-		//std::cerr << "Error: Cannot create output ESP file: " << SavePath << "\n";
-		Fin.close();
-		return false;
+		std::cerr << "Failed to open translation memory: " << Utf8Path << "\n";
+		return nullptr;
 	}
+	return Tm.release();
+}
+
+void C_CloseTranslationMemory(TranslationMemory* Tm)
+{
+	delete Tm;
+}
 
-	//std::cout << "Processing: " << LastSetPath << " -> " << SavePath << "\n";
+bool C_TranslationMemory_Add(TranslationMemory* Tm, const char* SourceUtf8, const char* TargetUtf8)
+{
+	if (!Tm || !SourceUtf8 || !TargetUtf8) return false;
 
-	bool Success = ProcessFileContent(Fin, Fout, -1);
+	return Tm->Add(SourceUtf8, TargetUtf8);
+}
 
-	Fin.close();
-	Fout.close();
+int C_TranslationMemory_Lookup(TranslationMemory* Tm, const char* SourceUtf8, uint8_t* Buffer, int BufferSize)
+{
+	if (!Tm || !SourceUtf8) return -1;
 
-	if (Success)
+	std::string Target;
+	if (!Tm->Lookup(SourceUtf8, Target))
+		return -1;
+
+	return CopyStringUtf8(Target, Buffer, BufferSize);
+}
+
+int C_TranslationMemory_GetCount(TranslationMemory* Tm)
+{
+	return Tm ? static_cast<int>(Tm->GetCount()) : 0;
+}
+
+bool C_TranslationMemory_Compact(TranslationMemory* Tm, bool Background)
+{
+	return Tm ? Tm->Compact(Background) : false;
+}
+
+EspTmLookup* C_Ctx_LookupTranslations(EspContext* Ctx, TranslationMemory* Tm)
+{
+	if (!Ctx || !Tm) return nullptr;
+	std::lock_guard<std::mutex> Guard(Ctx->Lock);
+
+	if (!Ctx->Data) return nullptr;
+
+	std::unique_ptr<EspTmLookup> Lookup(new EspTmLookup());
+	for (const RecordStore* Vec : { &Ctx->Data->Records, &Ctx->Data->CellRecords })
 	{
-		std::cout << "Successfully saved modified ESP to: " << SavePath << "\n";
+		for (const auto& Rec : *Vec)
+		{
+			for (const auto& Sub : Rec.SubRecords)
+			{
+				// Stored text may keep its terminator
+				std::string Text = Sub.GetString(Ctx->Data->Strings);
+				Text.resize(std::strlen(Text.c_str()));
+				if (Text.empty())
+					continue;
+
+				EspTmMatch M = {};
+				M.SubRecord = Sub.Handle;
+				M.FormID = Rec.FormID;
+				std::memcpy(M.RecordSig, Rec.Sig.c_str(), Rec.Sig.size() < 4 ? Rec.Sig.size() : 4);
+				std::memcpy(M.SubSig, Sub.Sig.c_str(), Sub.Sig.size() < 4 ? Sub.Sig.size() : 4);
+				M.OccurrenceIndex = Sub.OccurrenceIndex;
+
+				Lookup->Matches.push_back(M);
+				Lookup->Sources.push_back(Text);
+			}
+		}
 	}
-	else
+
+	std::vector<char> Hits;
+	Tm->LookupBatch(Lookup->Sources, Lookup->Targets, Hits);
+
+	// The strings are in place now; point at them.
+	for (size_t i = 0; i < Lookup->Matches.size(); ++i)
 	{
-		std::cerr << "Failed to save ESP file\n";
+		EspTmMatch& M = Lookup->Matches[i];
+		M.SourceUtf8 = Lookup->Sources[i].c_str();
+		M.TargetUtf8 = Hits[i] ? Lookup->Targets[i].c_str() : nullptr;
+
+		if (Hits[i])
+		{
+			EspTranslationEdit Edit;
+			Edit.FormID = M.FormID;
+			Edit.RecordSig = M.RecordSig;
+			Edit.SubSig = M.SubSig;
+			Edit.OccurrenceIndex = M.OccurrenceIndex;
+			Edit.Utf8Text = M.TargetUtf8;
+			Lookup->Edits.push_back(Edit);
+		}
 	}
 
-	return Success;
+	return Lookup.release();
+}
+
+int C_TmLookup_GetCount(const EspTmLookup* Lookup)
+{
+	return Lookup ? static_cast<int>(Lookup->Matches.size()) : 0;
+}
+
+int C_TmLookup_GetHitCount(const EspTmLookup* Lookup)
+{
+	return Lookup ? static_cast<int>(Lookup->Edits.size()) : 0;
+}
+
+const EspTmMatch* C_TmLookup_GetMatches(const EspTmLookup* Lookup)
+{
+	return Lookup && !Lookup->Matches.empty() ? Lookup->Matches.data() : nullptr;
+}
+
+const EspTranslationEdit* C_TmLookup_GetEdits(const EspTmLookup* Lookup)
+{
+	return Lookup && !Lookup->Edits.empty() ? Lookup->Edits.data() : nullptr;
+}
+
+void C_TmLookup_Free(EspTmLookup* Lookup)
+{
+	delete Lookup;
 }
 
 #pragma endregion
\ No newline at end of file
@@ -7,17 +7,28 @@
 #include <cstring>
 #include <unordered_map>
 #include <unordered_set>
+#include <atomic>
+#include <memory>
 #include "TextHelper.h"
 #include "StringsFileHelper.h"
+#include "SlotMap.h"
+#include "EditorIDIndex.h"
 
 // ===== Record Filter Configuration =====
+inline uint64_t NextFilterRevision()
+{
+	static std::atomic<uint64_t> Revision(1);
+	return Revision.fetch_add(1);
+}
+
 class RecordFilter
 {
 public:
 	bool AllowAll;
-	RecordFilter() : AllowAll(false) {}
+	RecordFilter() : AllowAll(false), Revision_(NextFilterRevision()) {}
 	void AddRecordType(const std::string& recordType, const std::vector<std::string>& subRecords)
 	{
+		Revision_ = NextFilterRevision();
 		std::string sig = recordType.substr(0, 4);
 		RecordTypes_.insert(sig);
 
@@ -63,7 +74,15 @@ public:
 		return !RecordTypes_.empty();
 	}
 
+	// Changes with every edit of the filter and differs between filters,
+	// unless one is a copy of the other.
+	uint64_t GetRevision() const
+	{
+		return Revision_;
+	}
+
 private:
+	uint64_t Revision_;
 	std::unordered_set<std::string> RecordTypes_;
 	std::unordered_map<std::string, std::unordered_set<std::string>> SubRecordFilters_;
 };
@@ -265,26 +284,65 @@ public:
 	}
 };
 
+// 64-bit FNV-1a. Start from FNV1A_BASIS; feeding consecutive ranges gives the
+// hash of their concatenation.
+const uint64_t FNV1A_BASIS = 0xCBF29CE484222325ull;
+
+inline uint64_t Fnv1a(uint64_t Hash, const void* Data, size_t Size)
+{
+	const uint8_t* Bytes = static_cast<const uint8_t*>(Data);
+	for (size_t i = 0; i < Size; ++i)
+	{
+		Hash = (Hash ^ Bytes[i]) * 0x100000001B3ull;
+	}
+	return Hash;
+}
+
 struct SubRecordData
 {
 	std::string Sig;
 	std::vector<uint8_t> Data;
 	bool IsLocalized;
 	uint32_t StringID;
+	// StringID from the source plugin. Unlike StringID it survives edits,
+	// so a localized save can put the new text back under the same ID.
+	uint32_t SourceStringID;
+	// Which strings file StringID refers to, from the record and subrecord type.
+	StringsFileType StringsType;
 	int OccurrenceIndex;
 	int GlobalIndex;
+	// Position in the record's original subrecord stream, counting subrecords
+	// the filter dropped. Save merges edits back in by this index.
+	int SourceIndex;
+	EspHandle Handle;
+	// Fnv1a of Data, updated with it. Equal data gives equal hashes in any plugin.
+	uint64_t ContentHash;
 
-	SubRecordData() : IsLocalized(false), StringID(0), OccurrenceIndex(0), GlobalIndex(0) {}
+	SubRecordData() : IsLocalized(false), StringID(0), SourceStringID(0), StringsType(StringsTypeStrings), OccurrenceIndex(0), GlobalIndex(0), SourceIndex(-1), Handle(INVALID_ESP_HANDLE), ContentHash(FNV1A_BASIS) {}
 
 	std::string GetString() const
+	{
+		return GetString(g_StringsManager);
+	}
+
+	// Resolve localized text through the given manager instead of the global one.
+	std::string GetString(const StringsManager* Strings) const
+	{
+		return GetString(Strings, 0);
+	}
+
+	// Localized text in one of the manager's languages (0 is the current one).
+	// The language must already be loaded; see StringsManager::LoadLanguage.
+	std::string GetString(const StringsManager* Strings, size_t Language) const
 	{
 		if (Data.empty()) return "";
 
 		if (IsLocalized)
 		{
-			if (g_StringsManager && g_StringsManager->HasString(StringID))
+			StringView Text = Strings ? Strings->GetStringView(Language, StringsType, StringID) : StringView();
+			if (Text.found())
 			{
-				return g_StringsManager->GetString(StringID);
+				return Text.str();
 			}
 			return "<StringID:" + std::to_string(StringID) + ">";
 		}
@@ -310,9 +368,24 @@ class EspRecord
 	std::unordered_map<std::string, int> TotalOccurrenceCount;
 	uint8_t LastEPFT;
 	bool HasEPFT;
+	int SubRecordsSeen;
+	EspHandle Handle;
+
+	// Captured from EDID at parse time, even when the filter drops EDID.
+	std::string EditorID;
+
+	// File offset of the record header in the source plugin, -1 if unknown.
+	int64_t SourceOffset;
+	// Set by the modify APIs. Save re-encodes dirty records and copies the rest verbatim.
+	bool Dirty;
+	// The plugin's TES4 header has the localized flag; 4-byte text fields are StringIDs.
+	bool InLocalizedPlugin;
+	// Fnv1a of the uncompressed subrecord stream as read, filtered subrecords
+	// included. Edits do not change it.
+	uint64_t PayloadHash;
 
 	EspRecord(const char* S, uint32_t FID, uint32_t FL)
-		: Sig(S, 4), FormID(FID), Flags(FL), LastEPFT(0), HasEPFT(false)
+		: Sig(S, 4), FormID(FID), Flags(FL), LastEPFT(0), HasEPFT(false), SubRecordsSeen(0), Handle(INVALID_ESP_HANDLE), SourceOffset(-1), Dirty(false), InLocalizedPlugin(false), PayloadHash(FNV1A_BASIS)
 	{
 	}
 
@@ -324,6 +397,13 @@ class EspRecord
 		, TotalOccurrenceCount(other.TotalOccurrenceCount)
 		, LastEPFT(other.LastEPFT)     
 		, HasEPFT(other.HasEPFT)       
+		, SubRecordsSeen(other.SubRecordsSeen)
+		, Handle(other.Handle)
+		, EditorID(other.EditorID)
+		, SourceOffset(other.SourceOffset)
+		, Dirty(other.Dirty)
+		, InLocalizedPlugin(other.InLocalizedPlugin)
+		, PayloadHash(other.PayloadHash)
 	{
 	}
 
@@ -338,18 +418,30 @@ class EspRecord
 			TotalOccurrenceCount = other.TotalOccurrenceCount;
 			LastEPFT = other.LastEPFT;
 	        HasEPFT = other.HasEPFT;
+			SubRecordsSeen = other.SubRecordsSeen;
+			Handle = other.Handle;
+			EditorID = other.EditorID;
+			SourceOffset = other.SourceOffset;
+			Dirty = other.Dirty;
+			InLocalizedPlugin = other.InLocalizedPlugin;
+			PayloadHash = other.PayloadHash;
 		}
 		return *this;
 	}
 
 	bool CanTranslate() const
+	{
+		return CanTranslate(g_StringsManager);
+	}
+
+	bool CanTranslate(const StringsManager* Strings) const
 	{
 		for (size_t i = 0; i < SubRecords.size(); ++i)
 		{
 			const SubRecordData& Sub = SubRecords[i];
 			if (!Sub.Data.empty())
 			{
-				std::string Text = Sub.GetString();
+				std::string Text = Sub.GetString(Strings);
 
 				Text.erase(std::remove(Text.begin(), Text.end(), '\0'), Text.end());
 
@@ -365,7 +457,7 @@ class EspRecord
 		return false;
 	}
 
-	bool CanTranslateSub(const EspRecord& Parent, const SubRecordData& Item)
+	bool CanTranslateSub(const EspRecord& Parent, const SubRecordData& Item) const
 	{
 		if (Item.Data.empty())
 			return false;
@@ -448,7 +540,7 @@ class EspRecord
 		return true;
 	}
 
-	bool IsProbablyStringID(const uint8_t* data, size_t size)
+	bool IsProbablyStringID(const uint8_t* data, size_t size) const
 	{
 		if (size < 4) return false;
 
@@ -470,7 +562,7 @@ class EspRecord
 		return !allPrintable;
 	}
 
-	inline bool IsProbablyString(const uint8_t* data, size_t size)
+	inline bool IsProbablyString(const uint8_t* data, size_t size) const
 	{
 		if (!data || size == 0)
 			return false;
@@ -537,7 +629,7 @@ class EspRecord
 		return true;
 	}
 
-	void AddSubRecord(const char* Str, const uint8_t* DataPtr, size_t Size, RecordFilter& Filter)
+	void AddSubRecord(const char* Str, const uint8_t* DataPtr, size_t Size, const RecordFilter& Filter)
 	{
 		SubRecordData Sub;
 		Sub.Sig = std::string(Str, 4);
@@ -547,6 +639,21 @@ class EspRecord
 
 		Sub.OccurrenceIndex = CurrentOccurrence;
 		Sub.GlobalIndex = static_cast<int>(SubRecords.size());
+		Sub.SourceIndex = SubRecordsSeen++;
+
+		const uint16_t Size16 = static_cast<uint16_t>(Size);
+		PayloadHash = Fnv1a(PayloadHash, Str, 4);
+		PayloadHash = Fnv1a(PayloadHash, &Size16, sizeof(Size16));
+		if (DataPtr)
+		{
+			PayloadHash = Fnv1a(PayloadHash, DataPtr, Size);
+		}
+
+		if (Sub.Sig == "EDID" && DataPtr && Size > 0)
+		{
+			const char* Text = reinterpret_cast<const char*>(DataPtr);
+			EditorID.assign(Text, std::find(Text, Text + Size, '\0'));
+		}
 
 		//===== PERK Special Handling: Recording EPFT Value =====
 		if (Sig == "PERK" && Sub.Sig == "EPFT" && DataPtr && Size >= 1)
@@ -559,13 +666,15 @@ class EspRecord
 		{
 			Sub.Data.assign(DataPtr, DataPtr + Size);
 		
-			bool IsLocalizedField = Size == 4 && IsProbablyStringID(DataPtr,4);
+			bool IsLocalizedField = InLocalizedPlugin && Size == 4 && IsProbablyStringID(DataPtr,4);
 
 			if (IsLocalizedField)
 			{
 				uint32_t stringID = 0;
 				std::memcpy(&stringID, DataPtr, sizeof(uint32_t));
 				Sub.StringID = stringID;
+				Sub.SourceStringID = stringID;
+				Sub.StringsType = StringsFileTypeFor(Sig, Sub.Sig);
 
 				Sub.IsLocalized = true;
 			}
@@ -588,8 +697,9 @@ class EspRecord
 				}
 			}
 
-			if (CanTranslateSub(*this, Sub))
+			if (Sub.IsLocalized || CanTranslateSub(*this, Sub))
 			{
+				Sub.ContentHash = Fnv1a(FNV1A_BASIS, Sub.Data.data(), Sub.Data.size());
 				SubRecords.push_back(Sub);
 			}
 		}
@@ -635,6 +745,9 @@ class EspRecord
 
 	std::string GetEditorID() const
 	{
+		if (!EditorID.empty())
+			return EditorID;
+
 		for (size_t i = 0; i < SubRecords.size(); ++i)
 		{
 			if (SubRecords[i].Sig == "EDID" && !SubRecords[i].IsLocalized)
@@ -646,22 +759,159 @@ class EspRecord
 	}
 };
 
+// Where a record handle points: Records or CellRecords, and the index there.
+struct RecordLocation
+{
+	bool IsCell;
+	uint32_t Index;
+};
+
+struct SubRecordLocation
+{
+	EspHandle Record;
+	uint32_t SubIndex;
+};
+
+// A top-level entry (GRUP or the TES4 record) of the file a document was read from.
+struct SourceGroup
+{
+	std::string Label;
+	uint64_t Offset;
+	uint64_t Size;
+	uint64_t Hash;
+	size_t GrupCount; // GRUPs inside, itself included
+};
+
+// Records of a document, kept in chunks of shared records so that a snapshot
+// takes all of them by copying the chunk list (see EspSnapshot). Reading never
+// copies anything. Edit first copies the chunk and the record when a snapshot
+// still holds them, so a pinned version never sees a record change.
+class RecordStore
+{
+public:
+	typedef std::vector<std::shared_ptr<EspRecord> > Chunk;
+	typedef std::vector<std::shared_ptr<Chunk> > ChunkList;
+
+	enum { ChunkSize = 256 };
+
+	class const_iterator
+	{
+	public:
+		const_iterator(const RecordStore* Store, size_t Index) : Store_(Store), Index_(Index) {}
+
+		const EspRecord& operator*() const { return (*Store_)[Index_]; }
+		const EspRecord* operator->() const { return &(*Store_)[Index_]; }
+		const_iterator& operator++() { ++Index_; return *this; }
+		bool operator==(const const_iterator& Other) const { return Index_ == Other.Index_; }
+		bool operator!=(const const_iterator& Other) const { return Index_ != Other.Index_; }
+
+	private:
+		const RecordStore* Store_;
+		size_t Index_;
+	};
+
+	RecordStore() : Size_(0) {}
+
+	size_t size() const { return Size_; }
+	bool empty() const { return Size_ == 0; }
+
+	const EspRecord& operator[](size_t Index) const
+	{
+		return *(*Chunks_[Index / ChunkSize])[Index % ChunkSize];
+	}
+
+	const EspRecord& back() const { return (*this)[Size_ - 1]; }
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, Size_); }
+
+	void push_back(const EspRecord& Rec)
+	{
+		if (Size_ % ChunkSize == 0)
+		{
+			Chunks_.push_back(std::make_shared<Chunk>());
+			Chunks_.back()->reserve(ChunkSize);
+		}
+		else
+		{
+			Unshare(Chunks_.back());
+		}
+		Chunks_.back()->push_back(std::make_shared<EspRecord>(Rec));
+		++Size_;
+	}
+
+	// The record at Index, for writing. Only the writer calls this, under its
+	// context's Lock, so a count of one cannot grow while it looks.
+	EspRecord& Edit(size_t Index)
+	{
+		std::shared_ptr<Chunk>& C = Chunks_[Index / ChunkSize];
+		Unshare(C);
+		std::shared_ptr<EspRecord>& Rec = (*C)[Index % ChunkSize];
+		Unshare(Rec);
+		return *Rec;
+	}
+
+	void clear()
+	{
+		Chunks_.clear();
+		Size_ = 0;
+	}
+
+private:
+	ChunkList Chunks_;
+	size_t Size_;
+
+	template<typename T>
+	static void Unshare(std::shared_ptr<T>& Ptr)
+	{
+		if (Ptr.use_count() > 1)
+		{
+			Ptr = std::make_shared<T>(*Ptr);
+		}
+		else
+		{
+			// Pairs with the release of the last snapshot that dropped it.
+			std::atomic_thread_fence(std::memory_order_acquire);
+		}
+	}
+};
+
 class EspData
 {
 	public:
-	std::vector<EspRecord> Records;
+	RecordStore Records;
 	std::unordered_map<std::string, size_t> RecordIndex;
 	std::unordered_set<uint32_t> FormIDs;
 
 	// CELL storage
-	std::vector<EspRecord> CellRecords;
+	RecordStore CellRecords;
 	std::unordered_map<uint32_t, size_t> CellByFormID;
 	std::unordered_map<std::string, size_t> CellByEditorID;
 
 	size_t GrupCount;
 	bool HasTES4Header;
+	bool IsLocalizedPlugin;
+	// TES4 MAST entries in order: a FormID whose top byte is i < Masters.size()
+	// belongs to Masters[i], any other to this plugin.
+	std::vector<std::string> Masters;
+
+	// Strings used to resolve localized subrecords of this document.
+	const StringsManager* Strings;
+
+	// Generation-checked handles that stay valid while the vectors grow.
+	SlotMap<RecordLocation> RecordHandles;
+	SlotMap<SubRecordLocation> SubRecordHandles;
+
+	// Every parsed record that has an EDID, CELLs and records the filter drops
+	// included. Entries of stored records get their handle in Finalize.
+	EditorIDIndex EditorIDs;
 
-	EspData() : GrupCount(0), HasTES4Header(false) {}
+	// Top-level entries of the source file in order, and the revision of the
+	// filter it was read with. Empty when the document was not read from a file.
+	std::vector<SourceGroup> SourceGroups;
+	uint64_t SourceFilterRevision;
+
+	EspData() : GrupCount(0), HasTES4Header(false), IsLocalizedPlugin(false), Strings(NULL), SourceFilterRevision(0) {}
 
 	std::vector<EspRecord> SearchBySig(const std::string& ParentSig, const std::string& ChildSig = "") const
 	{
@@ -778,7 +1028,7 @@ class EspData
 
 		for (const auto& Rec : Records) {
 			for (const auto& Sub : Rec.SubRecords) {
-				std::string Text = Sub.GetString();
+				std::string Text = Sub.GetString(Strings);
 				if (!Text.empty() && MatchesQuery(Text)) {
 					Matches.push_back(Rec);
 					break;
@@ -788,7 +1038,7 @@ class EspData
 
 		for (const auto& Rec : CellRecords) {
 			for (const auto& Sub : Rec.SubRecords) {
-				std::string Text = Sub.GetString();
+				std::string Text = Sub.GetString(Strings);
 				if (!Text.empty() && MatchesQuery(Text)) {
 					Matches.push_back(Rec);
 					break;
@@ -806,7 +1056,7 @@ class EspData
 		{
 			for (const auto& Sub : Rec.SubRecords)
 			{
-				std::string Text = Sub.GetString();
+				std::string Text = Sub.GetString(Strings);
 				if (!Text.empty() && HasVisibleText(Text))
 				{
 					Count++;
@@ -823,7 +1073,7 @@ class EspData
 		{
 			for (const auto& Sub : Rec.SubRecords)
 			{
-				std::string Text = Sub.GetString();
+				std::string Text = Sub.GetString(Strings);
 				if (!Text.empty() && HasVisibleText(Text))
 				{
 					Count++;
@@ -833,7 +1083,7 @@ class EspData
 		return Count;
 	}
 
-	void AddRecord(EspRecord& Rec, RecordFilter& Filter)
+	void AddRecord(EspRecord& Rec, const RecordFilter& Filter)
 	{
 		const size_t Index = Records.size();
 		const std::string UniqueKey = Rec.GetUniqueKey();
@@ -864,6 +1114,7 @@ class EspData
 		{
 			const size_t CellIndex = CellRecords.size();
 			CellRecords.push_back(Rec);
+			AssignHandles(CellRecords.Edit(CellIndex), true, CellIndex);
 			CellByFormID[Rec.FormID] = CellIndex;
 
 			std::string EditorID = Rec.GetEditorID();
@@ -877,10 +1128,184 @@ class EspData
 			if (Filter.ShouldParseRecordWithSub(Rec.Sig, ""))
 			{
 				Records.push_back(Rec);
+				AssignHandles(Records.Edit(Records.size() - 1), false, Records.size() - 1);
 			}
 		}
 	}
 
+	// Stores a record carried over from an earlier read of the same file. Its
+	// handles, already in RecordHandles, are pointed at the new position.
+	void KeepRecord(const EspRecord& Rec)
+	{
+		RecordIndex.insert(std::make_pair(Rec.GetUniqueKey(), Records.size()));
+		FormIDs.insert(Rec.FormID);
+
+		if (Rec.Sig == "TES4")
+		{
+			HasTES4Header = true;
+		}
+
+		RecordLocation* Loc = RecordHandles.Get(Rec.Handle);
+
+		if (Rec.IsCell())
+		{
+			const size_t CellIndex = CellRecords.size();
+			CellByFormID[Rec.FormID] = CellIndex;
+
+			std::string EditorID = Rec.GetEditorID();
+			if (!EditorID.empty())
+			{
+				CellByEditorID[EditorID] = CellIndex;
+			}
+
+			if (Loc)
+			{
+				Loc->IsCell = true;
+				Loc->Index = static_cast<uint32_t>(CellIndex);
+			}
+			CellRecords.push_back(Rec);
+		}
+		else
+		{
+			if (Loc)
+			{
+				Loc->IsCell = false;
+				Loc->Index = static_cast<uint32_t>(Records.size());
+			}
+			Records.push_back(Rec);
+		}
+	}
+
+	// Called for every parsed record before the filter decides whether it is
+	// stored, so EditorIDs of dropped records can still be looked up.
+	void IndexEditorID(const EspRecord& Rec)
+	{
+		EditorIDs.Add(Rec.EditorID, Rec.FormID, Rec.Sig, Rec.SourceOffset);
+	}
+
+	// Invalidates the handles of a record that is being dropped.
+	void ReleaseHandles(const EspRecord& Rec)
+	{
+		for (size_t i = 0; i < Rec.SubRecords.size(); ++i)
+		{
+			SubRecordHandles.Remove(Rec.SubRecords[i].Handle);
+		}
+		RecordHandles.Remove(Rec.Handle);
+	}
+
+	void AssignHandles(EspRecord& Rec, bool IsCell, size_t Index)
+	{
+		RecordLocation Loc;
+		Loc.IsCell = IsCell;
+		Loc.Index = static_cast<uint32_t>(Index);
+		Rec.Handle = RecordHandles.Insert(Loc);
+
+		for (size_t i = 0; i < Rec.SubRecords.size(); ++i)
+		{
+			SubRecordLocation SubLoc;
+			SubLoc.Record = Rec.Handle;
+			SubLoc.SubIndex = static_cast<uint32_t>(i);
+			Rec.SubRecords[i].Handle = SubRecordHandles.Insert(SubLoc);
+		}
+	}
+
+	// O(1); returns NULL once the handle is stale. The non-const versions
+	// are for writing and go through RecordStore::Edit.
+	EspRecord* ResolveRecord(EspHandle Handle)
+	{
+		const RecordLocation* Loc = RecordHandles.Get(Handle);
+		if (!Loc)
+			return NULL;
+
+		RecordStore& Store = Loc->IsCell ? CellRecords : Records;
+		if (Loc->Index >= Store.size())
+			return NULL;
+
+		return &Store.Edit(Loc->Index);
+	}
+
+	const EspRecord* ResolveRecord(EspHandle Handle) const
+	{
+		const RecordLocation* Loc = RecordHandles.Get(Handle);
+		if (!Loc)
+			return NULL;
+
+		const RecordStore& Store = Loc->IsCell ? CellRecords : Records;
+		if (Loc->Index >= Store.size())
+			return NULL;
+
+		return &Store[Loc->Index];
+	}
+
+	SubRecordData* ResolveSubRecord(EspHandle Handle)
+	{
+		const SubRecordLocation* Loc = SubRecordHandles.Get(Handle);
+		if (!Loc)
+			return NULL;
+
+		EspRecord* Rec = ResolveRecord(Loc->Record);
+		if (!Rec || Loc->SubIndex >= Rec->SubRecords.size())
+			return NULL;
+
+		return &Rec->SubRecords[Loc->SubIndex];
+	}
+
+	const SubRecordData* ResolveSubRecord(EspHandle Handle) const
+	{
+		const SubRecordLocation* Loc = SubRecordHandles.Get(Handle);
+		if (!Loc)
+			return NULL;
+
+		const EspRecord* Rec = ResolveRecord(Loc->Record);
+		if (!Rec || Loc->SubIndex >= Rec->SubRecords.size())
+			return NULL;
+
+		return &Rec->SubRecords[Loc->SubIndex];
+	}
+
+	// Handles of the subrecords whose ContentHash is Hash: the same text or
+	// StringID stored more than once.
+	std::vector<EspHandle> FindByContentHash(uint64_t Hash) const
+	{
+		std::vector<EspHandle> Matches;
+		for (const RecordStore* Vec : { &Records, &CellRecords })
+		{
+			for (const auto& Rec : *Vec)
+			{
+				for (const auto& Sub : Rec.SubRecords)
+				{
+					if (Sub.ContentHash == Hash)
+						Matches.push_back(Sub.Handle);
+				}
+			}
+		}
+		return Matches;
+	}
+
+	// Handles of the records whose PayloadHash is Hash.
+	std::vector<EspHandle> FindByPayloadHash(uint64_t Hash) const
+	{
+		std::vector<EspHandle> Matches;
+		for (const RecordStore* Vec : { &Records, &CellRecords })
+		{
+			for (const auto& Rec : *Vec)
+			{
+				if (Rec.PayloadHash == Hash)
+					Matches.push_back(Rec.Handle);
+			}
+		}
+		return Matches;
+	}
+
+	EspHandle GetRecordHandle(bool IsCell, size_t Index) const
+	{
+		const RecordStore& Vec = IsCell ? CellRecords : Records;
+		if (Index >= Vec.size())
+			return INVALID_ESP_HANDLE;
+
+		return Vec[Index].Handle;
+	}
+
 	void IncrementGrupCount()
 	{
 		GrupCount++;
@@ -898,6 +1323,82 @@ class EspData
 		return NULL;
 	}
 
+	// Called once parsing is done; sorts the lookup indexes and points the
+	// EditorID entries of stored records at their handles.
+	void Finalize()
+	{
+		std::unordered_map<uint32_t, const EspRecord*> Stored;
+		for (const RecordStore* Vec : { &Records, &CellRecords })
+		{
+			for (const auto& Rec : *Vec)
+			{
+				Stored.insert(std::make_pair(Rec.FormID, &Rec));
+			}
+		}
+
+		EditorIDs.Build([&Stored](const EditorIDIndex::Entry& E)
+			{
+				std::unordered_map<uint32_t, const EspRecord*>::const_iterator It = Stored.find(E.FormID);
+				return It != Stored.end() && It->second->Sig == E.Sig ? It->second->Handle : INVALID_ESP_HANDLE;
+			});
+	}
+
+	// NULL when no record has the EditorID or the document does not store it.
+	const EspRecord* FindByEditorID(const std::string& EditorID) const
+	{
+		const EditorIDIndex::Entry* Match = EditorIDs.FindExact(EditorID);
+		return Match ? ResolveRecord(Match->Handle) : NULL;
+	}
+
+	// Handles of the stored matches; use EditorIDs for all of them.
+	std::vector<EspHandle> SearchEditorIDPrefix(const std::string& Prefix) const
+	{
+		std::vector<const EditorIDIndex::Entry*> Matches;
+		EditorIDs.FindPrefix(Prefix, Matches);
+		return StoredHandles(Matches);
+	}
+
+	std::vector<EspHandle> SearchEditorIDGlob(const std::string& Pattern) const
+	{
+		std::vector<const EditorIDIndex::Entry*> Matches;
+		EditorIDs.FindGlob(Pattern, Matches);
+		return StoredHandles(Matches);
+	}
+
+	static std::vector<EspHandle> StoredHandles(const std::vector<const EditorIDIndex::Entry*>& Matches)
+	{
+		std::vector<EspHandle> Handles;
+		for (size_t i = 0; i < Matches.size(); ++i)
+		{
+			if (Matches[i]->Handle != INVALID_ESP_HANDLE)
+			{
+				Handles.push_back(Matches[i]->Handle);
+			}
+		}
+		return Handles;
+	}
+
+	// Edited records in source file order.
+	std::vector<const EspRecord*> GetDirtyRecords() const
+	{
+		std::vector<const EspRecord*> Dirty;
+
+		for (const auto& Rec : Records)
+		{
+			if (Rec.Dirty) Dirty.push_back(&Rec);
+		}
+
+		for (const auto& Rec : CellRecords)
+		{
+			if (Rec.Dirty) Dirty.push_back(&Rec);
+		}
+
+		std::sort(Dirty.begin(), Dirty.end(),
+			[](const EspRecord* A, const EspRecord* B) { return A->SourceOffset < B->SourceOffset; });
+
+		return Dirty;
+	}
+
 	const EspRecord* FindCellByFormID(uint32_t FormID) const
 	{
 		std::unordered_map<uint32_t, size_t>::const_iterator It = CellByFormID.find(FormID);
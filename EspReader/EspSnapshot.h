@@ -0,0 +1,123 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "EspRecord.h"
+#include "EspQuery.h"
+
+// Immutable version of a document's records and the strings they resolve to.
+// Readers pin a version through a shared_ptr and never see it change. Build
+// shares the document's record chunks rather than copying records; the writer
+// copies a chunk and record only when it edits one a version still holds
+// (RecordStore::Edit). Strings is a copy of the writer's strings when the
+// version was built, so loading other strings afterwards does not reach pinned
+// versions.
+class EspSnapshot
+{
+public:
+	uint64_t Version;
+	std::shared_ptr<const StringsManager> Strings;
+
+	EspSnapshot() : Version(0) {}
+
+	static std::shared_ptr<const EspSnapshot> Build(const EspData& Doc, const std::shared_ptr<const StringsManager>& Strings, uint64_t Version)
+	{
+		std::shared_ptr<EspSnapshot> Snap = std::make_shared<EspSnapshot>();
+		Snap->Version = Version;
+		Snap->Strings = Strings;
+		Snap->Records_ = Doc.Records;
+		Snap->Cells_ = Doc.CellRecords;
+		return Snap;
+	}
+
+	size_t Size(bool IsCell) const
+	{
+		return IsCell ? Cells_.size() : Records_.size();
+	}
+
+	const EspRecord* Get(bool IsCell, size_t Index) const
+	{
+		if (Index >= Size(IsCell))
+			return NULL;
+
+		return IsCell ? &Cells_[Index] : &Records_[Index];
+	}
+
+	// Records first, then CELLs, like EspData's search methods.
+	template<typename Fn>
+	void ForEach(Fn Visit) const
+	{
+		for (const auto& Rec : Records_)
+			Visit(Rec);
+
+		for (const auto& Rec : Cells_)
+			Visit(Rec);
+	}
+
+	std::vector<const EspRecord*> SearchBySig(const std::string& ParentSig, const std::string& ChildSig = "") const
+	{
+		std::vector<const EspRecord*> Matches;
+
+		ForEach([&](const EspRecord& Rec)
+			{
+				if (ParentSig != "ALL" && Rec.Sig != ParentSig)
+					return;
+
+				if (ChildSig.empty() || ChildSig == "ALL")
+				{
+					Matches.push_back(&Rec);
+					return;
+				}
+
+				for (const auto& Sub : Rec.SubRecords)
+				{
+					if (Sub.Sig == ChildSig)
+					{
+						Matches.push_back(&Rec);
+						return;
+					}
+				}
+			});
+
+		return Matches;
+	}
+
+	std::vector<const EspRecord*> SearchRecords(const std::string& Query, bool ExactMatch = false) const
+	{
+		std::vector<const EspRecord*> Matches;
+
+		std::string LowerQuery = Query;
+		std::transform(LowerQuery.begin(), LowerQuery.end(), LowerQuery.begin(), ::tolower);
+
+		ForEach([&](const EspRecord& Rec)
+			{
+				for (const auto& Sub : Rec.SubRecords)
+				{
+					std::string Text = Sub.GetString(Strings.get());
+					if (Text.empty())
+						continue;
+
+					bool Hit = ExactMatch ? (Text == Query) : QueryNode::ContainsNoCase(Text, LowerQuery);
+					if (Hit)
+					{
+						Matches.push_back(&Rec);
+						return;
+					}
+				}
+			});
+
+		return Matches;
+	}
+
+private:
+	// Copies of the document's stores; they share its chunks.
+	RecordStore Records_;
+	RecordStore Cells_;
+};
+
+// What the C API hands out for a pinned snapshot.
+struct EspSnapshotPin
+{
+	std::shared_ptr<const EspSnapshot> Snapshot;
+};
@@ -0,0 +1,307 @@
+#pragma once
+#include <fstream>
+#include <streambuf>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+
+// Forward-only output through a large user-space buffer.
+// It never seeks, so the same writer can target a file, a pipe or memory.
+class EspSink
+{
+public:
+	explicit EspSink(size_t BufferSize) : Written_(0), Failed_(false)
+	{
+		Buffer_.reserve(BufferSize);
+	}
+
+	virtual ~EspSink() {}
+
+	bool Write(const void* Data, size_t Size)
+	{
+		if (Failed_)
+			return false;
+
+		const char* Bytes = static_cast<const char*>(Data);
+		Written_ += Size;
+
+		if (Buffer_.size() + Size > Buffer_.capacity())
+		{
+			if (!Flush())
+				return false;
+
+			// Too big to be worth buffering.
+			if (Size >= Buffer_.capacity())
+			{
+				Failed_ = !Commit(Bytes, Size);
+				return !Failed_;
+			}
+		}
+
+		Buffer_.insert(Buffer_.end(), Bytes, Bytes + Size);
+		return true;
+	}
+
+	bool Flush()
+	{
+		if (!Failed_ && !Buffer_.empty())
+		{
+			Failed_ = !Commit(Buffer_.data(), Buffer_.size());
+			Buffer_.clear();
+		}
+		return !Failed_;
+	}
+
+	uint64_t BytesWritten() const
+	{
+		return Written_;
+	}
+
+protected:
+	virtual bool Commit(const char* Data, size_t Size) = 0;
+
+private:
+	std::vector<char> Buffer_;
+	uint64_t Written_;
+	bool Failed_;
+
+	EspSink(const EspSink&);
+	EspSink& operator=(const EspSink&);
+};
+
+class FileSink : public EspSink
+{
+public:
+	explicit FileSink(const char* Path, size_t BufferSize = 4 << 20)
+		: EspSink(BufferSize), File_(Path, std::ios::binary)
+	{
+	}
+
+	~FileSink()
+	{
+		Flush();
+	}
+
+	bool IsOpen() const
+	{
+		return File_.is_open();
+	}
+
+protected:
+	bool Commit(const char* Data, size_t Size)
+	{
+		File_.write(Data, Size);
+		return File_.good();
+	}
+
+private:
+	std::ofstream File_;
+};
+
+// Appends to a caller-owned vector; no intermediate buffer.
+class MemorySink : public EspSink
+{
+public:
+	explicit MemorySink(std::vector<uint8_t>& Out) : EspSink(0), Out_(Out) {}
+
+protected:
+	bool Commit(const char* Data, size_t Size)
+	{
+		Out_.insert(Out_.end(), Data, Data + Size);
+		return true;
+	}
+
+private:
+	std::vector<uint8_t>& Out_;
+};
+
+// Random-access input with an explicitly tracked position.
+class EspSource
+{
+public:
+	virtual ~EspSource() {}
+
+	virtual bool Read(void* Data, size_t Size) = 0;
+	virtual bool Seek(uint64_t Offset) = 0;
+	virtual uint64_t Position() const = 0;
+	virtual uint64_t Size() const = 0;
+
+	// Independent cursor over the same bytes, for use on another thread.
+	virtual std::unique_ptr<EspSource> Reopen() const = 0;
+
+	bool Skip(uint64_t Bytes)
+	{
+		return Seek(Position() + Bytes);
+	}
+
+	// Copies the next Bytes bytes to Out, using Scratch as the transfer buffer.
+	virtual bool CopyTo(EspSink& Out, uint64_t Bytes, std::vector<char>& Scratch)
+	{
+		while (Bytes > 0)
+		{
+			size_t Chunk = Scratch.size();
+			if (Bytes < Chunk) Chunk = static_cast<size_t>(Bytes);
+
+			if (!Read(Scratch.data(), Chunk) || !Out.Write(Scratch.data(), Chunk))
+				return false;
+
+			Bytes -= Chunk;
+		}
+		return true;
+	}
+};
+
+class FileSource : public EspSource
+{
+public:
+	explicit FileSource(const std::wstring& Path)
+		: Path_(Path), File_(Path, std::ios::binary), Position_(0), Size_(0)
+	{
+		if (File_.is_open())
+		{
+			File_.seekg(0, std::ios::end);
+			Size_ = static_cast<uint64_t>(File_.tellg());
+			File_.seekg(0, std::ios::beg);
+		}
+	}
+
+	bool IsOpen() const
+	{
+		return File_.is_open();
+	}
+
+	bool Read(void* Data, size_t Size)
+	{
+		if (!File_.read(static_cast<char*>(Data), Size))
+			return false;
+
+		Position_ += Size;
+		return true;
+	}
+
+	bool Seek(uint64_t Offset)
+	{
+		if (Offset > Size_)
+			return false;
+
+		File_.clear();
+		File_.seekg(static_cast<std::streamoff>(Offset));
+		Position_ = Offset;
+		return File_.good();
+	}
+
+	uint64_t Position() const
+	{
+		return Position_;
+	}
+
+	uint64_t Size() const
+	{
+		return Size_;
+	}
+
+	std::unique_ptr<EspSource> Reopen() const
+	{
+		return std::unique_ptr<EspSource>(new FileSource(Path_));
+	}
+
+private:
+	std::wstring Path_;
+	std::ifstream File_;
+	uint64_t Position_;
+	uint64_t Size_;
+};
+
+// Source over bytes already in memory. Reopened cursors share the bytes.
+class MemorySource : public EspSource
+{
+public:
+	explicit MemorySource(const std::shared_ptr<const std::vector<uint8_t> >& Bytes)
+		: Bytes_(Bytes), Position_(0)
+	{
+	}
+
+	bool Read(void* Data, size_t Size)
+	{
+		if (Size > Bytes_->size() - Position_)
+			return false;
+
+		if (Size > 0)
+		{
+			std::memcpy(Data, Bytes_->data() + Position_, Size);
+		}
+		Position_ += Size;
+		return true;
+	}
+
+	bool Seek(uint64_t Offset)
+	{
+		if (Offset > Bytes_->size())
+			return false;
+
+		Position_ = static_cast<size_t>(Offset);
+		return true;
+	}
+
+	uint64_t Position() const
+	{
+		return Position_;
+	}
+
+	uint64_t Size() const
+	{
+		return Bytes_->size();
+	}
+
+	std::unique_ptr<EspSource> Reopen() const
+	{
+		return std::unique_ptr<EspSource>(new MemorySource(Bytes_));
+	}
+
+	// The bytes are already addressable, so they go straight to Out.
+	bool CopyTo(EspSink& Out, uint64_t Bytes, std::vector<char>&)
+	{
+		if (Bytes > Bytes_->size() - Position_)
+			return false;
+
+		if (Bytes > 0 && !Out.Write(Bytes_->data() + Position_, static_cast<size_t>(Bytes)))
+			return false;
+
+		Position_ += static_cast<size_t>(Bytes);
+		return true;
+	}
+
+private:
+	std::shared_ptr<const std::vector<uint8_t> > Bytes_;
+	size_t Position_;
+};
+
+// Read-only, seekable streambuf over a byte range, so the std::istream
+// based parser can read a plugin that is already in memory.
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+	MemoryStreamBuf(const uint8_t* Data, size_t Size)
+	{
+		char* Begin = const_cast<char*>(reinterpret_cast<const char*>(Data));
+		setg(Begin, Begin, Begin + Size);
+	}
+
+protected:
+	pos_type seekoff(off_type Offset, std::ios_base::seekdir Dir, std::ios_base::openmode)
+	{
+		char* Base = Dir == std::ios_base::beg ? eback() : (Dir == std::ios_base::cur ? gptr() : egptr());
+		if (Offset < eback() - Base || Offset > egptr() - Base)
+			return pos_type(off_type(-1));
+
+		setg(eback(), Base + Offset, egptr());
+		return pos_type(gptr() - eback());
+	}
+
+	pos_type seekpos(pos_type Position, std::ios_base::openmode Which)
+	{
+		return seekoff(off_type(Position), std::ios_base::beg, Which);
+	}
+};
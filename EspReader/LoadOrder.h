@@ -0,0 +1,204 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cctype>
+#include "EspContext.h"
+
+// Several plugins read as one load order. Each plugin keeps its own context,
+// so adding a patch parses only the patch and reuses the masters already read.
+//
+// A record's identity is (defining plugin, local ID): the top byte of its
+// FormID picks an entry of the plugin's MAST list, or the plugin itself when
+// it is past the end. The override index maps each identity to the last plugin
+// in load order that has the record, which is the version the game uses.
+// Only records the contexts' filter keeps take part.
+class EspLoadOrder
+{
+public:
+	struct Plugin
+	{
+		std::wstring Path;
+		std::string Name; // file name, lower case
+		std::unique_ptr<EspContext> Context;
+		uint32_t NameID;
+		std::vector<uint32_t> MasterIDs; // NameID of each MAST entry
+	};
+
+	struct Winner
+	{
+		uint32_t Plugin; // load order index
+		EspHandle Record;
+		uint32_t OverrideCount; // plugins that have the record, its own included
+	};
+
+	// Calls that change the load order or read the index hold Lock.
+	std::mutex Lock;
+
+	EspLoadOrder() : IndexedCount_(0) {}
+
+	size_t GetPluginCount() const
+	{
+		return Plugins_.size();
+	}
+
+	Plugin& GetPlugin(size_t Index)
+	{
+		return *Plugins_[Index];
+	}
+
+	const Plugin& GetPlugin(size_t Index) const
+	{
+		return *Plugins_[Index];
+	}
+
+	// Load order index of the plugin with this file name (any case), or -1.
+	int FindPlugin(const std::string& Name) const
+	{
+		std::string Key = NormalizeName(Name);
+		for (size_t i = 0; i < Plugins_.size(); ++i)
+		{
+			if (Plugins_[i]->Name == Key)
+				return static_cast<int>(i);
+		}
+		return -1;
+	}
+
+	// Adds an already read plugin at the end of the load order.
+	// Call UpdateIndex once a batch has been appended.
+	void Append(const std::wstring& Path, const std::string& Name, std::unique_ptr<EspContext> Context)
+	{
+		std::unique_ptr<Plugin> P(new Plugin());
+		P->Path = Path;
+		P->Name = NormalizeName(Name);
+		P->Context = std::move(Context);
+		P->NameID = InternName(P->Name);
+
+		if (P->Context->Data)
+		{
+			const std::vector<std::string>& Masters = P->Context->Data->Masters;
+			for (size_t i = 0; i < Masters.size(); ++i)
+			{
+				P->MasterIDs.push_back(InternName(NormalizeName(Masters[i])));
+			}
+		}
+
+		Plugins_.push_back(std::move(P));
+	}
+
+	// Folds the plugins appended since the last call into the override index.
+	// Plugins already indexed are not visited again.
+	void UpdateIndex()
+	{
+		for (; IndexedCount_ < Plugins_.size(); ++IndexedCount_)
+		{
+			const Plugin& P = *Plugins_[IndexedCount_];
+			if (!P.Context->Data)
+				continue;
+
+			const uint32_t PluginIndex = static_cast<uint32_t>(IndexedCount_);
+			for (const RecordStore* Vec : { &P.Context->Data->Records, &P.Context->Data->CellRecords })
+			{
+				for (const auto& Rec : *Vec)
+				{
+					if (Rec.Sig == "TES4")
+						continue;
+
+					Winner& W = Winners_[GlobalID(P, Rec.FormID)];
+					W.Plugin = PluginIndex;
+					W.Record = Rec.Handle;
+					W.OverrideCount++;
+				}
+			}
+		}
+	}
+
+	// Load order independent identity: defining plugin name ID and local ID.
+	uint64_t GlobalID(const Plugin& P, uint32_t FormID) const
+	{
+		const uint32_t MasterIndex = FormID >> 24;
+		const uint32_t Owner = MasterIndex < P.MasterIDs.size() ? P.MasterIDs[MasterIndex] : P.NameID;
+		return (static_cast<uint64_t>(Owner) << 24) | (FormID & 0x00FFFFFF);
+	}
+
+	// The winning version of FormID as numbered in the plugin at PluginIndex.
+	const Winner* FindWinner(size_t PluginIndex, uint32_t FormID) const
+	{
+		if (PluginIndex >= Plugins_.size())
+			return NULL;
+
+		std::unordered_map<uint64_t, Winner>::const_iterator It = Winners_.find(GlobalID(*Plugins_[PluginIndex], FormID));
+		return It != Winners_.end() ? &It->second : NULL;
+	}
+
+	const EspRecord* ResolveWinner(const Winner& W) const
+	{
+		const EspData* Data = Plugins_[W.Plugin]->Context->Data;
+		return Data ? Data->ResolveRecord(W.Record) : NULL;
+	}
+
+	// Calls Fn(PluginIndex, Record) for the winning version of every record, in
+	// load order of the winners.
+	template <typename Func>
+	void ForEachWinner(Func Fn) const
+	{
+		for (size_t i = 0; i < IndexedCount_; ++i)
+		{
+			const Plugin& P = *Plugins_[i];
+			if (!P.Context->Data)
+				continue;
+
+			for (const RecordStore* Vec : { &P.Context->Data->Records, &P.Context->Data->CellRecords })
+			{
+				for (const auto& Rec : *Vec)
+				{
+					std::unordered_map<uint64_t, Winner>::const_iterator It = Winners_.find(GlobalID(P, Rec.FormID));
+					if (It != Winners_.end() && It->second.Plugin == i && It->second.Record == Rec.Handle)
+					{
+						Fn(i, Rec);
+					}
+				}
+			}
+		}
+	}
+
+	size_t GetRecordCount() const
+	{
+		return Winners_.size();
+	}
+
+private:
+	std::vector<std::unique_ptr<Plugin> > Plugins_;
+	size_t IndexedCount_;
+	std::unordered_map<uint64_t, Winner> Winners_;
+	// Every plugin name seen, loaded or only named as a master
+	std::unordered_map<std::string, uint32_t> NameIDs_;
+
+	EspLoadOrder(const EspLoadOrder&);
+	EspLoadOrder& operator=(const EspLoadOrder&);
+
+	uint32_t InternName(const std::string& Name)
+	{
+		std::unordered_map<std::string, uint32_t>::const_iterator It = NameIDs_.find(Name);
+		if (It != NameIDs_.end())
+			return It->second;
+
+		uint32_t ID = static_cast<uint32_t>(NameIDs_.size());
+		NameIDs_[Name] = ID;
+		return ID;
+	}
+
+	static std::string NormalizeName(const std::string& Name)
+	{
+		size_t Slash = Name.find_last_of("\\/");
+		std::string Key = Slash == std::string::npos ? Name : Name.substr(Slash + 1);
+		for (size_t i = 0; i < Key.size(); ++i)
+		{
+			Key[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(Key[i])));
+		}
+		return Key;
+	}
+};
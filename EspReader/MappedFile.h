@@ -0,0 +1,121 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. Pages are read by the OS when touched.
+class MappedFile
+{
+public:
+	MappedFile() : Data_(NULL), Size_(0)
+#ifdef _WIN32
+		, File_(INVALID_HANDLE_VALUE), Mapping_(NULL)
+#endif
+	{
+	}
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	bool Open(const std::string& Path)
+	{
+		Close();
+
+#ifdef _WIN32
+		// FILE_SHARE_DELETE lets a save rename the file aside while it is mapped.
+		File_ = CreateFileA(Path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (File_ == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER Size;
+		if (!GetFileSizeEx(File_, &Size) || Size.QuadPart == 0)
+		{
+			Close();
+			return false;
+		}
+
+		Mapping_ = CreateFileMappingA(File_, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!Mapping_)
+		{
+			Close();
+			return false;
+		}
+
+		Data_ = static_cast<const uint8_t*>(MapViewOfFile(Mapping_, FILE_MAP_READ, 0, 0, 0));
+		Size_ = static_cast<size_t>(Size.QuadPart);
+#else
+		int Fd = open(Path.c_str(), O_RDONLY);
+		if (Fd < 0)
+			return false;
+
+		struct stat Info;
+		if (fstat(Fd, &Info) != 0 || Info.st_size == 0)
+		{
+			close(Fd);
+			return false;
+		}
+
+		void* View = mmap(NULL, static_cast<size_t>(Info.st_size), PROT_READ, MAP_PRIVATE, Fd, 0);
+		close(Fd);
+
+		if (View != MAP_FAILED)
+		{
+			Data_ = static_cast<const uint8_t*>(View);
+			Size_ = static_cast<size_t>(Info.st_size);
+		}
+#endif
+		if (!Data_)
+		{
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef _WIN32
+		if (Data_) UnmapViewOfFile(Data_);
+		if (Mapping_) CloseHandle(Mapping_);
+		if (File_ != INVALID_HANDLE_VALUE) CloseHandle(File_);
+		Mapping_ = NULL;
+		File_ = INVALID_HANDLE_VALUE;
+#else
+		if (Data_) munmap(const_cast<uint8_t*>(Data_), Size_);
+#endif
+		Data_ = NULL;
+		Size_ = 0;
+	}
+
+	const uint8_t* Data() const
+	{
+		return Data_;
+	}
+
+	size_t Size() const
+	{
+		return Size_;
+	}
+
+private:
+	const uint8_t* Data_;
+	size_t Size_;
+#ifdef _WIN32
+	HANDLE File_;
+	HANDLE Mapping_;
+#endif
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
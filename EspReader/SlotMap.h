@@ -0,0 +1,124 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <atomic>
+
+// Handle layout: low 32 bits = slot index, high 32 bits = generation.
+// 0 is never a valid handle.
+typedef uint64_t EspHandle;
+const EspHandle INVALID_ESP_HANDLE = 0;
+
+// Every SlotMap starts its generations at a different value, so a handle
+// from a map that was thrown away (e.g. by reloading the plugin) won't
+// accidentally match a slot in the new one.
+inline uint32_t NextSlotMapEpoch()
+{
+	static std::atomic<uint32_t> Epoch(1);
+	return Epoch.fetch_add(0x10000);
+}
+
+template<typename T>
+class SlotMap
+{
+private:
+	struct Slot
+	{
+		T Value;
+		uint32_t Generation;
+		bool Used;
+	};
+
+	std::vector<Slot> Slots_;
+	std::vector<uint32_t> FreeList_;
+	uint32_t Epoch_;
+
+	static EspHandle MakeHandle(uint32_t Index, uint32_t Generation)
+	{
+		return (static_cast<uint64_t>(Generation) << 32) | Index;
+	}
+
+	static uint32_t IndexOf(EspHandle Handle) { return static_cast<uint32_t>(Handle & 0xFFFFFFFF); }
+	static uint32_t GenerationOf(EspHandle Handle) { return static_cast<uint32_t>(Handle >> 32); }
+
+	const Slot* Find(EspHandle Handle) const
+	{
+		uint32_t Index = IndexOf(Handle);
+		if (Index >= Slots_.size())
+			return NULL;
+
+		const Slot& S = Slots_[Index];
+		if (!S.Used || S.Generation != GenerationOf(Handle))
+			return NULL;
+
+		return &S;
+	}
+
+public:
+	SlotMap() : Epoch_(NextSlotMapEpoch()) {}
+
+	EspHandle Insert(const T& Value)
+	{
+		uint32_t Index;
+		if (!FreeList_.empty())
+		{
+			Index = FreeList_.back();
+			FreeList_.pop_back();
+		}
+		else
+		{
+			Index = static_cast<uint32_t>(Slots_.size());
+			Slot S;
+			S.Generation = Epoch_;
+			S.Used = false;
+			Slots_.push_back(S);
+		}
+
+		Slot& S = Slots_[Index];
+		S.Value = Value;
+		S.Used = true;
+		return MakeHandle(Index, S.Generation);
+	}
+
+	bool Remove(EspHandle Handle)
+	{
+		if (!Find(Handle))
+			return false;
+
+		uint32_t Index = IndexOf(Handle);
+		Slot& S = Slots_[Index];
+		S.Used = false;
+
+		// Generation 0 is reserved so that handle 0 stays invalid.
+		if (++S.Generation == 0)
+			S.Generation = 1;
+
+		FreeList_.push_back(Index);
+		return true;
+	}
+
+	T* Get(EspHandle Handle)
+	{
+		return const_cast<T*>(static_cast<const SlotMap*>(this)->Get(Handle));
+	}
+
+	const T* Get(EspHandle Handle) const
+	{
+		const Slot* S = Find(Handle);
+		return S ? &S->Value : NULL;
+	}
+
+	bool IsValid(EspHandle Handle) const
+	{
+		return Find(Handle) != NULL;
+	}
+
+	size_t Size() const
+	{
+		return Slots_.size() - FreeList_.size();
+	}
+
+	void Reserve(size_t Count)
+	{
+		Slots_.reserve(Count);
+	}
+};
@@ -9,6 +9,10 @@
 #include <iostream>
 #include <algorithm>
 #include <cctype>
+#include <memory>
+#include "BsaArchive.h"
+#include "MappedFile.h"
+#include "StringsTable.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -17,12 +21,90 @@
 #include <dirent.h>
 #endif
 
+// Non-owning view of a string inside a loaded strings file.
+// Valid until the manager that returned it loads or clears its strings.
+struct StringView
+{
+    const char* data;
+    size_t size;
+
+    StringView() : data(NULL), size(0) {}
+    StringView(const char* d, size_t n) : data(d), size(n) {}
+
+    bool found() const { return data != NULL; }
+    std::string str() const { return data ? std::string(data, size) : std::string(); }
+};
+
 // Localized Strings Manager
+// Strings files are memory-mapped (or kept as the in-memory image they were
+// loaded from) and only their directories are indexed. Strings are decoded
+// when asked for, as views into the file. The three types are separate ID
+// spaces, so a lookup names the type it wants (see StringsFileTypeFor).
+//
+// Several languages of the same plugin can be held at once. Per type they
+// share one sorted StringID directory, and each language has a column of
+// slots parallel to it, so one binary search finds an ID in every language.
+// Language 0 is the current language; others are added with AddLanguage and
+// loaded the first time they are asked for.
 class StringsManager
 {
 private:
-    std::unordered_map<uint32_t, std::string> strings_;
-    std::string currentLanguage_;
+    // One loaded strings file
+    struct Table
+    {
+        MappedFile mapped;
+        std::vector<uint8_t> owned;
+        const uint8_t* data;   // string data block
+        uint32_t dataSize;
+    };
+
+    // A directory entry of a file being loaded
+    struct Entry
+    {
+        uint32_t id;
+        uint32_t offset;
+        uint32_t table;
+
+        bool operator<(const Entry& other) const { return id < other.id; }
+    };
+
+    // Where one language keeps the string of a directory ID
+    struct Slot
+    {
+        uint32_t table;   // noTable: not in this language
+        uint32_t offset;
+    };
+
+    // One language's files of one type. Tables are shared with the copies
+    // made by CopyCurrentLanguage.
+    struct Column
+    {
+        std::vector<std::shared_ptr<const Table> > tables;
+        std::vector<Slot> slots;   // parallel to ids_[type], empty until loaded
+        size_t count;
+
+        Column() : count(0) {}
+    };
+
+    struct Language
+    {
+        std::string name;
+        bool loaded;   // false: load on first use
+        Column columns[StringsTypeCount];
+
+        explicit Language(const std::string& n) : name(n), loaded(true) {}
+    };
+
+    static const uint32_t noTable = 0xFFFFFFFFu;
+
+    // Per type, so loading one type never touches another's tables.
+    // Each directory is the union of the IDs of all loaded languages.
+    std::vector<uint32_t> ids_[StringsTypeCount];
+    std::vector<std::unique_ptr<Language> > languages_;   // [0]: current language
+    // Where further languages are looked up: the plugin, and the archive the
+    // current language came from (empty: loose files or <Plugin>.bsa)
+    std::string espPath_;
+    std::string archivePath_;
 
     // Check if file exists (compatible with older C++)
     bool FileExists(const std::string& path) const
@@ -72,6 +154,7 @@ private:
         return result;
     }
 
+public:
     // Build string file path
     std::string BuildStringsPath(const std::string& espPath,
         const std::string& language,
@@ -97,88 +180,327 @@ private:
         return stringsPath;
     }
 
-    // Load a single .STRINGS file
-    bool LoadSingleStringsFile(const std::string& path)
+private:
+    // Load a single strings file into a language's column
+    bool LoadSingleStringsFile(const std::string& path, size_t language, StringsFileType type,
+        std::vector<Entry>& pending, std::ostream& log)
     {
-        std::ifstream file(path.c_str(), std::ios::binary);
-        if (!file.is_open())
+        std::unique_ptr<Table> table(new Table());
+        if (!table->mapped.Open(path))
         {
             std::cerr << "Failed to open strings file: " << path << "\n";
             return false;
         }
 
+        return AddTable(table, table->mapped.Data(), table->mapped.Size(), path, language, type, pending, log);
+    }
+
+    // Index a whole strings file image; name is only used for messages.
+    // Only the directory is read here; the strings are decoded on lookup.
+    // Its entries go to pending until FinishLoad merges them into the column.
+    bool AddTable(std::unique_ptr<Table>& table, const uint8_t* bytes, size_t size,
+        const std::string& name, size_t language, StringsFileType type,
+        std::vector<Entry>& pending, std::ostream& log)
+    {
         // Read file header
-        uint32_t count, dataSize;
-        file.read(reinterpret_cast<char*>(&count), 4);
-        file.read(reinterpret_cast<char*>(&dataSize), 4);
+        uint32_t count = 0, dataSize = 0;
+        if (size >= 8)
+        {
+            std::memcpy(&count, bytes, 4);
+            std::memcpy(&dataSize, bytes + 4, 4);
+        }
+
+        if (count == 0 || dataSize == 0)
+        {
+            std::cerr << "Invalid strings file header: " << name << "\n";
+            return false;
+        }
 
-        if (!file.good() || count == 0 || dataSize == 0)
+        // String directory (StringID + Offset pairs), then the string data
+        size_t dataStart = 8 + static_cast<size_t>(count) * 8;
+        if (dataStart + dataSize > size)
         {
-            std::cerr << "Invalid strings file header: " << path << "\n";
-            file.close();
+            std::cerr << "Failed to read string data: " << name << "\n";
             return false;
         }
 
-        // Read string directory (StringID + Offset pairs)
-        std::vector<std::pair<uint32_t, uint32_t> > directory;
-        directory.reserve(count);
+        table->data = bytes + dataStart;
+        table->dataSize = dataSize;
+
+        std::vector<std::shared_ptr<const Table> >& tables = languages_[language]->columns[type].tables;
+        const uint32_t tableIndex = static_cast<uint32_t>(tables.size());
+        size_t loadedCount = 0;
+        pending.reserve(pending.size() + count);
 
         for (uint32_t i = 0; i < count; ++i)
         {
-            uint32_t stringID, offset;
-            file.read(reinterpret_cast<char*>(&stringID), 4);
-            file.read(reinterpret_cast<char*>(&offset), 4);
+            Entry entry;
+            std::memcpy(&entry.id, bytes + 8 + i * 8, 4);
+            std::memcpy(&entry.offset, bytes + 12 + i * 8, 4);
+            entry.table = tableIndex;
+
+            if (entry.offset >= dataSize) continue;
+
+            pending.push_back(entry);
+            loadedCount++;
+        }
+
+        tables.push_back(std::shared_ptr<const Table>(std::move(table)));
+
+        log << "Loaded " << loadedCount << " strings from: " << name << "\n";
+        return true;
+    }
+
+    // Merge a language's pending entries into the type's directory, once all of
+    // its files of that type are in. A later file wins on duplicate IDs.
+    void FinishLoad(size_t language, StringsFileType type, std::vector<Entry>& pending)
+    {
+        std::stable_sort(pending.begin(), pending.end());
+
+        size_t out = 0;
+        for (size_t i = 0; i < pending.size(); ++i)
+        {
+            if (i + 1 < pending.size() && pending[i + 1].id == pending[i].id) continue;
+            pending[out++] = pending[i];
+        }
+        pending.resize(out);
+
+        // IDs new to the directory move the other languages' slots along
+        std::vector<uint32_t>& ids = ids_[type];
+        std::vector<uint32_t> merged;
+        merged.reserve(ids.size() + pending.size());
+
+        size_t a = 0, b = 0;
+        while (a < ids.size() || b < pending.size())
+        {
+            if (b == pending.size() || (a < ids.size() && ids[a] < pending[b].id))
+            {
+                merged.push_back(ids[a++]);
+            }
+            else if (a == ids.size() || pending[b].id < ids[a])
+            {
+                merged.push_back(pending[b++].id);
+            }
+            else
+            {
+                merged.push_back(ids[a]);
+                ++a;
+                ++b;
+            }
+        }
+
+        Slot missing = { noTable, 0 };
+
+        if (merged.size() != ids.size())
+        {
+            for (size_t l = 0; l < languages_.size(); ++l)
+            {
+                std::vector<Slot>& slots = languages_[l]->columns[type].slots;
+                if (slots.empty()) continue;
+
+                std::vector<Slot> moved(merged.size(), missing);
+                size_t j = 0;
+                for (size_t i = 0; i < ids.size(); ++i)
+                {
+                    while (merged[j] != ids[i]) ++j;
+                    moved[j] = slots[i];
+                }
+                slots.swap(moved);
+            }
+            ids.swap(merged);
+        }
+
+        Column& column = languages_[language]->columns[type];
+        column.slots.assign(ids.size(), missing);
+        column.count = pending.size();
+
+        size_t j = 0;
+        for (size_t i = 0; i < pending.size(); ++i)
+        {
+            while (ids[j] != pending[i].id) ++j;
+            column.slots[j].table = pending[i].table;
+            column.slots[j].offset = pending[i].offset;
+        }
+        pending.clear();
+    }
+
+    // Index of stringID in the type's directory, or -1
+    ptrdiff_t FindIndex(StringsFileType type, uint32_t stringID) const
+    {
+        const std::vector<uint32_t>& ids = ids_[type];
+        std::vector<uint32_t>::const_iterator it = std::lower_bound(ids.begin(), ids.end(), stringID);
+        if (it == ids.end() || *it != stringID)
+        {
+            return -1;
+        }
+        return it - ids.begin();
+    }
+
+    // Decode one language's string at a directory index. STRINGS entries are
+    // plain NUL-terminated text; DLSTRINGS and ILSTRINGS entries have a 4-byte
+    // length prefix.
+    bool Decode(size_t language, StringsFileType type, ptrdiff_t index, StringView& out) const
+    {
+        const Column& column = languages_[language]->columns[type];
+        if (index < 0 || static_cast<size_t>(index) >= column.slots.size()) return false;
+
+        const Slot& slot = column.slots[index];
+        if (slot.table == noTable) return false;
+
+        const Table& table = *column.tables[slot.table];
+
+        if (type == StringsTypeStrings)
+        {
+            const char* text = reinterpret_cast<const char*>(table.data + slot.offset);
+            const void* end = std::memchr(text, 0, table.dataSize - slot.offset);
+            if (!end) return false;
+
+            out = StringView(text, static_cast<const char*>(end) - text);
+            return true;
+        }
 
-            if (!file.good()) break;
+        if (static_cast<uint64_t>(slot.offset) + 4 > table.dataSize) return false;
 
-            directory.push_back(std::make_pair(stringID, offset));
+        uint32_t length;
+        std::memcpy(&length, table.data + slot.offset, 4);
+
+        if (static_cast<uint64_t>(slot.offset) + 4 + length > table.dataSize) return false;
+
+        // UTF-8 or Windows-1252
+        const char* text = reinterpret_cast<const char*>(table.data + slot.offset + 4);
+
+        // Remove null terminator
+        if (length > 0 && text[length - 1] == '\0')
+        {
+            length--;
         }
 
-        // Read all string data
-        std::vector<char> data(dataSize);
-        file.read(data.data(), dataSize);
-        file.close();
+        out = StringView(text, length);
+        return true;
+    }
+
+    // Strings\<Plugin>_<Language>.<type> inside an opened archive
+    bool LoadStringsFromArchive(BsaArchive& bsa, size_t language, StringsFileType type,
+        std::vector<Entry>& pending, std::ostream& log)
+    {
+        std::string entry = "strings\\" + GetBaseName(espPath_) + "_" + languages_[language]->name + "." + StringsFileExtension(type);
 
-        if (data.empty())
+        std::vector<uint8_t> bytes;
+        if (!bsa.Extract(entry, bytes))
         {
-            std::cerr << "Failed to read string data: " << path << "\n";
             return false;
         }
 
-        // Parse strings
-        size_t loadedCount = 0;
-        for (size_t i = 0; i < directory.size(); ++i)
+        log << "Found strings file in archive: " << entry << "\n";
+        std::unique_ptr<Table> table(new Table());
+        table->owned.swap(bytes);
+        return AddTable(table, table->owned.data(), table->owned.size(), entry, language, type, pending, log);
+    }
+
+    // The loose file of one type, else its entry in <Plugin>.bsa next to the
+    // plugin. The archive is opened on first use and shared between calls.
+    bool LoadStringsType(size_t language, StringsFileType type,
+        BsaArchive& bsa, bool& bsaOpened, std::ostream& log)
+    {
+        std::vector<Entry> pending;
+        bool loaded = false;
+
+        std::string stringsPath = BuildStringsPath(espPath_, languages_[language]->name, StringsFileExtension(type));
+
+        if (FileExists(stringsPath))
+        {
+            log << "Found strings file: " << stringsPath << "\n";
+            loaded = LoadSingleStringsFile(stringsPath, language, type, pending, log);
+        }
+        else
         {
-            uint32_t stringID = directory[i].first;
-            uint32_t offset = directory[i].second;
+            // Strings not shipped loose are looked up in the plugin's own archive
+            if (!bsaOpened)
+            {
+                bsaOpened = true;
+                std::string bsaPath = archivePath_;
+                if (bsaPath.empty())
+                {
+                    bsaPath = GetDirectory(espPath_);
+                    bsaPath += (bsaPath.empty() ? "" : "\\") + GetBaseName(espPath_) + ".bsa";
+                }
+                if (FileExists(bsaPath))
+                {
+                    bsa.Open(bsaPath);
+                }
+            }
 
-            if (offset >= dataSize) continue;
+            loaded = bsa.GetVersion() != 0 && LoadStringsFromArchive(bsa, language, type, pending, log);
+            if (!loaded)
+            {
+                log << "Strings file not found: " << stringsPath << "\n";
+            }
+        }
 
-            // Read length prefix (4 bytes)
-            uint32_t length;
-            std::memcpy(&length, data.data() + offset, 4);
+        FinishLoad(language, type, pending);
+        return loaded;
+    }
 
-            if (offset + 4 + length > dataSize) continue;
+    // All three types of one language, the way the current language was found
+    bool LoadLanguageFiles(size_t language, std::ostream& log)
+    {
+        Language& lang = *languages_[language];
+        lang.loaded = true;
 
-            // Extract string (UTF-8 or Windows-1252)
-            std::string str(data.data() + offset + 4, length);
+        if (espPath_.empty())
+        {
+            std::cerr << "No plugin to load " << lang.name << " strings for\n";
+            return false;
+        }
 
-            // Remove null terminator
-            if (!str.empty() && str[str.length() - 1] == '\0')
+        BsaArchive bsa;
+        bool bsaOpened = false;
+        if (!archivePath_.empty())
+        {
+            // Only the given archive, not loose files
+            bsaOpened = true;
+            if (!bsa.Open(archivePath_))
             {
-                str.resize(str.length() - 1);
+                std::cerr << "Failed to open archive: " << archivePath_ << "\n";
+                return false;
             }
+        }
 
-            strings_[stringID] = str;
-            loadedCount++;
+        bool loadedAny = false;
+        // Three types of strings files
+        for (int i = 0; i < StringsTypeCount; ++i)
+        {
+            StringsFileType type = static_cast<StringsFileType>(i);
+            lang.columns[type].tables.clear();
+            lang.columns[type].slots.clear();
+
+            bool loaded;
+            if (!archivePath_.empty())
+            {
+                std::vector<Entry> pending;
+                loaded = LoadStringsFromArchive(bsa, language, type, pending, log);
+                FinishLoad(language, type, pending);
+            }
+            else
+            {
+                loaded = LoadStringsType(language, type, bsa, bsaOpened, log);
+            }
+
+            if (loaded)
+            {
+                loadedAny = true;
+            }
         }
 
-        std::cout << "Loaded " << loadedCount << " strings from: " << path << "\n";
-        return true;
+        log << "Total " << lang.name << " strings loaded: " << GetStringCount(language) << "\n";
+        return loadedAny;
     }
 
 public:
-    StringsManager() : currentLanguage_("english") {}
+    StringsManager()
+    {
+        languages_.push_back(std::unique_ptr<Language>(new Language("english")));
+    }
 
     // Extract StringID from data (4-byte uint32_t)
     static uint32_t GetStringID(const uint8_t* data, size_t size)
@@ -192,72 +514,335 @@ public:
     // Load .STRINGS file
     // espPath: ESP file path, e.g., "C:/Data/3DNPC.esp"
     // language: language, e.g., "english", "chinese"
+    // Replaces every loaded language with this one.
     bool LoadStringsFile(const std::string& espPath, const std::string& language = "english")
     {
-        currentLanguage_ = language;
-        strings_.clear();
+        Reset(language, espPath);
+        return LoadLanguageFiles(0, std::cout);
+    }
+
+    // Load the strings of espPath from a .bsa, e.g. "Data/Mod - Strings.bsa".
+    // Replaces the current strings like LoadStringsFile. Languages added later
+    // are read from the same archive.
+    bool LoadStringsFromBsa(const std::string& bsaPath, const std::string& espPath, const std::string& language = "english")
+    {
+        Reset(language, espPath);
+        archivePath_ = bsaPath;
+        return LoadLanguageFiles(0, std::cout);
+    }
 
-        // Three types of strings files
-        std::vector<std::string> types;
-        types.push_back("STRINGS");
-        types.push_back("DLSTRINGS");
-        types.push_back("ILSTRINGS");
+    // Drop all languages and strings and start over with one language for
+    // espPath, to be filled by LoadStringsType.
+    void Reset(const std::string& language, const std::string& espPath = std::string())
+    {
+        Clear();
+        languages_[0]->name = language;
+        espPath_ = espPath;
+    }
+
+    // Load the current language's strings file of one type like LoadStringsFile
+    // does, replacing only that type. Only that type's tables are touched, so
+    // after Reset the three types may be loaded on separate threads, each with
+    // its own log.
+    bool LoadStringsType(StringsFileType type, std::ostream& log)
+    {
+        Column& column = languages_[0]->columns[type];
+        column.tables.clear();
+        column.slots.clear();
+
+        BsaArchive bsa;
+        bool bsaOpened = false;
+        return LoadStringsType(0, type, bsa, bsaOpened, log);
+    }
+
+    // Copy the strings files that are mapped into memory and unmap them, so
+    // the files can be replaced. Copies made earlier keep their mappings.
+    void ReleaseMappings()
+    {
+        for (size_t l = 0; l < languages_.size(); ++l)
+        {
+            for (int i = 0; i < StringsTypeCount; ++i)
+            {
+                std::vector<std::shared_ptr<const Table> >& tables = languages_[l]->columns[i].tables;
+                for (size_t t = 0; t < tables.size(); ++t)
+                {
+                    const Table& mapped = *tables[t];
+                    if (!mapped.mapped.Data()) continue;
+
+                    std::unique_ptr<Table> table(new Table());
+                    table->owned.assign(mapped.mapped.Data(), mapped.mapped.Data() + mapped.mapped.Size());
+                    table->data = table->owned.data() + (mapped.data - mapped.mapped.Data());
+                    table->dataSize = mapped.dataSize;
+                    tables[t] = std::shared_ptr<const Table>(std::move(table));
+                }
+            }
+        }
+    }
+
+    // A copy of the current language that later loads, swaps and clears of
+    // this manager leave alone. The strings files are shared, not copied.
+    std::shared_ptr<const StringsManager> CopyCurrentLanguage() const
+    {
+        std::shared_ptr<StringsManager> copy = std::make_shared<StringsManager>();
+        for (int i = 0; i < StringsTypeCount; ++i)
+        {
+            copy->ids_[i] = ids_[i];
+        }
+        *copy->languages_[0] = *languages_[0];
+        copy->espPath_ = espPath_;
+        copy->archivePath_ = archivePath_;
+        return copy;
+    }
+
+    // Exchange all loaded languages and strings with other.
+    void Swap(StringsManager& other)
+    {
+        for (int i = 0; i < StringsTypeCount; ++i)
+        {
+            ids_[i].swap(other.ids_[i]);
+        }
+        languages_.swap(other.languages_);
+        espPath_.swap(other.espPath_);
+        archivePath_.swap(other.archivePath_);
+    }
+
+    // Load strings files that are already in memory, e.g. inflated from an archive.
+    // Replaces the current strings like LoadStringsFile. Empty images are skipped.
+    // files is indexed by StringsFileType; the images are taken over (files is
+    // left empty), not copied. Further languages cannot be added afterwards.
+    bool LoadStringsFromMemory(std::vector<std::vector<uint8_t> >& files,
+        const std::vector<std::string>& names, const std::string& language)
+    {
+        Reset(language);
 
         bool loadedAny = false;
-        for (size_t i = 0; i < types.size(); ++i)
+        for (size_t i = 0; i < StringsTypeCount; ++i)
         {
-            std::string stringsPath = BuildStringsPath(espPath, language, types[i]);
+            StringsFileType type = static_cast<StringsFileType>(i);
+            std::vector<Entry> pending;
 
-            if (FileExists(stringsPath))
+            if (i < files.size() && !files[i].empty())
             {
-                std::cout << "Found strings file: " << stringsPath << "\n";
-                if (LoadSingleStringsFile(stringsPath))
+                std::unique_ptr<Table> table(new Table());
+                table->owned.swap(files[i]);
+
+                const std::string& name = i < names.size() ? names[i] : std::string();
+                if (AddTable(table, table->owned.data(), table->owned.size(), name, 0, type, pending, std::cout))
                 {
                     loadedAny = true;
                 }
             }
-            else
+
+            FinishLoad(0, type, pending);
+        }
+        files.clear();
+
+        std::cout << "Total strings loaded: " << GetStringCount() << "\n";
+        return loadedAny;
+    }
+
+    // Add a language of the same plugin, next to the current one. Nothing is
+    // read until one of its strings is asked for (or LoadLanguage is called).
+    // Returns its index for GetStringViews; an existing language keeps its index.
+    size_t AddLanguage(const std::string& language)
+    {
+        for (size_t i = 0; i < languages_.size(); ++i)
+        {
+            if (languages_[i]->name == language)
             {
-                std::cout << "Strings file not found: " << stringsPath << "\n";
+                return i;
             }
         }
 
-        std::cout << "Total strings loaded: " << strings_.size() << "\n";
-        return loadedAny;
+        languages_.push_back(std::unique_ptr<Language>(new Language(language)));
+        languages_.back()->loaded = false;
+        return languages_.size() - 1;
     }
 
-    // Get string by ID
-    std::string GetString(uint32_t stringID) const
+    // Read an added language now rather than on first use
+    bool LoadLanguage(size_t language)
     {
-        std::unordered_map<uint32_t, std::string>::const_iterator it = strings_.find(stringID);
-        if (it != strings_.end())
+        if (language >= languages_.size()) return false;
+        if (!languages_[language]->loaded)
         {
-            return it->second;
+            LoadLanguageFiles(language, std::cout);
         }
-        return "";
+        return GetStringCount(language) > 0;
+    }
+
+    size_t GetLanguageCount() const
+    {
+        return languages_.size();
+    }
+
+    const std::string& GetLanguageName(size_t language) const
+    {
+        return languages_[language]->name;
+    }
+
+    // One StringID in the first count languages (count <= GetLanguageCount()),
+    // with a single directory lookup. Languages not read yet are loaded first.
+    // out[i] is the view for language i, !found() where it has no such string.
+    // Returns how many languages have it.
+    size_t GetStringViews(StringsFileType type, uint32_t stringID, StringView* out, size_t count)
+    {
+        if (count > languages_.size()) count = languages_.size();
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!languages_[i]->loaded)
+            {
+                LoadLanguageFiles(i, std::cout);
+            }
+        }
+
+        ptrdiff_t index = FindIndex(type, stringID);
+        size_t found = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            out[i] = StringView();
+            if (index >= 0 && Decode(i, type, index, out[i]))
+            {
+                found++;
+            }
+        }
+        return found;
+    }
+
+    // The same for any list of languages: out[i] is the view for languages[i],
+    // and only the listed languages are loaded. Indices past GetLanguageCount()
+    // are left !found().
+    size_t GetStringViews(StringsFileType type, uint32_t stringID, const size_t* languages, StringView* out, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (languages[i] < languages_.size() && !languages_[languages[i]]->loaded)
+            {
+                LoadLanguageFiles(languages[i], std::cout);
+            }
+        }
+
+        ptrdiff_t index = FindIndex(type, stringID);
+        size_t found = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            out[i] = StringView();
+            if (index >= 0 && languages[i] < languages_.size() && Decode(languages[i], type, index, out[i]))
+            {
+                found++;
+            }
+        }
+        return found;
+    }
+
+    // Get string by ID from one table of a loaded language, as a view into the
+    // strings file (not found: !found())
+    StringView GetStringView(size_t language, StringsFileType type, uint32_t stringID) const
+    {
+        StringView view;
+        if (language < languages_.size() && Decode(language, type, FindIndex(type, stringID), view))
+        {
+            return view;
+        }
+        return StringView();
+    }
+
+    // Get string by ID from one table of the current language
+    StringView GetStringView(StringsFileType type, uint32_t stringID) const
+    {
+        return GetStringView(0, type, stringID);
+    }
+
+    // Get string by ID when the caller does not know the type: the first
+    // table that has it, in STRINGS, DLSTRINGS, ILSTRINGS order
+    StringView GetStringView(uint32_t stringID) const
+    {
+        for (int i = 0; i < StringsTypeCount; ++i)
+        {
+            StringView view = GetStringView(static_cast<StringsFileType>(i), stringID);
+            if (view.found())
+            {
+                return view;
+            }
+        }
+        return StringView();
+    }
+
+    // Get string by ID (copy)
+    std::string GetString(StringsFileType type, uint32_t stringID) const
+    {
+        return GetStringView(type, stringID).str();
+    }
+
+    std::string GetString(uint32_t stringID) const
+    {
+        return GetStringView(stringID).str();
     }
 
     // Check if StringID exists
+    bool HasString(StringsFileType type, uint32_t stringID) const
+    {
+        return GetStringView(type, stringID).found();
+    }
+
     bool HasString(uint32_t stringID) const
     {
-        return strings_.count(stringID) > 0;
+        return GetStringView(stringID).found();
+    }
+
+    // Copy every string of one type of the current language into out, e.g.
+    // to write the strings files back wherever they were loaded from.
+    void CopyStrings(StringsFileType type, StringsTable& out) const
+    {
+        const std::vector<uint32_t>& ids = ids_[type];
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            StringView view;
+            if (Decode(0, type, static_cast<ptrdiff_t>(i), view))
+            {
+                out.Set(ids[i], view.str());
+            }
+        }
+    }
+
+    // Get string count of the current language
+    size_t GetStringCount(StringsFileType type) const
+    {
+        return languages_[0]->columns[type].count;
     }
 
-    // Get string count
     size_t GetStringCount() const
     {
-        return strings_.size();
+        return GetStringCount(0);
     }
 
-    // Clear all strings
+    size_t GetStringCount(size_t language) const
+    {
+        size_t count = 0;
+        for (int i = 0; i < StringsTypeCount; ++i)
+        {
+            count += languages_[language]->columns[i].count;
+        }
+        return count;
+    }
+
+    // Clear all strings, and every language but the current one
     void Clear()
     {
-        strings_.clear();
+        for (int i = 0; i < StringsTypeCount; ++i)
+        {
+            ids_[i].clear();
+        }
+        languages_.resize(1);
+
+        const std::string name = languages_[0]->name;
+        languages_[0].reset(new Language(name));
+        archivePath_.clear();
     }
 
     // Get current language
     std::string GetCurrentLanguage() const
     {
-        return currentLanguage_;
+        return languages_[0]->name;
     }
 };
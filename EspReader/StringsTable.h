@@ -0,0 +1,219 @@
+#pragma once
+#include <fstream>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+// The three localized string files of a plugin.
+// .STRINGS entries are NUL-terminated; .DLSTRINGS and .ILSTRINGS entries
+// start with a 4-byte length that includes the terminating NUL.
+enum StringsFileType
+{
+	StringsTypeStrings = 0,
+	StringsTypeDLStrings = 1,
+	StringsTypeILStrings = 2,
+	StringsTypeCount = 3
+};
+
+inline const char* StringsFileExtension(StringsFileType Type)
+{
+	switch (Type)
+	{
+	case StringsTypeDLStrings: return "DLSTRINGS";
+	case StringsTypeILStrings: return "ILSTRINGS";
+	default: return "STRINGS";
+	}
+}
+
+// Which file a localized subrecord's text lives in.
+inline StringsFileType StringsFileTypeFor(const std::string& RecordSig, const std::string& SubSig)
+{
+	if (RecordSig == "INFO" && SubSig == "NAM1")
+		return StringsTypeILStrings;
+
+	if (SubSig == "DESC" || (RecordSig == "QUST" && SubSig == "CNAM") || (RecordSig == "BOOK" && SubSig == "CNAM"))
+		return StringsTypeDLStrings;
+
+	return StringsTypeStrings;
+}
+
+// One string table, kept sorted by StringID.
+class StringsTable
+{
+public:
+	explicit StringsTable(StringsFileType Type = StringsTypeStrings) : Type_(Type) {}
+
+	StringsFileType GetType() const
+	{
+		return Type_;
+	}
+
+	bool Load(const std::string& Path)
+	{
+		std::ifstream File(Path.c_str(), std::ios::binary);
+		if (!File.is_open())
+			return false;
+
+		File.seekg(0, std::ios::end);
+		std::vector<char> Bytes(static_cast<size_t>(File.tellg()));
+		File.seekg(0, std::ios::beg);
+		if (!File.read(Bytes.data(), Bytes.size()))
+			return false;
+
+		return Parse(reinterpret_cast<const uint8_t*>(Bytes.data()), Bytes.size());
+	}
+
+	bool Parse(const uint8_t* Bytes, size_t Size)
+	{
+		if (Size < 8)
+			return false;
+
+		uint32_t Count, DataSize;
+		std::memcpy(&Count, Bytes, 4);
+		std::memcpy(&DataSize, Bytes + 4, 4);
+
+		uint64_t DataStart = 8 + static_cast<uint64_t>(Count) * 8;
+		if (DataStart + DataSize > Size)
+			return false;
+
+		const uint8_t* Data = Bytes + DataStart;
+
+		for (uint32_t i = 0; i < Count; ++i)
+		{
+			uint32_t ID, Offset;
+			std::memcpy(&ID, Bytes + 8 + i * 8, 4);
+			std::memcpy(&Offset, Bytes + 12 + i * 8, 4);
+
+			std::string Text;
+			if (DecodeEntry(Data, DataSize, Offset, Text))
+			{
+				Entries_[ID] = Text;
+			}
+		}
+		return true;
+	}
+
+	void Set(uint32_t ID, const std::string& Text)
+	{
+		Entries_[ID] = Text;
+	}
+
+	const std::string* Find(uint32_t ID) const
+	{
+		std::map<uint32_t, std::string>::const_iterator It = Entries_.find(ID);
+		return It != Entries_.end() ? &It->second : NULL;
+	}
+
+	uint32_t MaxID() const
+	{
+		return Entries_.empty() ? 0 : Entries_.rbegin()->first;
+	}
+
+	size_t Size() const
+	{
+		return Entries_.size();
+	}
+
+	// File image: header, directory sorted by StringID, then the string data
+	// in directory order. Identical strings are stored once and shared.
+	std::vector<uint8_t> Serialize() const
+	{
+		std::vector<std::pair<uint32_t, uint32_t> > Directory;
+		Directory.reserve(Entries_.size());
+
+		std::vector<uint8_t> Data;
+		std::unordered_map<std::string, uint32_t> Offsets;
+
+		for (std::map<uint32_t, std::string>::const_iterator It = Entries_.begin(); It != Entries_.end(); ++It)
+		{
+			std::unordered_map<std::string, uint32_t>::const_iterator Seen = Offsets.find(It->second);
+			if (Seen != Offsets.end())
+			{
+				Directory.push_back(std::make_pair(It->first, Seen->second));
+				continue;
+			}
+
+			uint32_t Offset = static_cast<uint32_t>(Data.size());
+			Offsets[It->second] = Offset;
+			Directory.push_back(std::make_pair(It->first, Offset));
+
+			if (Type_ != StringsTypeStrings)
+			{
+				uint32_t Length = static_cast<uint32_t>(It->second.size() + 1);
+				Data.insert(Data.end(), reinterpret_cast<const uint8_t*>(&Length), reinterpret_cast<const uint8_t*>(&Length) + 4);
+			}
+			Data.insert(Data.end(), It->second.begin(), It->second.end());
+			Data.push_back(0);
+		}
+
+		uint32_t Count = static_cast<uint32_t>(Directory.size());
+		uint32_t DataSize = static_cast<uint32_t>(Data.size());
+
+		std::vector<uint8_t> Image(8 + Directory.size() * 8 + Data.size());
+		std::memcpy(Image.data(), &Count, 4);
+		std::memcpy(Image.data() + 4, &DataSize, 4);
+
+		for (size_t i = 0; i < Directory.size(); ++i)
+		{
+			std::memcpy(Image.data() + 8 + i * 8, &Directory[i].first, 4);
+			std::memcpy(Image.data() + 12 + i * 8, &Directory[i].second, 4);
+		}
+
+		if (!Data.empty())
+		{
+			std::memcpy(Image.data() + 8 + Directory.size() * 8, Data.data(), Data.size());
+		}
+		return Image;
+	}
+
+	bool Save(const std::string& Path) const
+	{
+		std::vector<uint8_t> Image = Serialize();
+
+		std::ofstream File(Path.c_str(), std::ios::binary);
+		if (!File.is_open())
+			return false;
+
+		File.write(reinterpret_cast<const char*>(Image.data()), Image.size());
+		return File.good();
+	}
+
+private:
+	StringsFileType Type_;
+	std::map<uint32_t, std::string> Entries_;
+
+	bool DecodeEntry(const uint8_t* Data, uint32_t DataSize, uint32_t Offset, std::string& Text) const
+	{
+		if (Offset >= DataSize)
+			return false;
+
+		if (Type_ == StringsTypeStrings)
+		{
+			const uint8_t* Begin = Data + Offset;
+			const uint8_t* End = static_cast<const uint8_t*>(std::memchr(Begin, 0, DataSize - Offset));
+			if (!End)
+				return false;
+
+			Text.assign(reinterpret_cast<const char*>(Begin), End - Begin);
+			return true;
+		}
+
+		if (Offset + 4 > DataSize)
+			return false;
+
+		uint32_t Length;
+		std::memcpy(&Length, Data + Offset, 4);
+		if (static_cast<uint64_t>(Offset) + 4 + Length > DataSize)
+			return false;
+
+		Text.assign(reinterpret_cast<const char*>(Data + Offset + 4), Length);
+		if (!Text.empty() && Text[Text.size() - 1] == '\0')
+		{
+			Text.resize(Text.size() - 1);
+		}
+		return true;
+	}
+};
@@ -0,0 +1,463 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <iostream>
+#include "MappedFile.h"
+#include "EspRecord.h"
+
+// Source text -> translation, reused across plugins.
+//
+// The table file is mapped and never written in place. It is an open-addressing
+// hash table keyed by the hash of the normalized source text:
+//   Header  "SLTM", Version, SlotCount (power of two), EntryCount   (uint32 each)
+//   Slot    KeyHash (uint64, 0 = empty), EntryOffset (uint64, from file start)
+//   Entry   SourceSize, TargetSize (uint32), normalized source, target
+// Add appends entries in the same Entry layout to <Path>.log and keeps them in
+// memory. Compact rewrites the table with both and empties the journal; run in
+// the background, lookups and adds carry on meanwhile. Compact and Close are
+// called from one thread; everything else may be called from any.
+class TranslationMemory
+{
+public:
+	TranslationMemory() : Journal_(NULL), SlotCount_(0), TableCount_(0) {}
+
+	~TranslationMemory()
+	{
+		Close();
+	}
+
+	// A missing table is an empty memory; the first Compact creates it.
+	bool Open(const std::string& Path)
+	{
+		Close();
+
+		std::lock_guard<std::mutex> Guard(Lock_);
+		Path_ = Path;
+		MapTable();
+		ReplayJournal();
+
+		Journal_ = std::fopen((Path_ + ".log").c_str(), "ab");
+		return Journal_ != NULL;
+	}
+
+	void Close()
+	{
+		WaitForCompaction();
+
+		std::lock_guard<std::mutex> Guard(Lock_);
+		if (Journal_)
+		{
+			std::fclose(Journal_);
+			Journal_ = NULL;
+		}
+		Table_.Close();
+		SlotCount_ = 0;
+		TableCount_ = 0;
+		Pending_.clear();
+		Path_.clear();
+	}
+
+	// Later additions for the same source replace earlier ones.
+	bool Add(const std::string& Source, const std::string& Target)
+	{
+		std::string Key = Normalize(Source);
+		if (Key.empty())
+			return false;
+
+		std::lock_guard<std::mutex> Guard(Lock_);
+		if (!Journal_ || !WriteEntry(Journal_, Key, Target) || std::fflush(Journal_) != 0)
+			return false;
+
+		Pending_[Key] = Target;
+		return true;
+	}
+
+	bool Lookup(const std::string& Source, std::string& Target)
+	{
+		std::string Key = Normalize(Source);
+
+		std::lock_guard<std::mutex> Guard(Lock_);
+		return Find(Key, Target);
+	}
+
+	// Looks up every source under one lock. Hits[i] is 1 when Targets[i] was found.
+	size_t LookupBatch(const std::vector<std::string>& Sources, std::vector<std::string>& Targets, std::vector<char>& Hits)
+	{
+		Targets.assign(Sources.size(), std::string());
+		Hits.assign(Sources.size(), 0);
+
+		size_t Found = 0;
+		std::lock_guard<std::mutex> Guard(Lock_);
+		for (size_t i = 0; i < Sources.size(); ++i)
+		{
+			if (Find(Normalize(Sources[i]), Targets[i]))
+			{
+				Hits[i] = 1;
+				Found++;
+			}
+		}
+		return Found;
+	}
+
+	// Entries in the table plus entries added since; a source re-added since the
+	// last compaction counts twice.
+	size_t GetCount()
+	{
+		std::lock_guard<std::mutex> Guard(Lock_);
+		return TableCount_ + Pending_.size();
+	}
+
+	// Rewrites the table with every entry and empties the journal. Entries added
+	// while a background rewrite runs stay in the journal for the next one.
+	bool Compact(bool Background)
+	{
+		WaitForCompaction();
+
+		std::shared_ptr<std::vector<std::pair<std::string, std::string> > > Added(new std::vector<std::pair<std::string, std::string> >());
+		{
+			std::lock_guard<std::mutex> Guard(Lock_);
+			if (Path_.empty())
+				return false;
+
+			if (Journal_)
+				std::fflush(Journal_);
+
+			Added->assign(Pending_.begin(), Pending_.end());
+		}
+
+		if (!Background)
+			return Rebuild(*Added);
+
+		// Only a compaction remaps the table, so the rewrite can read it unlocked.
+		Worker_ = std::thread([this, Added]() { Rebuild(*Added); });
+		return true;
+	}
+
+	void WaitForCompaction()
+	{
+		if (Worker_.joinable())
+			Worker_.join();
+	}
+
+	// Keys ignore leading and trailing whitespace and treat any run of
+	// whitespace inside the text as one space.
+	static std::string Normalize(const std::string& Text)
+	{
+		std::string Key;
+		Key.reserve(Text.size());
+
+		bool Space = false;
+		for (size_t i = 0; i < Text.size(); ++i)
+		{
+			const char C = Text[i];
+			if (C == ' ' || C == '\t' || C == '\r' || C == '\n')
+			{
+				Space = !Key.empty();
+				continue;
+			}
+
+			if (Space)
+			{
+				Key += ' ';
+				Space = false;
+			}
+			Key += C;
+		}
+		return Key;
+	}
+
+	static uint64_t HashKey(const std::string& Key)
+	{
+		const uint64_t Hash = Fnv1a(FNV1A_BASIS, Key.data(), Key.size());
+		return Hash ? Hash : 1;
+	}
+
+private:
+	enum
+	{
+		HeaderSize = 16,
+		SlotSize = 16,
+		Version = 1
+	};
+
+	std::mutex Lock_;
+	std::string Path_;
+	FILE* Journal_;
+	MappedFile Table_;
+	size_t SlotCount_;
+	size_t TableCount_;
+	std::unordered_map<std::string, std::string> Pending_;
+	std::thread Worker_;
+
+	TranslationMemory(const TranslationMemory&);
+	TranslationMemory& operator=(const TranslationMemory&);
+
+	// Under Lock_.
+	bool Find(const std::string& Key, std::string& Target) const
+	{
+		if (Key.empty())
+			return false;
+
+		std::unordered_map<std::string, std::string>::const_iterator It = Pending_.find(Key);
+		if (It != Pending_.end())
+		{
+			Target = It->second;
+			return true;
+		}
+
+		const uint8_t* Source;
+		uint32_t SourceSize;
+		const uint8_t* Text;
+		uint32_t TextSize;
+
+		const uint64_t Hash = HashKey(Key);
+		const size_t Mask = SlotCount_ - 1;
+		for (size_t Probe = 0, i = Hash & Mask; Probe < SlotCount_; ++Probe, i = (i + 1) & Mask)
+		{
+			uint64_t SlotHash;
+			uint64_t Offset;
+			ReadSlot(i, SlotHash, Offset);
+
+			if (SlotHash == 0)
+				return false;
+
+			if (SlotHash == Hash && ReadEntry(Offset, Source, SourceSize, Text, TextSize)
+				&& SourceSize == Key.size() && std::memcmp(Source, Key.data(), SourceSize) == 0)
+			{
+				Target.assign(reinterpret_cast<const char*>(Text), TextSize);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void ReadSlot(size_t Index, uint64_t& Hash, uint64_t& Offset) const
+	{
+		const uint8_t* Slot = Table_.Data() + HeaderSize + Index * SlotSize;
+		std::memcpy(&Hash, Slot, 8);
+		std::memcpy(&Offset, Slot + 8, 8);
+	}
+
+	bool ReadEntry(uint64_t Offset, const uint8_t*& Source, uint32_t& SourceSize, const uint8_t*& Target, uint32_t& TargetSize) const
+	{
+		const size_t Size = Table_.Size();
+		if (Offset > Size || Size - Offset < 8)
+			return false;
+
+		const uint8_t* Entry = Table_.Data() + Offset;
+		std::memcpy(&SourceSize, Entry, 4);
+		std::memcpy(&TargetSize, Entry + 4, 4);
+		if (static_cast<uint64_t>(SourceSize) + TargetSize > Size - Offset - 8)
+			return false;
+
+		Source = Entry + 8;
+		Target = Source + SourceSize;
+		return true;
+	}
+
+	// Under Lock_. A table that does not check out is dropped with a warning.
+	void MapTable()
+	{
+		Table_.Close();
+		SlotCount_ = 0;
+		TableCount_ = 0;
+
+		if (!Table_.Open(Path_))
+			return;
+
+		const uint8_t* Data = Table_.Data();
+		uint32_t FileVersion = 0, SlotCount = 0, Count = 0;
+		if (Table_.Size() >= HeaderSize)
+		{
+			std::memcpy(&FileVersion, Data + 4, 4);
+			std::memcpy(&SlotCount, Data + 8, 4);
+			std::memcpy(&Count, Data + 12, 4);
+		}
+
+		if (Table_.Size() < HeaderSize || std::memcmp(Data, "SLTM", 4) != 0 || FileVersion != Version
+			|| SlotCount == 0 || (SlotCount & (SlotCount - 1)) != 0
+			|| static_cast<uint64_t>(SlotCount) * SlotSize > Table_.Size() - HeaderSize)
+		{
+			std::cerr << "[Warn] Not a translation memory table: " << Path_ << "\n";
+			Table_.Close();
+			return;
+		}
+
+		SlotCount_ = SlotCount;
+		TableCount_ = Count;
+	}
+
+	// Under Lock_. A torn last entry is ignored.
+	void ReplayJournal()
+	{
+		FILE* F = std::fopen((Path_ + ".log").c_str(), "rb");
+		if (!F)
+			return;
+
+		uint32_t Sizes[2];
+		std::string Key, Target;
+		while (std::fread(Sizes, 4, 2, F) == 2)
+		{
+			Key.resize(Sizes[0]);
+			Target.resize(Sizes[1]);
+			if ((Sizes[0] && std::fread(&Key[0], 1, Sizes[0], F) != Sizes[0])
+				|| (Sizes[1] && std::fread(&Target[0], 1, Sizes[1], F) != Sizes[1]))
+				break;
+
+			Pending_[Key] = Target;
+		}
+		std::fclose(F);
+	}
+
+	static bool WriteEntry(FILE* F, const std::string& Key, const std::string& Target)
+	{
+		const uint32_t Sizes[2] = { static_cast<uint32_t>(Key.size()), static_cast<uint32_t>(Target.size()) };
+		return std::fwrite(Sizes, 4, 2, F) == 2
+			&& std::fwrite(Key.data(), 1, Key.size(), F) == Key.size()
+			&& std::fwrite(Target.data(), 1, Target.size(), F) == Target.size();
+	}
+
+	// Writes <Path>.tmp from the mapped table and Added, then swaps it in.
+	bool Rebuild(const std::vector<std::pair<std::string, std::string> >& Added)
+	{
+		std::unordered_map<std::string, size_t> AddedIndex;
+		for (size_t i = 0; i < Added.size(); ++i)
+		{
+			AddedIndex[Added[i].first] = i;
+		}
+
+		// Table entries a journal entry replaces are dropped.
+		std::vector<uint64_t> Kept;
+		for (size_t i = 0; i < SlotCount_; ++i)
+		{
+			uint64_t Hash, Offset;
+			const uint8_t* Source;
+			const uint8_t* Target;
+			uint32_t SourceSize, TargetSize;
+			ReadSlot(i, Hash, Offset);
+
+			if (Hash != 0 && ReadEntry(Offset, Source, SourceSize, Target, TargetSize)
+				&& !AddedIndex.count(std::string(reinterpret_cast<const char*>(Source), SourceSize)))
+			{
+				Kept.push_back(Offset);
+			}
+		}
+
+		const size_t Count = Kept.size() + Added.size();
+		size_t SlotCount = 16;
+		while (SlotCount < Count * 2)
+		{
+			SlotCount *= 2;
+		}
+
+		const std::string TempPath = Path_ + ".tmp";
+		FILE* F = std::fopen(TempPath.c_str(), "wb");
+		if (!F)
+			return false;
+
+		// Entries go after the slots. The header and slots are written empty
+		// first, so the entries follow without a seek, and rewritten once all
+		// offsets are known.
+		std::vector<uint64_t> Slots(SlotCount * 2, 0);
+		uint32_t Header[4] = { 0, 0, 0, 0 };
+		uint64_t Offset = HeaderSize + static_cast<uint64_t>(SlotCount) * SlotSize;
+		bool Ok = std::fwrite(Header, 4, 4, F) == 4
+			&& std::fwrite(Slots.data(), 8, Slots.size(), F) == Slots.size();
+
+		size_t Written = 0;
+		for (size_t i = 0; Ok && i < Count; ++i)
+		{
+			std::string Key, Target;
+			if (i < Kept.size())
+			{
+				const uint8_t* SourceData;
+				const uint8_t* TargetData;
+				uint32_t SourceSize, TargetSize;
+				if (!ReadEntry(Kept[i], SourceData, SourceSize, TargetData, TargetSize))
+					continue;
+
+				Key.assign(reinterpret_cast<const char*>(SourceData), SourceSize);
+				Target.assign(reinterpret_cast<const char*>(TargetData), TargetSize);
+			}
+			else
+			{
+				Key = Added[i - Kept.size()].first;
+				Target = Added[i - Kept.size()].second;
+			}
+
+			const uint64_t Hash = HashKey(Key);
+			size_t Slot = Hash & (SlotCount - 1);
+			while (Slots[Slot * 2] != 0)
+			{
+				Slot = (Slot + 1) & (SlotCount - 1);
+			}
+			Slots[Slot * 2] = Hash;
+			Slots[Slot * 2 + 1] = Offset;
+
+			Ok = WriteEntry(F, Key, Target);
+			Offset += 8 + Key.size() + Target.size();
+			Written++;
+		}
+
+		std::memcpy(Header, "SLTM", 4);
+		Header[1] = Version;
+		Header[2] = static_cast<uint32_t>(SlotCount);
+		Header[3] = static_cast<uint32_t>(Written);
+		Ok = Ok && std::fseek(F, 0, SEEK_SET) == 0
+			&& std::fwrite(Header, 4, 4, F) == 4
+			&& std::fwrite(Slots.data(), 8, Slots.size(), F) == Slots.size();
+		Ok = std::fclose(F) == 0 && Ok;
+
+		if (!Ok)
+		{
+			std::remove(TempPath.c_str());
+			return false;
+		}
+
+		std::lock_guard<std::mutex> Guard(Lock_);
+
+		// A mapped file cannot be replaced on Windows.
+		Table_.Close();
+#ifdef _WIN32
+		Ok = MoveFileExA(TempPath.c_str(), Path_.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		Ok = std::rename(TempPath.c_str(), Path_.c_str()) == 0;
+#endif
+		MapTable();
+
+		if (!Ok)
+		{
+			std::remove(TempPath.c_str());
+			return false;
+		}
+
+		// What was added during the rewrite stays pending.
+		for (size_t i = 0; i < Added.size(); ++i)
+		{
+			std::unordered_map<std::string, std::string>::iterator It = Pending_.find(Added[i].first);
+			if (It != Pending_.end() && It->second == Added[i].second)
+			{
+				Pending_.erase(It);
+			}
+		}
+
+		if (Journal_)
+			std::fclose(Journal_);
+
+		Journal_ = std::fopen((Path_ + ".log").c_str(), "wb");
+		for (std::unordered_map<std::string, std::string>::const_iterator It = Pending_.begin(); Journal_ && It != Pending_.end(); ++It)
+		{
+			WriteEntry(Journal_, It->first, It->second);
+		}
+		if (Journal_)
+			std::fflush(Journal_);
+		return true;
+	}
+};
@@ -0,0 +1,172 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cctype>
+#include "miniz.h"
+
+// Read-only view of a mod archive. Only the central directory is read on
+// Open; an entry is inflated into memory when it is extracted.
+class ZipArchive
+{
+public:
+	ZipArchive() : File_(NULL), IsOpen_(false)
+	{
+		std::memset(&Zip_, 0, sizeof(Zip_));
+	}
+
+	~ZipArchive()
+	{
+		Close();
+	}
+
+	bool Open(const wchar_t* Path)
+	{
+		Close();
+
+		File_ = _wfopen(Path, L"rb");
+		if (!File_)
+			return false;
+
+		IsOpen_ = mz_zip_reader_init_cfile(&Zip_, File_, 0, 0) != 0;
+		if (!IsOpen_)
+		{
+			Close();
+			return false;
+		}
+
+		Entries_.clear();
+		mz_uint Count = mz_zip_reader_get_num_files(&Zip_);
+		for (mz_uint i = 0; i < Count; ++i)
+		{
+			mz_zip_archive_file_stat Stat;
+			if (!mz_zip_reader_file_stat(&Zip_, i, &Stat) || Stat.m_is_directory)
+				continue;
+
+			Entry E;
+			E.Index = i;
+			E.Size = Stat.m_uncomp_size;
+			E.Key = NormalizePath(Stat.m_filename);
+			Entries_.push_back(E);
+		}
+		return true;
+	}
+
+	void Close()
+	{
+		if (IsOpen_)
+		{
+			mz_zip_reader_end(&Zip_);
+			IsOpen_ = false;
+		}
+		if (File_)
+		{
+			fclose(File_);
+			File_ = NULL;
+		}
+		std::memset(&Zip_, 0, sizeof(Zip_));
+	}
+
+	// The entry whose file name is PluginName, case-insensitive, in any folder.
+	// With no name, the first .esp, .esm or .esl. Returns the entry path or "".
+	std::string FindPlugin(const char* PluginName) const
+	{
+		std::string Wanted = PluginName ? NormalizePath(PluginName) : std::string();
+
+		for (size_t i = 0; i < Entries_.size(); ++i)
+		{
+			const std::string& Key = Entries_[i].Key;
+			std::string Name = FileName(Key);
+
+			if (!Wanted.empty())
+			{
+				if (Name == FileName(Wanted))
+					return Key;
+				continue;
+			}
+
+			if (EndsWith(Name, ".esp") || EndsWith(Name, ".esm") || EndsWith(Name, ".esl"))
+				return Key;
+		}
+		return "";
+	}
+
+	// Strings\<Plugin>_<Language>.<Extension> next to the plugin entry.
+	std::string FindStrings(const std::string& PluginEntry, const std::string& Language, const char* Extension) const
+	{
+		std::string Name = FileName(PluginEntry);
+		size_t Dot = Name.find_last_of('.');
+		if (Dot != std::string::npos)
+		{
+			Name.resize(Dot);
+		}
+
+		std::string Wanted = PluginEntry.substr(0, PluginEntry.size() - FileName(PluginEntry).size())
+			+ "strings\\" + Name + "_" + NormalizePath(Language) + "." + NormalizePath(Extension);
+
+		return Find(Wanted) ? Wanted : "";
+	}
+
+	// Inflates one entry into Out, which is resized to the entry's size.
+	bool Extract(const std::string& EntryPath, std::vector<uint8_t>& Out)
+	{
+		const Entry* E = Find(EntryPath);
+		if (!E)
+			return false;
+
+		Out.resize(static_cast<size_t>(E->Size));
+		return mz_zip_reader_extract_to_mem(&Zip_, E->Index, Out.data(), Out.size(), 0) != 0;
+	}
+
+private:
+	struct Entry
+	{
+		mz_uint Index;
+		mz_uint64 Size;
+		std::string Key; // lower case, backslash separated
+	};
+
+	mz_zip_archive Zip_;
+	FILE* File_;
+	bool IsOpen_;
+	std::vector<Entry> Entries_;
+
+	ZipArchive(const ZipArchive&);
+	ZipArchive& operator=(const ZipArchive&);
+
+	const Entry* Find(const std::string& Key) const
+	{
+		for (size_t i = 0; i < Entries_.size(); ++i)
+		{
+			if (Entries_[i].Key == Key)
+				return &Entries_[i];
+		}
+		return NULL;
+	}
+
+	static std::string NormalizePath(const std::string& Path)
+	{
+		std::string Key = Path;
+		for (size_t i = 0; i < Key.size(); ++i)
+		{
+			if (Key[i] == '/') Key[i] = '\\';
+			Key[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(Key[i])));
+		}
+		return Key;
+	}
+
+	static std::string FileName(const std::string& Key)
+	{
+		size_t Slash = Key.find_last_of('\\');
+		return Slash == std::string::npos ? Key : Key.substr(Slash + 1);
+	}
+
+	static bool EndsWith(const std::string& Text, const char* Suffix)
+	{
+		size_t Length = std::strlen(Suffix);
+		return Text.size() >= Length && Text.compare(Text.size() - Length, Length, Suffix) == 0;
+	}
+};